@@ -0,0 +1,1606 @@
+#include <time.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+
+// Heap allocations made by the tree are counted,
+// see descent benchmark.
+unsigned long bench_allocs = 0;
+
+void* bench_malloc(size_t size) {
+    bench_allocs++;
+    return malloc(size);
+}
+
+void* bench_calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return calloc(n, size);
+}
+
+void* bench_realloc(void* ptr, size_t size) {
+    bench_allocs++;
+    return realloc(ptr, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(ptr, size) bench_realloc(ptr, size)
+
+#include "btree.c"
+
+// Benchmarks
+//
+// Run all benchmarks:        ./bin/bench_btree
+// Run selected benchmarks:   ./bin/bench_btree alloc_policy ...
+//////////////////////////////////////////////////////////////////////
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+u32 bench_rand() {
+    static u32 state = 2463534242;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+void bench_shuffle(u32* arr, u32 n) {
+    for (u32 i = n - 1; i > 0; i--) {
+        u32 j = bench_rand() % (i + 1);
+        u32 tmp = arr[i];
+        arr[i] = arr[j];
+        arr[j] = tmp;
+    }
+}
+
+// Page sizes used by benchmarks that compare page sizes.
+u32 bench_page_sizes[] = { 512, 4096, 16384, 65536, 262144 };
+#define BENCH_PAGE_SIZES (sizeof(bench_page_sizes) / sizeof(u32))
+
+u32* bench_keys(u32 n, int shuffled) {
+    u32* keys = malloc(n * sizeof(u32));
+    for (u32 i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    if (shuffled) {
+        bench_shuffle(keys, n);
+    }
+    return keys;
+}
+
+// Allocation policy: churn workload
+// Tree is loaded with keys that have random value sizes and
+// then values of random keys are overwritten with values of random size.
+//////////////////////////////////////////////////////////////////////
+
+void bench_alloc_policy() {
+    const char* names[] = { "first-fit", "best-fit", "size-class" };
+    BTAllocPolicy policies[] = { FirstFit, BestFit, SizeClassFit };
+    u32 n = 200000;
+    u32 ops = 2000000;
+    u32 max_value_size = MAX_PAYLOAD_SIZE - sizeof(u32);
+    char value[MAX_PAYLOAD_SIZE] = { 0 };
+
+    printf("== alloc_policy: %u keys, %u overwrites, value size 1..%u\n", n, ops, max_value_size);
+    printf("%-12s %12s %16s %10s\n", "policy", "ns/op", "defrags/1k ops", "pages");
+
+    for (int p = 0; p < 3; p++) {
+        BTreeConfig config = { .alloc_policy = policies[p] };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        u32* keys = bench_keys(n, 1);
+
+        for (u32 i = 0; i < n; i++) {
+            btree_insert(btree, &keys[i], sizeof(u32), value, 1 + bench_rand() % max_value_size);
+        }
+
+        defrag_counter = 0;
+        double start = now();
+        for (u32 i = 0; i < ops; i++) {
+            u32 key = keys[bench_rand() % n];
+            btree_insert(btree, &key, sizeof(u32), value, 1 + bench_rand() % max_value_size);
+        }
+        double elapsed = now() - start;
+
+        printf("%-12s %12.1f %16.2f %10u\n",
+            names[p], elapsed * 1e9 / ops, defrag_counter * 1000.0 / ops, page_counter);
+
+        free(keys);
+        btree_destroy(btree);
+        reset_buffer();
+    }
+}
+
+// Defragmentation cost
+// Page is filled to 75% with 32 byte payloads and then given
+// fraction of cells is overwritten with smaller payload, leaving
+// one free block behind each of them.
+//////////////////////////////////////////////////////////////////////
+
+void bench_defrag_page(u32 page_size) {
+    int fragmentation[] = { 0, 10, 25, 50, 100 };
+    char value[32] = { 0 };
+    char* saved = malloc(page_size);
+
+    for (int f = 0; f < 5; f++) {
+        BTreeConfig config = { .alloc_policy = FirstFit, .page_size = page_size };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        BTPage* page = buffer[btree->root_page_id];
+
+        u32 cells = 0;
+        while (page->hdr->freespace > page_data_size(page_size) / 4) {
+            int rc = page_leaf_insert(page, &cells, sizeof(u32), value, sizeof(value) - sizeof(u32));
+            assert(rc == Ok);
+            cells++;
+        }
+
+        if (fragmentation[f] > 0) {
+            u32 step = 100 / fragmentation[f];
+            for (u32 key = 0; key < cells; key += step) {
+                int rc = page_leaf_insert(page, &key, sizeof(u32), value, 12);
+                assert(rc == Ok);
+            }
+        }
+
+        u32 freeblocks = page->hdr->freeblock_count;
+        memcpy(saved, page->pdata, page_size);
+
+        int iters = 2000000 / cells;
+        double start = now();
+        for (int i = 0; i < iters; i++) {
+            memcpy(page->pdata, saved, page_size);
+            page_reload(page);
+        }
+        double baseline = now() - start;
+
+        start = now();
+        for (int i = 0; i < iters; i++) {
+            memcpy(page->pdata, saved, page_size);
+            page_reload(page);
+            page_defragment(page, NULL);
+        }
+        double elapsed = now() - start - baseline;
+
+        printf("%10u %13d%% %8u %12u %14.1f\n",
+            page_size, fragmentation[f], cells, freeblocks, elapsed * 1e9 / iters);
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+
+    free(saved);
+}
+
+void bench_defrag() {
+    printf("== defrag\n");
+    printf("%10s %14s %8s %12s %14s\n", "page size", "fragmentation", "cells", "freeblocks", "ns/defrag");
+    for (u32 p = 0; p < BENCH_PAGE_SIZES; p++) {
+        bench_defrag_page(bench_page_sizes[p]);
+    }
+}
+
+// In-page search with and without key hints
+// Lookups go to random pages of a set that is larger then L2 cache
+// so that key dereferences are mostly cache misses.
+//////////////////////////////////////////////////////////////////////
+
+// Binary keys are 10 decimal digits of scrambled key number.
+u32 bench_key(char* key, u32 i, int binary) {
+    if (binary) {
+        return sprintf(key, "%010u", i * 2654435761u);
+    }
+    memcpy(key, &i, sizeof(u32));
+    return sizeof(u32);
+}
+
+int bench_fill_page(BTPage* page, u32 cells, int binary) {
+    char key[16];
+    for (u32 i = 0; i < cells; i++) {
+        u32 key_size = bench_key(key, i, binary);
+        if (page->hdr->freespace < key_size + sizeof(u32) + PAGE_CELL_PTR_SIZE) {
+            return NotEnoughSpace;
+        }
+        int rc = page_leaf_insert(page, key, key_size, &i, sizeof(u32));
+        assert(rc == Ok);
+    }
+    return Ok;
+}
+
+void bench_page_search_page(u32 page_size) {
+    u32 cell_counts[] = { 64, 256, 1024 };
+    const char* key_types[] = { "u32", "binary" };
+    u32 lookups = 4000000;
+
+    for (int binary = 0; binary < 2; binary++) {
+        for (int c = 0; c < 3; c++) {
+            u32 cells = cell_counts[c];
+            u32 npages = (8 << 20) / page_size;
+            double ns[2];
+            int fits = 1;
+
+            for (int hinted = 0; hinted < 2 && fits; hinted++) {
+                BTreeConfig config = { .alloc_policy = FirstFit, .page_size = page_size };
+                if (binary) {
+                    config.hint = hinted ? hint_binary : NULL;
+                } else {
+                    config.hint = hinted ? hint_integers : NULL;
+                }
+                BTree* btree = btree_new_with_config(binary ? binary_collation : compare_integers, &config);
+
+                BTPage** pages = malloc(npages * sizeof(BTPage*));
+                for (u32 p = 0; p < npages && fits; p++) {
+                    pages[p] = page_new(btree);
+                    pages[p]->hdr->is_leaf = 1;
+                    fits = bench_fill_page(pages[p], cells, binary) == Ok;
+                }
+
+                if (fits) {
+                    char keys[cells][16];
+                    u32 key_sizes[cells];
+                    for (u32 k = 0; k < cells; k++) {
+                        key_sizes[k] = bench_key(keys[k], k, binary);
+                    }
+
+                    u32 found = 0;
+                    double start = now();
+                    for (u32 i = 0; i < lookups; i++) {
+                        BTPage* page = pages[bench_rand() % npages];
+                        u32 k = bench_rand() % cells;
+                        found += page_find_cell(page, keys[k], key_sizes[k]) != -1;
+                    }
+                    ns[hinted] = (now() - start) * 1e9 / lookups;
+                    assert(found == lookups);
+                }
+
+                free(pages);
+                btree_destroy(btree);
+                reset_buffer();
+            }
+
+            if (fits) {
+                printf("%10u %-8s %8u %8u %14.1f %14.1f\n",
+                    page_size, key_types[binary], cells, npages, ns[0], ns[1]);
+            } else {
+                printf("%10u %-8s %8u %8s %14s %14s\n",
+                    page_size, key_types[binary], cells, "-", "page too small", "");
+            }
+        }
+    }
+}
+
+void bench_page_search() {
+    printf("== page_search\n");
+    printf("%10s %-8s %8s %8s %14s %14s\n", "page size", "keys", "cells", "pages", "no hint ns/op", "hint ns/op");
+    for (u32 p = 0; p < BENCH_PAGE_SIZES; p++) {
+        bench_page_search_page(bench_page_sizes[p]);
+    }
+}
+
+// Hint search kernels
+// Each page is modelled by its cell pointer array, page holds
+// records with 24 byte payload. Working set is 8 MB of cell pointers.
+//////////////////////////////////////////////////////////////////////
+
+void bench_hint_search() {
+    const char* names[] = { "binary", "branchless", "sse4.2", "blocked sse4.2", "avx2", "blocked avx2" };
+    BTHintLowerBound kernels[] = {
+        hint_lower_bound_binary,
+        hint_lower_bound_branchless,
+#ifdef HINT_SIMD
+        hint_lower_bound_sse42,
+        hint_lower_bound_blocked_sse42,
+        hint_lower_bound_avx2,
+        hint_lower_bound_blocked_avx2,
+#endif
+    };
+    int nkernels = sizeof(kernels) / sizeof(BTHintLowerBound);
+#ifdef HINT_SIMD
+    if (!__builtin_cpu_supports("avx2")) {
+        nkernels = 4;
+    }
+    if (!__builtin_cpu_supports("sse4.2")) {
+        nkernels = 2;
+    }
+#endif
+
+    u32 page_sizes[] = { 4096, 16384, 65536, 262144 };
+    u32 lookups = 4000000;
+
+    printf("== hint_search: ns per lower bound\n");
+    printf("%-16s", "kernel");
+    for (int p = 0; p < 4; p++) {
+        char label[32];
+        sprintf(label, "%uK/%u", page_sizes[p] / 1024, page_sizes[p] / (24 + PAGE_CELL_PTR_SIZE));
+        printf(" %14s", label);
+    }
+    printf("\n");
+
+    double results[6][4];
+    for (int p = 0; p < 4; p++) {
+        u16 cells = page_sizes[p] / (24 + PAGE_CELL_PTR_SIZE);
+        u32 npages = (8 << 20) / (cells * sizeof(BTCellPtr));
+        BTCellPtr* arr = malloc((size_t)npages * cells * sizeof(BTCellPtr));
+        for (u32 i = 0; i < npages * cells; i++) {
+            arr[i].key_hint = (i % cells) * 16;
+        }
+
+        for (int k = 0; k < nkernels; k++) {
+            u32 checksum = 0;
+            double start = now();
+            for (u32 i = 0; i < lookups; i++) {
+                BTCellPtr* page = arr + (size_t)(bench_rand() % npages) * cells;
+                checksum += kernels[k](page, cells, bench_rand() % (cells * 16));
+            }
+            results[k][p] = (now() - start) * 1e9 / lookups;
+            assert(checksum > 0);
+        }
+        free(arr);
+    }
+
+    for (int k = 0; k < nkernels; k++) {
+        printf("%-16s", names[k]);
+        for (int p = 0; p < 4; p++) {
+            printf(" %14.1f", results[k][p]);
+        }
+        printf("\n");
+    }
+}
+
+// Page size: get/put/scan throughput
+// Tree is loaded with random keys and 16 byte values (put), then
+// random keys are looked up (get) and the whole tree is read in
+// key order (scan). Scan walks the leaves with a cursor.
+//////////////////////////////////////////////////////////////////////
+
+u32 bench_scan(BTree* btree, u64* checksum) {
+    BTCursor cursor;
+    u32 n = 0;
+    for (bool ok = btree_cursor_seek(&cursor, btree, NULL, 0); ok; ok = btree_cursor_next(&cursor)) {
+        *checksum += *(u32*)btree_cursor_value(&cursor).data;
+        n++;
+    }
+    btree_cursor_close(&cursor);
+    return n;
+}
+
+void bench_page_size() {
+    u32 n = 1000000;
+    u32 scans = 10;
+    char value[16] = { 0 };
+
+    printf("== page_size: %u keys, %zu byte values\n", n, sizeof(value));
+    printf("%10s %10s %14s %14s %14s\n", "page size", "pages", "put Mops/s", "get Mops/s", "scan Mkeys/s");
+
+    for (u32 p = 0; p < BENCH_PAGE_SIZES; p++) {
+        BTreeConfig config = {
+            .alloc_policy = FirstFit, .hint = hint_integers, .page_size = bench_page_sizes[p]
+        };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        u32* keys = bench_keys(n, 1);
+
+        double start = now();
+        for (u32 i = 0; i < n; i++) {
+            memcpy(value, &keys[i], sizeof(u32));
+            btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+        }
+        double put = now() - start;
+
+        bench_shuffle(keys, n);
+        u64 checksum = 0;
+        start = now();
+        for (u32 i = 0; i < n; i++) {
+            Value v = btree_get(btree, &keys[i], sizeof(u32));
+            checksum += *(u32*)v.data;
+        }
+        double get = now() - start;
+
+        u32 scanned = 0;
+        start = now();
+        for (u32 i = 0; i < scans; i++) {
+            scanned += bench_scan(btree, &checksum);
+        }
+        double scan = now() - start;
+        assert(scanned == n * scans);
+        assert(checksum > 0);
+
+        printf("%10u %10u %14.2f %14.2f %14.2f\n",
+            bench_page_sizes[p], page_counter, n / put / 1e6, n / get / 1e6, scanned / scan / 1e6);
+
+        free(keys);
+        btree_destroy(btree);
+        reset_buffer();
+    }
+}
+
+// Slot format: small records
+// 8 byte keys with 16 byte values, keys are compared as binary
+// strings. Wide slots use key hints, compact slots can't.
+//////////////////////////////////////////////////////////////////////
+
+void bench_slot_key(char* key, u32 i) {
+    u32 hi = i * 2654435761u;
+    for (int b = 0; b < 4; b++) {
+        key[b] = hi >> (24 - 8 * b);
+        key[4 + b] = i >> (24 - 8 * b);
+    }
+}
+
+void bench_slot_format() {
+    const char* names[] = { "wide", "compact" };
+    BTSlotFormat formats[] = { WideSlots, CompactSlots };
+    u32 page_sizes[] = { 4096, 16384 };
+    u32 n = 1000000;
+    char value[16] = { 0 };
+
+    printf("== slot_format: %u keys, 8 byte keys, %zu byte values\n", n, sizeof(value));
+    printf("%10s %-8s %10s %12s %12s %12s\n", "page size", "format", "leaves", "cells/leaf", "put ns/op", "get ns/op");
+
+    for (int p = 0; p < 2; p++) {
+        for (int f = 0; f < 2; f++) {
+            BTreeConfig config = {
+                .alloc_policy = FirstFit,
+                .hint = hint_binary,
+                .page_size = page_sizes[p],
+                .slot_format = formats[f]
+            };
+            BTree* btree = btree_new_with_config(&binary_collation, &config);
+            u32* keys = bench_keys(n, 1);
+            char key[8];
+
+            double start = now();
+            for (u32 i = 0; i < n; i++) {
+                bench_slot_key(key, keys[i]);
+                btree_insert(btree, key, sizeof(key), value, sizeof(value));
+            }
+            double put = now() - start;
+
+            bench_shuffle(keys, n);
+            u32 found = 0;
+            start = now();
+            for (u32 i = 0; i < n; i++) {
+                bench_slot_key(key, keys[i]);
+                found += btree_get(btree, key, sizeof(key)).data != NULL;
+            }
+            double get = now() - start;
+            assert(found == n);
+
+            u32 leaves = 0;
+            for (u32 pid = 0; pid < page_counter; pid++) {
+                leaves += buffer[pid]->hdr->is_leaf;
+            }
+
+            printf("%10u %-8s %10u %12.1f %12.1f %12.1f\n",
+                page_sizes[p], names[f], leaves, (double)n / leaves, put * 1e9 / n, get * 1e9 / n);
+
+            free(keys);
+            btree_destroy(btree);
+            reset_buffer();
+        }
+    }
+}
+
+// Delete: one by one vs batch
+// Half of the keys is deleted in random order, either one key
+// at a time or marked in a batch and reclaimed at commit.
+//////////////////////////////////////////////////////////////////////
+
+void bench_delete() {
+    const char* names[] = { "single", "batch" };
+    u32 page_sizes[] = { 4096, 65536 };
+    u32 n = 1000000;
+    char value[16] = { 0 };
+
+    printf("== delete: %u keys, %u deleted, %zu byte values\n", n, n / 2, sizeof(value));
+    printf("%10s %-8s %14s\n", "page size", "mode", "ns/delete");
+
+    for (int p = 0; p < 2; p++) {
+        for (int batched = 0; batched < 2; batched++) {
+            BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = page_sizes[p] };
+            BTree* btree = btree_new_with_config(&compare_integers, &config);
+            u32* keys = bench_keys(n, 1);
+            for (u32 i = 0; i < n; i++) {
+                btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+            }
+            bench_shuffle(keys, n);
+
+            double start = now();
+            if (batched) {
+                BTDeleteBatch batch;
+                btree_delete_batch_begin(btree, &batch);
+                for (u32 i = 0; i < n / 2; i++) {
+                    btree_delete_batch_add(&batch, &keys[i], sizeof(u32));
+                }
+                btree_delete_batch_commit(&batch);
+            } else {
+                for (u32 i = 0; i < n / 2; i++) {
+                    btree_delete(btree, &keys[i], sizeof(u32));
+                }
+            }
+            double elapsed = now() - start;
+            assert(btree_get(btree, &keys[0], sizeof(u32)).data == NULL);
+
+            printf("%10u %-8s %14.1f\n", page_sizes[p], names[batched], elapsed * 1e9 / (n / 2));
+
+            free(keys);
+            btree_destroy(btree);
+            reset_buffer();
+        }
+    }
+}
+
+// Bulk load vs inserts of sorted input
+//////////////////////////////////////////////////////////////////////
+
+typedef struct BenchBulkInput {
+    u32 i;
+    u32 n;
+    char value[16];
+} BenchBulkInput;
+
+bool bench_bulk_next(void* ctx, Value* key, Value* value) {
+    BenchBulkInput* input = ctx;
+    if (input->i == input->n) {
+        return false;
+    }
+    memcpy(input->value, &input->i, sizeof(u32));
+    key->data = &input->i;
+    key->size = sizeof(u32);
+    value->data = input->value;
+    value->size = sizeof(input->value);
+    input->i++;
+    return true;
+}
+
+// Best of two runs, first run after a large tree was freed
+// is slowed down by the allocator.
+void bench_bulk_load() {
+    u32 n = 5000000;
+    u32 page_size = 4096;
+
+    printf("== bulk_load: %u sorted keys, 16 byte values, page size %u\n", n, page_size);
+    printf("%-16s %10s %12s %10s\n", "method", "ns/key", "leaves", "speedup");
+
+    double insert_ns = 0;
+    for (int m = 0; m < 3; m++) {
+        u32 fill_factor = m == 1 ? 100 : 90;
+        double best = 0;
+        u32 leaves = 0;
+
+        for (int run = 0; run < 2; run++) {
+            BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = page_size };
+            BTree* btree = btree_new_with_config(&compare_integers, &config);
+            BenchBulkInput input = { .i = 0, .n = n };
+
+            double start = now();
+            if (m == 0) {
+                Value key, value;
+                while (bench_bulk_next(&input, &key, &value)) {
+                    btree_insert(btree, key.data, key.size, value.data, value.size);
+                }
+            } else {
+                BTBulkIterator it = { .next = bench_bulk_next, .ctx = &input };
+                btree_bulk_load(btree, &it, fill_factor);
+            }
+            double ns = (now() - start) * 1e9 / n;
+            if (run == 0 || ns < best) {
+                best = ns;
+            }
+
+            leaves = 0;
+            for (u32 pid = 0; pid < page_counter; pid++) {
+                leaves += buffer[pid]->hdr->is_leaf;
+            }
+
+            btree_destroy(btree);
+            reset_buffer();
+        }
+
+        if (m == 0) {
+            insert_ns = best;
+        }
+
+        char method[32];
+        if (m == 0) {
+            sprintf(method, "insert");
+        } else {
+            sprintf(method, "bulk load %u%%", fill_factor);
+        }
+        printf("%-16s %10.1f %12u %9.1fx\n", method, best, leaves, insert_ns / best);
+    }
+}
+
+// Range scan: lookups vs cursor
+// Tree is loaded with dense random keys, ranges of consecutive keys
+// are read either by a lookup per key or by a cursor going
+// forward or backward.
+//////////////////////////////////////////////////////////////////////
+
+void bench_range_scan() {
+    const char* names[] = { "get per key", "cursor", "cursor prev" };
+    u32 range_sizes[] = { 10, 100, 1000 };
+    u32 n = 1000000;
+    u32 rows = 10000000;
+    char value[16] = { 0 };
+
+    printf("== range_scan: %u keys, %zu byte values, page size 4096\n", n, sizeof(value));
+    printf("%10s %-12s %12s\n", "range", "method", "ns/row");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    u32* keys = bench_keys(n, 1);
+    for (u32 i = 0; i < n; i++) {
+        memcpy(value, &keys[i], sizeof(u32));
+        btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+    }
+
+    for (int r = 0; r < 3; r++) {
+        u32 range = range_sizes[r];
+        for (int m = 0; m < 3; m++) {
+            u64 checksum = 0;
+            double start = now();
+            for (u32 q = 0; q < rows / range; q++) {
+                u32 from = keys[q % n] % (n - range);
+                if (m == 0) {
+                    for (u32 key = from; key < from + range; key++) {
+                        checksum += *(u32*)btree_get(btree, &key, sizeof(u32)).data;
+                    }
+                } else if (m == 1) {
+                    BTCursor cursor;
+                    btree_cursor_seek(&cursor, btree, &from, sizeof(u32));
+                    for (u32 i = 0; i < range; i++) {
+                        checksum += *(u32*)btree_cursor_value(&cursor).data;
+                        btree_cursor_next(&cursor);
+                    }
+                    btree_cursor_close(&cursor);
+                } else {
+                    BTCursor cursor;
+                    u32 to = from + range - 1;
+                    btree_cursor_seek_for_prev(&cursor, btree, &to, sizeof(u32));
+                    for (u32 i = 0; i < range; i++) {
+                        checksum += *(u32*)btree_cursor_value(&cursor).data;
+                        btree_cursor_prev(&cursor);
+                    }
+                    btree_cursor_close(&cursor);
+                }
+            }
+            double elapsed = now() - start;
+            assert(checksum > 0);
+
+            printf("%10u %-12s %12.1f\n", range, names[m], elapsed * 1e9 / (rows / range * range));
+        }
+    }
+
+    free(keys);
+    btree_destroy(btree);
+    reset_buffer();
+}
+
+// Underflow: tree after random deletes
+// Tree is loaded with random keys and half of them is deleted in
+// random order (with different merge thresholds), then it is compared
+// with a tree built from the keys that are left.
+//////////////////////////////////////////////////////////////////////
+
+void bench_underflow_report(const char* name, BTree* btree, u32 n) {
+    u32 scans = 10;
+    u32 leaves = 0;
+    u32 pages = 0;
+    for (u32 pid = 0; pid < page_counter; pid++) {
+        if (buffer[pid] != NULL) {
+            leaves += buffer[pid]->hdr->is_leaf;
+            pages++;
+        }
+    }
+
+    u64 checksum = 0;
+    u32 scanned = 0;
+    double start = now();
+    for (u32 i = 0; i < scans; i++) {
+        scanned += bench_scan(btree, &checksum);
+    }
+    double scan = now() - start;
+    assert(scanned == n * scans);
+
+    printf("%-16s %10u %10u %10u %12.1f %12.2f\n",
+        name, n, pages, leaves, (double)n / leaves, scanned / scan / 1e6);
+}
+
+void bench_underflow() {
+    u32 thresholds[] = { 25, 40, 45 };
+    u32 n = 1000000;
+    char value[16] = { 0 };
+
+    printf("== underflow: %u keys, %u deleted, %zu byte values, page size 4096\n", n, n / 2, sizeof(value));
+    printf("%-16s %10s %10s %10s %12s %12s\n", "tree", "keys", "pages", "leaves", "cells/leaf", "scan Mkeys/s");
+
+    u32* keys = bench_keys(n, 1);
+    double delete_ns[3];
+    for (int t = 0; t < 3; t++) {
+        BTreeConfig config = {
+            .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096, .merge_threshold = thresholds[t]
+        };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        for (u32 i = 0; i < n; i++) {
+            memcpy(value, &keys[i], sizeof(u32));
+            btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+        }
+        if (t == 0) {
+            bench_underflow_report("loaded", btree, n);
+        }
+
+        double start = now();
+        for (u32 i = 0; i < n / 2; i++) {
+            btree_delete(btree, &keys[i], sizeof(u32));
+        }
+        delete_ns[t] = (now() - start) * 1e9 / (n / 2);
+
+        char name[32];
+        sprintf(name, "deleted, %u%%", thresholds[t]);
+        bench_underflow_report(name, btree, n - n / 2);
+        btree_destroy(btree);
+        reset_buffer();
+    }
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    for (u32 i = n / 2; i < n; i++) {
+        memcpy(value, &keys[i], sizeof(u32));
+        btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+    }
+    bench_underflow_report("rebuilt", btree, n - n / 2);
+    btree_destroy(btree);
+    reset_buffer();
+
+    for (int t = 0; t < 3; t++) {
+        printf("delete, threshold %u%%: %.1f ns/op\n", thresholds[t], delete_ns[t]);
+    }
+    free(keys);
+}
+
+// Free list: churn
+// Half of the keys is deleted and inserted back with values of new
+// random size (some of them in overflow pages) in each round.
+// Freed pages are reused, so page space and frame count stay flat.
+//////////////////////////////////////////////////////////////////////
+
+void bench_freelist() {
+    u32 n = 200000;
+    u32 rounds = 6;
+    u32 max_value_size = 8192;
+    char* value = calloc(1, max_value_size);
+
+    printf("== freelist: %u keys, values up to %u bytes, page size 4096\n", n, max_value_size);
+    printf("%6s %12s %12s %12s %12s\n", "round", "page space", "frames", "free pages", "ns/op");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    u32* keys = bench_keys(n, 1);
+
+    for (u32 round = 0; round < rounds; round++) {
+        double start = now();
+        u32 ops = 0;
+        if (round > 0) {
+            bench_shuffle(keys, n);
+            for (u32 i = 0; i < n / 2; i++) {
+                btree_delete(btree, &keys[i], sizeof(u32));
+            }
+            ops += n / 2;
+        }
+        u32 from = round == 0 ? 0 : n / 2;
+        for (u32 i = 0; i < n - from; i++) {
+            u32 size = 16 + bench_rand() % 64;
+            if (bench_rand() % 16 == 0) {
+                size = bench_rand() % max_value_size;
+            }
+            btree_insert(btree, &keys[i], sizeof(u32), value, size);
+        }
+        ops += n - from;
+        double elapsed = now() - start;
+
+        u32 frames = 0;
+        for (u32 pid = 0; pid < page_counter; pid++) {
+            frames += buffer[pid] != NULL;
+        }
+        printf("%6u %12u %12u %12u %12.1f\n",
+            round, page_counter, frames, btree_free_page_count(btree), elapsed * 1e9 / ops);
+    }
+
+    free(value);
+    free(keys);
+    btree_destroy(btree);
+    reset_buffer();
+}
+
+// Descent: heap allocations per operation
+// Random keys are inserted, looked up and deleted. Only page
+// splits may allocate, lookups and deletes shouldn't.
+//////////////////////////////////////////////////////////////////////
+
+void bench_descent() {
+    const char* names[] = { "insert", "get", "seek", "delete" };
+    u32 n = 1000000;
+    char value[16] = { 0 };
+
+    printf("== descent: %u keys, %zu byte values, page size 4096\n", n, sizeof(value));
+    printf("%-8s %12s %12s\n", "op", "ns/op", "allocs/op");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    u32* keys = bench_keys(n, 1);
+
+    for (int op = 0; op < 4; op++) {
+        bench_shuffle(keys, n);
+        u64 checksum = 0;
+        unsigned long allocs = bench_allocs;
+        double start = now();
+        for (u32 i = 0; i < n; i++) {
+            if (op == 0) {
+                btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+            } else if (op == 1) {
+                checksum += btree_get(btree, &keys[i], sizeof(u32)).size;
+            } else if (op == 2) {
+                BTCursor cursor;
+                checksum += btree_cursor_seek(&cursor, btree, &keys[i], sizeof(u32));
+                btree_cursor_close(&cursor);
+            } else {
+                btree_delete(btree, &keys[i], sizeof(u32));
+            }
+        }
+        double elapsed = now() - start;
+        assert(op == 0 || op == 3 || checksum > 0);
+
+        printf("%-8s %12.1f %12.3f\n", names[op], elapsed * 1e9 / n, (double)(bench_allocs - allocs) / n);
+    }
+
+    free(keys);
+    btree_destroy(btree);
+    reset_buffer();
+}
+
+// Finger: key streams with different locality
+// Sequential inserts into empty tree, then lookups of sequential,
+// Zipfian (skew 0.99, hot keys are the most recently written ones)
+// and uniform keys, with and without finger.
+//////////////////////////////////////////////////////////////////////
+
+// Fill 'out' with Zipfian ranks in [0, n).
+void bench_zipf(u32* out, u32 count, u32 n, double skew) {
+    double* cdf = malloc(n * sizeof(double));
+    double sum = 0;
+    for (u32 i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, skew);
+        cdf[i] = sum;
+    }
+    for (u32 i = 0; i < count; i++) {
+        double r = (double)bench_rand() / UINT32_MAX * sum;
+        u32 lo = 0, hi = n - 1;
+        while (lo < hi) {
+            u32 mid = (lo + hi) / 2;
+            if (cdf[mid] < r) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        out[i] = lo;
+    }
+    free(cdf);
+}
+
+void bench_finger() {
+    const char* streams[] = { "seq insert", "seq get", "zipf get", "uniform get" };
+    u32 n = 1000000;
+    u32 ops = 2000000;
+    char value[16] = { 0 };
+
+    printf("== finger: %u keys, %u lookups, %zu byte values, page size 4096\n", n, ops, sizeof(value));
+    printf("%-12s %12s %12s %10s %10s\n", "stream", "off ns/op", "on ns/op", "speedup", "hit rate");
+
+    u32* keys[4];
+    keys[0] = bench_keys(n, 0);
+    keys[1] = malloc(ops * sizeof(u32));
+    keys[2] = malloc(ops * sizeof(u32));
+    keys[3] = malloc(ops * sizeof(u32));
+    bench_zipf(keys[2], ops, n, 0.99);
+    for (u32 i = 0; i < ops; i++) {
+        keys[1][i] = i % n;
+        keys[2][i] = n - 1 - keys[2][i];
+        keys[3][i] = bench_rand() % n;
+    }
+
+    double ns[2][4];
+    double hit_rate[4];
+    for (int on = 0; on < 2; on++) {
+        BTreeConfig config = {
+            .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096, .disable_finger = !on
+        };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+
+        for (int st = 0; st < 4; st++) {
+            u32 count = st == 0 ? n : ops;
+            u64 hits = btree->finger.hits;
+            u64 checksum = 0;
+            double start = now();
+            for (u32 i = 0; i < count; i++) {
+                u32 key = keys[st][i];
+                if (st == 0) {
+                    memcpy(value, &key, sizeof(u32));
+                    btree_insert(btree, &key, sizeof(u32), value, sizeof(value));
+                } else {
+                    checksum += *(u32*)btree_get(btree, &key, sizeof(u32)).data;
+                }
+            }
+            ns[on][st] = (now() - start) * 1e9 / count;
+            hit_rate[st] = (double)(btree->finger.hits - hits) / count;
+            assert(st == 0 || checksum > 0);
+        }
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+
+    for (int st = 0; st < 4; st++) {
+        printf("%-12s %12.1f %12.1f %9.2fx %9.1f%%\n",
+            streams[st], ns[0][st], ns[1][st], ns[0][st] / ns[1][st], hit_rate[st] * 100);
+    }
+
+    for (int st = 0; st < 4; st++) {
+        free(keys[st]);
+    }
+}
+
+// Multi get: batches of random keys
+// Same keys are looked up by a loop of single gets and by multi get.
+// Keys of a batch are either uniform over the whole tree or clustered
+// in a random window of 4 * batch size consecutive keys.
+//////////////////////////////////////////////////////////////////////
+
+void bench_multi_get() {
+    const char* dists[] = { "uniform", "clustered" };
+    u32 batch_sizes[] = { 1, 10, 100, 1000, 10000 };
+    u32 n = 1000000;
+    u32 lookups = 2000000;
+    char value[16] = { 0 };
+
+    printf("== multi_get: %u keys, %u lookups, %zu byte values, page size 4096\n", n, lookups, sizeof(value));
+    printf("%-10s %10s %14s %14s %10s\n", "keys", "batch", "get ns/key", "multi ns/key", "speedup");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    u32* keys = bench_keys(n, 1);
+    for (u32 i = 0; i < n; i++) {
+        memcpy(value, &keys[i], sizeof(u32));
+        btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+    }
+
+    u32* lookup_keys = malloc(lookups * sizeof(u32));
+    Value* in = malloc(lookups * sizeof(Value));
+    Value* out = malloc(lookups * sizeof(Value));
+
+    for (int d = 0; d < 2; d++) {
+        for (int b = 0; b < 5; b++) {
+            u32 batch = batch_sizes[b];
+            u32 window = 4 * batch;
+            for (u32 i = 0; i < lookups; i += batch) {
+                u32 from = bench_rand() % (n - window);
+                for (u32 j = i; j < i + batch; j++) {
+                    lookup_keys[j] = d == 0 ? bench_rand() % n : from + bench_rand() % window;
+                    in[j] = (Value) { .data = &lookup_keys[j], .size = sizeof(u32) };
+                }
+            }
+
+            u64 checksum = 0;
+            double start = now();
+            for (u32 i = 0; i < lookups; i++) {
+                checksum += *(u32*)btree_get(btree, &lookup_keys[i], sizeof(u32)).data;
+            }
+            double get = now() - start;
+
+            start = now();
+            for (u32 i = 0; i < lookups; i += batch) {
+                btree_multi_get(btree, in + i, batch, out + i);
+            }
+            double multi = now() - start;
+            for (u32 i = 0; i < lookups; i++) {
+                checksum -= *(u32*)out[i].data;
+            }
+            assert(checksum == 0);
+
+            printf("%-10s %10u %14.1f %14.1f %9.2fx\n",
+                dists[d], batch, get * 1e9 / lookups, multi * 1e9 / lookups, get / multi);
+        }
+    }
+
+    free(in);
+    free(out);
+    free(lookup_keys);
+    free(keys);
+    btree_destroy(btree);
+    reset_buffer();
+}
+
+// Interleaved lookups: throughput vs lookups in flight
+// Trees much larger than the cache are bulk loaded with dense keys and
+// 4 byte values, uniform random keys are looked up by btree_get and
+// by interleaved lookups with growing number of lookups in flight.
+//////////////////////////////////////////////////////////////////////
+
+bool bench_key_value_next(void* ctx, Value* key, Value* value) {
+    BenchBulkInput* input = ctx;
+    if (input->i == input->n) {
+        return false;
+    }
+    key->data = &input->i;
+    key->size = sizeof(u32);
+    value->data = &input->i;
+    value->size = sizeof(u32);
+    input->i++;
+    return true;
+}
+
+void bench_interleaved() {
+    u32 sizes[] = { 10000000, 100000000 };
+    u32 depths[] = { 1, 2, 4, 8, 16, 32, 64 };
+    u32 lookups = 2000000;
+
+    u32* lookup_keys = malloc(lookups * sizeof(u32));
+    Value* in = malloc(lookups * sizeof(Value));
+    Value* out = malloc(lookups * sizeof(Value));
+    for (u32 i = 0; i < lookups; i++) {
+        in[i] = (Value) { .data = &lookup_keys[i], .size = sizeof(u32) };
+    }
+
+    for (int s = 0; s < 2; s++) {
+        u32 n = sizes[s];
+        printf("== interleaved: %u keys, %u lookups, 4 byte values, page size 4096\n", n, lookups);
+        printf("%-12s %10s %12s %10s\n", "in flight", "ns/key", "Mkeys/s", "speedup");
+
+        BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        BenchBulkInput input = { .i = 0, .n = n };
+        BTBulkIterator it = { .next = bench_key_value_next, .ctx = &input };
+        btree_bulk_load(btree, &it, 100);
+        for (u32 i = 0; i < lookups; i++) {
+            lookup_keys[i] = bench_rand() % n;
+        }
+
+        u64 checksum = 0;
+        double start = now();
+        for (u32 i = 0; i < lookups; i++) {
+            checksum += *(u32*)btree_get(btree, &lookup_keys[i], sizeof(u32)).data;
+        }
+        double get = now() - start;
+        printf("%-12s %10.1f %12.2f %9.2fx\n", "btree_get", get * 1e9 / lookups, lookups / get / 1e6, 1.0);
+
+        for (int d = 0; d < 7; d++) {
+            start = now();
+            btree_get_interleaved(btree, in, lookups, out, depths[d]);
+            double interleaved = now() - start;
+
+            u64 sum = 0;
+            for (u32 i = 0; i < lookups; i++) {
+                sum += *(u32*)out[i].data;
+            }
+            assert(sum == checksum);
+
+            printf("%-12u %10.1f %12.2f %9.2fx\n",
+                depths[d], interleaved * 1e9 / lookups, lookups / interleaved / 1e6, get / interleaved);
+        }
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+
+    free(in);
+    free(out);
+    free(lookup_keys);
+}
+
+// Write batch: per-key inserts vs batched upserts
+// Tree is bulk loaded with even keys, random keys of the same range
+// are then upserted so about half of them overwrite existing keys.
+// Uniform keys are spread over the whole tree, clustered keys of a batch
+// come from a window of 4 x batch keys.
+//////////////////////////////////////////////////////////////////////
+
+bool bench_even_next(void* ctx, Value* key, Value* value) {
+    BenchBulkInput* input = ctx;
+    if (input->i == input->n) {
+        return false;
+    }
+    static u32 even;
+    even = input->i * 2;
+    memcpy(input->value, &even, sizeof(u32));
+    key->data = &even;
+    key->size = sizeof(u32);
+    value->data = input->value;
+    value->size = sizeof(input->value);
+    input->i++;
+    return true;
+}
+
+BTree* bench_write_batch_tree(u32 n) {
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    BenchBulkInput input = { .i = 0, .n = n };
+    BTBulkIterator it = { .next = bench_even_next, .ctx = &input };
+    btree_bulk_load(btree, &it, 90);
+    return btree;
+}
+
+void bench_write_batch() {
+    const char* dists[] = { "uniform", "clustered" };
+    u32 batch_sizes[] = { 1, 10, 100, 1000, 10000 };
+    u32 n = 1000000;
+    u32 upserts = 1000000;
+    char value[16] = { 0 };
+
+    printf("== write_batch: %u keys, %u upserts, %zu byte values, page size 4096\n", n, upserts, sizeof(value));
+    printf("%-10s %10s %14s %14s %10s\n", "keys", "batch", "insert ns/key", "batch ns/key", "speedup");
+
+    u32* upsert_keys = malloc(upserts * sizeof(u32));
+    Value* in_keys = malloc(upserts * sizeof(Value));
+    Value* in_values = malloc(upserts * sizeof(Value));
+    for (u32 i = 0; i < upserts; i++) {
+        in_keys[i] = (Value) { .data = &upsert_keys[i], .size = sizeof(u32) };
+        in_values[i] = (Value) { .data = value, .size = sizeof(value) };
+    }
+
+    for (int d = 0; d < 2; d++) {
+        for (int b = 0; b < 5; b++) {
+            u32 batch = batch_sizes[b];
+            u32 window = 4 * batch;
+            for (u32 i = 0; i < upserts; i += batch) {
+                u32 from = bench_rand() % (2 * n - window);
+                for (u32 j = i; j < i + batch; j++) {
+                    upsert_keys[j] = d == 0 ? bench_rand() % (2 * n) : from + bench_rand() % window;
+                }
+            }
+
+            BTree* btree = bench_write_batch_tree(n);
+            double start = now();
+            for (u32 i = 0; i < upserts; i++) {
+                btree_insert(btree, &upsert_keys[i], sizeof(u32), value, sizeof(value));
+            }
+            double insert = now() - start;
+            btree_destroy(btree);
+            reset_buffer();
+
+            btree = bench_write_batch_tree(n);
+            start = now();
+            for (u32 i = 0; i < upserts; i += batch) {
+                btree_write_batch(btree, in_keys + i, in_values + i, batch);
+            }
+            double batched = now() - start;
+            btree_destroy(btree);
+            reset_buffer();
+
+            printf("%-10s %10u %14.1f %14.1f %9.2fx\n",
+                dists[d], batch, insert * 1e9 / upserts, batched * 1e9 / upserts, insert / batched);
+        }
+    }
+
+    free(in_keys);
+    free(in_values);
+    free(upsert_keys);
+}
+
+// Concurrency: throughput vs threads
+// Concurrent tree is loaded with dense keys, threads then run a mixed
+// workload of 95% lookups of random loaded keys and 5% inserts of new
+// keys. Total number of operations is split between threads.
+//////////////////////////////////////////////////////////////////////
+
+typedef struct BenchWorker {
+    BTree* btree;
+    u32 n;
+    u32 ops;
+    u32 next_key;
+    u32 seed;
+    u32 insert_pct;
+    u64 checksum;
+    u64 misses;
+} BenchWorker;
+
+void* bench_concurrent_worker(void* arg) {
+    BenchWorker* worker = arg;
+    char value[16] = { 0 };
+    char read[16];
+    u32 state = worker->seed;
+    for (u32 i = 0; i < worker->ops; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        if (state % 100 < worker->insert_pct) {
+            u32 key = worker->next_key++;
+            btree_insert_concurrent(worker->btree, &key, sizeof(u32), value, sizeof(value));
+        } else {
+            u32 key = state % worker->n;
+            u32 size;
+            if (btree_get_concurrent(worker->btree, &key, sizeof(u32), read, sizeof(read), &size) == Ok) {
+                u32 v;
+                memcpy(&v, read, sizeof(u32));
+                worker->checksum += v;
+            } else {
+                worker->misses++;
+            }
+        }
+    }
+    return NULL;
+}
+
+void bench_concurrent() {
+    u32 thread_counts[] = { 1, 2, 4, 8, 16, 32 };
+    u32 insert_pcts[] = { 5, 100 };
+    u32 n = 1000000;
+    u32 ops = 4000000;
+    char value[16] = { 0 };
+
+    printf("== concurrent: %u keys, %u ops, page size 4096, %ld cpus\n",
+        n, ops, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-10s %-10s %12s %10s\n", "insert %", "threads", "Mops/s", "scaling");
+
+    for (int m = 0; m < 2; m++) {
+        double base = 0;
+        for (int t = 0; t < 6; t++) {
+            u32 threads = thread_counts[t];
+            BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096, .concurrent = true };
+            BTree* btree = btree_new_with_config(&compare_integers, &config);
+            u32* keys = bench_keys(n, 1);
+            for (u32 i = 0; i < n; i++) {
+                memcpy(value, &keys[i], sizeof(u32));
+                btree_insert_concurrent(btree, &keys[i], sizeof(u32), value, sizeof(value));
+            }
+
+            pthread_t tids[32];
+            BenchWorker workers[32];
+            double start = now();
+            for (u32 i = 0; i < threads; i++) {
+                // each thread inserts keys of its own range past the loaded ones
+                workers[i] = (BenchWorker) {
+                    .btree = btree, .n = n, .ops = ops / threads,
+                    .next_key = n + i * (ops / threads), .seed = 2463534242u + i * 7919,
+                    .insert_pct = insert_pcts[m]
+                };
+                pthread_create(&tids[i], NULL, bench_concurrent_worker, &workers[i]);
+            }
+            for (u32 i = 0; i < threads; i++) {
+                pthread_join(tids[i], NULL);
+            }
+            double mops = ops / (now() - start) / 1e6;
+            // every looked up key was loaded
+            u64 misses = 0;
+            for (u32 i = 0; i < threads; i++) {
+                misses += workers[i].misses;
+            }
+            assert(misses == 0);
+            if (t == 0) {
+                base = mops;
+            }
+            printf("%-10u %-10u %12.2f %9.2fx\n", insert_pcts[m], threads, mops, mops / base);
+
+            free(keys);
+            btree_destroy(btree);
+            reset_buffer();
+        }
+    }
+}
+
+// Order statistics: range count by subtree counts vs leaf scan
+// Keys 1..10M are bulk loaded into a counted tree, random ranges of
+// growing size are counted by btree_count_range and by walking a cursor
+// over the range. Rank and select are timed on their own, and random
+// inserts and deletes of a counted tree are compared to a plain one.
+//////////////////////////////////////////////////////////////////////
+
+void bench_order_statistics() {
+    u32 n = 10000000;
+    u32 range_sizes[] = { 100, 10000, 1000000, 10000000 };
+
+    printf("== order_statistics: %u keys, page size 4096\n", n);
+    printf("%10s %14s %14s %10s\n", "range", "scan us/query", "count us/query", "speedup");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096, .counted = true };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    BenchBulkInput input = { .i = 0, .n = n };
+    BTBulkIterator it = { .next = bench_key_value_next, .ctx = &input };
+    btree_bulk_load(btree, &it, 100);
+
+    u32 queries = 100000;
+    u32* starts = bench_keys(queries, 1);
+    for (int r = 0; r < 4; r++) {
+        u32 range = range_sizes[r];
+        u32 scans = range >= 1000000 ? 10 : queries / (range / 100);
+        u64 scanned = 0;
+        double start = now();
+        for (u32 q = 0; q < scans; q++) {
+            u32 from = 1 + starts[q] % (n - range + 1);
+            u32 to = from + range;
+            BTCursor cursor;
+            btree_cursor_seek(&cursor, btree, &from, sizeof(u32));
+            while (btree_cursor_valid(&cursor) && *(u32*)btree_cursor_key(&cursor).data < to) {
+                scanned++;
+                btree_cursor_next(&cursor);
+            }
+            btree_cursor_close(&cursor);
+        }
+        double scan_us = (now() - start) * 1e6 / scans;
+
+        u64 counted = 0;
+        start = now();
+        for (u32 q = 0; q < queries; q++) {
+            u32 from = 1 + starts[q] % (n - range + 1);
+            u32 to = from + range;
+            counted += btree_count_range(btree, &from, sizeof(u32), &to, sizeof(u32));
+        }
+        double count_us = (now() - start) * 1e6 / queries;
+        assert(scanned == (u64)scans * range && counted == (u64)queries * range);
+
+        printf("%10u %14.2f %14.2f %9.0fx\n", range, scan_us, count_us, scan_us / count_us);
+    }
+
+    u64 checksum = 0;
+    double start = now();
+    for (u32 q = 0; q < queries; q++) {
+        u32 key = starts[q] % n;
+        checksum += btree_rank(btree, &key, sizeof(u32));
+    }
+    double rank_ns = (now() - start) * 1e9 / queries;
+    start = now();
+    for (u32 q = 0; q < queries; q++) {
+        checksum += *(u32*)btree_select(btree, starts[q] % n).data;
+    }
+    double select_ns = (now() - start) * 1e9 / queries;
+    assert(checksum > 0);
+    printf("rank %.0f ns, select %.0f ns\n", rank_ns, select_ns);
+
+    free(starts);
+    btree_destroy(btree);
+    reset_buffer();
+
+    // maintenance cost of the counts
+    u32 updates = 1000000;
+    u32* keys = bench_keys(updates, 1);
+    char value[16] = { 0 };
+    printf("%-10s %14s %14s\n", "tree", "insert ns", "delete ns");
+    for (int c = 0; c < 2; c++) {
+        BTreeConfig update_config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096, .counted = c == 1 };
+        btree = btree_new_with_config(&compare_integers, &update_config);
+        start = now();
+        for (u32 i = 0; i < updates; i++) {
+            btree_insert(btree, &keys[i], sizeof(u32), value, sizeof(value));
+        }
+        double insert_ns = (now() - start) * 1e9 / updates;
+        start = now();
+        for (u32 i = 0; i < updates; i++) {
+            btree_delete(btree, &keys[updates - 1 - i], sizeof(u32));
+        }
+        double delete_ns = (now() - start) * 1e9 / updates;
+        printf("%-10s %14.1f %14.1f\n", c == 1 ? "counted" : "plain", insert_ns, delete_ns);
+        btree_destroy(btree);
+        reset_buffer();
+    }
+    free(keys);
+}
+
+// Range delete: key by key vs dropping covered subtrees
+// Keys 1..1M are bulk loaded, a range of growing size is deleted from
+// the middle of a fresh tree either by a loop of btree_delete or by a
+// single btree_delete_range. Free pages are counted after each.
+//////////////////////////////////////////////////////////////////////
+
+void bench_delete_range() {
+    u32 n = 1000000;
+    u32 range_sizes[] = { 1000, 100000, 900000 };
+
+    printf("== delete_range: %u keys, 16 byte values, page size 4096\n", n);
+    printf("%10s %12s %12s %10s %12s %12s\n", "range", "loop ms", "range ms", "speedup", "loop free", "range free");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096 };
+    for (int r = 0; r < 3; r++) {
+        u32 range = range_sizes[r];
+        u32 from = 1 + (n - range) / 2;
+        u32 to = from + range;
+        double ms[2];
+        u32 free_pages[2];
+        for (int m = 0; m < 2; m++) {
+            BTree* btree = btree_new_with_config(&compare_integers, &config);
+            BenchBulkInput input = { .i = 0, .n = n };
+            BTBulkIterator it = { .next = bench_key_value_next, .ctx = &input };
+            btree_bulk_load(btree, &it, 100);
+
+            u32 deleted = 0;
+            double start = now();
+            if (m == 0) {
+                for (u32 key = from; key < to; key++) {
+                    deleted += btree_delete(btree, &key, sizeof(u32)) == Ok;
+                }
+            } else {
+                deleted = btree_delete_range(btree, &from, sizeof(u32), &to, sizeof(u32));
+            }
+            ms[m] = (now() - start) * 1e3;
+            assert(deleted == range);
+            free_pages[m] = btree_free_page_count(btree);
+            btree_destroy(btree);
+            reset_buffer();
+        }
+        printf("%10u %12.2f %12.3f %9.0fx %12u %12u\n", range, ms[0], ms[1], ms[0] / ms[1], free_pages[0], free_pages[1]);
+    }
+}
+
+// Prefix scan: seek with upper bound vs prefix cursor
+// 1000 tenants with 1000 keys each are stored as "tenant%04u/%06u",
+// prefixes of a tenant, 10 tenants and 100 tenants are read by a seek
+// that compares every key to the computed upper bound of the prefix
+// and by btree_prefix_scan.
+//////////////////////////////////////////////////////////////////////
+
+void bench_prefix_scan() {
+    u32 tenants = 1000;
+    u32 per_tenant = 1000;
+    const char* prefix_formats[] = { "tenant%04u/", "tenant%03u", "tenant%02u" };
+    u32 groups[] = { tenants, tenants / 10, tenants / 100 };
+
+    printf("== prefix_scan: %u keys, page size 4096\n", tenants * per_tenant);
+    printf("%10s %14s %14s %10s\n", "rows", "bound ns/row", "prefix ns/row", "speedup");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_binary, .page_size = 4096 };
+    BTree* btree = btree_new_with_config(&binary_collation, &config);
+    char key[32];
+    char value[16] = { 0 };
+    for (u32 t = 0; t < tenants; t++) {
+        for (u32 i = 0; i < per_tenant; i++) {
+            int key_size = sprintf(key, "tenant%04u/%06u", t, i);
+            btree_insert(btree, key, key_size, value, sizeof(value));
+        }
+    }
+
+    u32 queries = 2000;
+    for (int f = 0; f < 3; f++) {
+        u32* picks = bench_keys(queries, 1);
+        double ns[2];
+        u64 rows[2] = { 0 };
+        for (int m = 0; m < 2; m++) {
+            double start = now();
+            for (u32 q = 0; q < queries; q++) {
+                char prefix[16];
+                u32 prefix_size = sprintf(prefix, prefix_formats[f], picks[q] % groups[f]);
+                BTCursor cursor;
+                if (m == 0) {
+                    // smallest key above all keys with the prefix
+                    char high[16];
+                    memcpy(high, prefix, prefix_size);
+                    high[prefix_size - 1]++;
+                    btree_cursor_seek(&cursor, btree, prefix, prefix_size);
+                    while (btree_cursor_valid(&cursor)) {
+                        Value k = btree_cursor_key(&cursor);
+                        if (binary_collation(k.data, k.size, high, prefix_size) >= 0) {
+                            break;
+                        }
+                        rows[m]++;
+                        btree_cursor_next(&cursor);
+                    }
+                } else {
+                    btree_prefix_scan(&cursor, btree, prefix, prefix_size);
+                    while (btree_cursor_valid(&cursor)) {
+                        rows[m]++;
+                        btree_cursor_next(&cursor);
+                    }
+                }
+                btree_cursor_close(&cursor);
+            }
+            ns[m] = (now() - start) * 1e9 / rows[m];
+        }
+        assert(rows[0] == rows[1] && rows[0] == (u64)queries * tenants / groups[f] * per_tenant);
+        printf("%10u %14.2f %14.2f %9.2fx\n", tenants / groups[f] * per_tenant, ns[0], ns[1], ns[0] / ns[1]);
+        free(picks);
+    }
+    btree_destroy(btree);
+    reset_buffer();
+}
+
+// Scan tokens: cost of opening page N of a paginated scan
+// Keys 1..1M are bulk loaded and read in pages of 1000 rows. Cursor of
+// page N is opened by seeking to the start and skipping N pages of rows,
+// by seeking to the last key of the previous page, and by resuming
+// a token of the previous page. Finger is disabled as the same key is
+// sought over and over.
+//////////////////////////////////////////////////////////////////////
+
+void bench_scan_token() {
+    u32 n = 1000000;
+    u32 rows_per_page = 1000;
+    u32 page_numbers[] = { 1, 10, 100, 999 };
+    u32 repeats = 200;
+
+    printf("== scan_token: %u keys, %u rows per page, page size 4096\n", n, rows_per_page);
+    printf("%10s %12s %12s %12s\n", "page", "skip us", "seek us", "token us");
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = 4096, .disable_finger = true };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    BenchBulkInput input = { .i = 0, .n = n };
+    BTBulkIterator it = { .next = bench_key_value_next, .ctx = &input };
+    btree_bulk_load(btree, &it, 100);
+
+    for (int p = 0; p < 4; p++) {
+        u32 last = page_numbers[p] * rows_per_page;
+        BTCursor cursor;
+        btree_cursor_seek(&cursor, btree, &last, sizeof(u32));
+        BTScanToken* token = btree_cursor_token(&cursor);
+        btree_cursor_close(&cursor);
+
+        double us[3];
+        u64 checksum = 0;
+        for (int m = 0; m < 3; m++) {
+            u32 reps = m == 0 && page_numbers[p] > 10 ? repeats / 20 : repeats;
+            double start = now();
+            for (u32 r = 0; r < reps; r++) {
+                if (m == 0) {
+                    btree_cursor_seek(&cursor, btree, NULL, 0);
+                    for (u32 i = 0; i < last; i++) {
+                        btree_cursor_next(&cursor);
+                    }
+                } else if (m == 1) {
+                    btree_cursor_seek(&cursor, btree, &last, sizeof(u32));
+                    btree_cursor_next(&cursor);
+                } else {
+                    btree_cursor_resume(&cursor, btree, token);
+                }
+                checksum += *(u32*)btree_cursor_key(&cursor).data;
+                btree_cursor_close(&cursor);
+            }
+            us[m] = (now() - start) * 1e6 / reps;
+        }
+        assert(checksum > 0);
+        printf("%10u %12.2f %12.3f %12.3f\n", page_numbers[p] + 1, us[0], us[1], us[2]);
+        free(token);
+    }
+    btree_destroy(btree);
+    reset_buffer();
+}
+
+typedef struct Bench {
+    const char* name;
+    void (*run)();
+} Bench;
+
+Bench benches[] = {
+    { "alloc_policy", bench_alloc_policy },
+    { "defrag", bench_defrag },
+    { "page_search", bench_page_search },
+    { "hint_search", bench_hint_search },
+    { "page_size", bench_page_size },
+    { "slot_format", bench_slot_format },
+    { "delete", bench_delete },
+    { "bulk_load", bench_bulk_load },
+    { "range_scan", bench_range_scan },
+    { "underflow", bench_underflow },
+    { "freelist", bench_freelist },
+    { "descent", bench_descent },
+    { "finger", bench_finger },
+    { "multi_get", bench_multi_get },
+    { "interleaved", bench_interleaved },
+    { "write_batch", bench_write_batch },
+    { "concurrent", bench_concurrent },
+    { "order_statistics", bench_order_statistics },
+    { "delete_range", bench_delete_range },
+    { "prefix_scan", bench_prefix_scan },
+    { "scan_token", bench_scan_token },
+};
+
+int main(int argc, char** argv) {
+    int n = sizeof(benches) / sizeof(Bench);
+    for (int i = 0; i < n; i++) {
+        int selected = argc == 1;
+        for (int j = 1; j < argc; j++) {
+            selected |= strcmp(argv[j], benches[i].name) == 0;
+        }
+        if (selected) {
+            benches[i].run();
+        }
+    }
+    return 0;
+}
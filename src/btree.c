@@ -4,68 +4,197 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HINT_SIMD
+#include <immintrin.h>
+#endif
+
+#define u64 uint64_t
 #define u32 uint32_t
 #define u16 uint16_t
 #define u8 uint8_t
 
+#ifndef PAGE_SIZE
 #ifdef TEST
 #define PAGE_SIZE 256
 #else
 #define PAGE_SIZE 512
 #endif
+#endif
+
+// PAGE_SIZE is the default page size, trees can choose
+// their own page size (see BTreeConfig.page_size).
+#define MIN_PAGE_SIZE 256
+#define MAX_PAGE_SIZE (1 << 20)
 
-#define PAGE_HDR_SIZE 16
-#define PAGE_CELL_PTR_SIZE 12
-#define PAGE_FREE_BLOCK_SIZE 4
+#define PAGE_HDR_SIZE 32
+#define PAGE_CELL_PTR_SIZE 16
+#define PAGE_COMPACT_SLOT_SIZE 2
+#define MAX_COMPACT_PAGE_SIZE (1 << 16)
+#define PAGE_FREE_BLOCK_SIZE 8
 #define PAGE_DATA_SIZE (PAGE_SIZE - PAGE_HDR_SIZE - PAGE_FREE_BLOCK_SIZE)
 #define MAX_PAYLOAD_SIZE (PAGE_DATA_SIZE / 4)
+#define NO_PID UINT32_MAX
+#define MERGE_THRESHOLD 40
 
 typedef struct Value {
     const void* data;
     u32 size;
 } Value;
 
+// In leaf pages 'rightmost_pid' and 'prev_pid' link to the next and
+// previous leaf (NO_PID at the ends), in overflow pages 'rightmost_pid'
+// links to the next page of the chain. In internal pages of counted
+// tree 'prev_pid' is the entry count of the rightmost child.
+// 'version' changes whenever key range of the page may change (split,
+// merge, redistribution, free), scan tokens compare it (see BTScanToken).
 typedef struct BTPageHdr {
     u32 pid;                 // 4
     u32 rightmost_pid;       // 4
+    u32 prev_pid;            // 4
+    u32 page_size;           // 4
+    u32 freespace;           // 4
+    u32 version;             // 4
     u16 cell_count;          // 2
     u16 freeblock_count;     // 2
-    u16 freespace;           // 2
     u8  is_leaf;             // 1
-    int : 8;                 // 1
+    u8  alloc_policy;        // 1
+    u8  slot_format;         // 1
+    u8  counted;             // 1
 } BTPageHdr;
 
+// Key hint is order preserving prefix of the key (see BTree.hint),
+// in-page search compares hints first and reads the key only on ties.
 typedef struct BTCellPtr {
-    u32 key_size;          // 4
+    u32 key_hint;          // 4
     u32 data_size;         // 4
-    u16 offset;            // 2
-    int : 16;              // 2
+    u32 offset;            // 4
+    u16 key_size;          // 2
+    u16 reserved;          // 2
 } BTCellPtr;
 
 typedef struct BTFreeBlock {
-    u16 start_offset;          // 2
-    u16 end_offset;            // 2
+    u32 start_offset;          // 4
+    u32 end_offset;            // 4
 } BTFreeBlock;
 
+// Policy used to pick a free block for cell payload.
+//  - FirstFit: first free block (by offset) that is large enough
+//  - BestFit: smallest free block that is large enough
+//  - SizeClassFit: free blocks are bucketed into power of two size classes,
+//    first free block from the smallest class that can fit the payload
+typedef enum BTAllocPolicy {
+    FirstFit,
+    BestFit,
+    SizeClassFit
+} BTAllocPolicy;
+
+// Layout of the slot (cell pointer) array.
+//  - WideSlots: BTCellPtr with key hint, key and data size and offset
+//  - CompactSlots: u16 offset only, key and data size are stored as
+//    varints in front of the key (like sqlite cells). There are no
+//    key hints and pages can't be larger then MAX_COMPACT_PAGE_SIZE.
+typedef enum BTSlotFormat {
+    WideSlots,
+    CompactSlots
+} BTSlotFormat;
+
+// Key hint function must be order preserving with respect to
+// the compare function: cmp(a, b) < 0 implies hint(a) <= hint(b).
+// When not set all hints are 0 and every probe compares full keys.
+// Page size must be within [MIN_PAGE_SIZE, MAX_PAGE_SIZE],
+// 0 means default PAGE_SIZE.
+// Page that is filled below merge threshold (percent of page space,
+// at most 50) after delete is merged with or borrows from its sibling,
+// 0 means default MERGE_THRESHOLD.
+// Finger (see BTFinger) is used unless disabled.
+// Concurrent tree can be used by many threads (see Concurrency),
+// it needs wide slots and doesn't use the finger.
+// Counted tree keeps entry counts of subtrees in internal cells
+// (see Order statistics), it can't be concurrent and doesn't use
+// the finger as every insert and delete updates the path.
+typedef struct BTreeConfig {
+    BTAllocPolicy alloc_policy;
+    u32 (*hint)(const void*, u32);
+    u32 page_size;
+    BTSlotFormat slot_format;
+    u32 merge_threshold;
+    bool disable_finger;
+    bool concurrent;
+    bool counted;
+} BTreeConfig;
+
+// Last leaf reached by descent together with its fence keys,
+// the leaf holds keys in [low, high), missing fence is unbounded.
+// Operation on a key within the fences goes straight to the leaf.
+// Finger is valid only while tree structure is unchanged, i.e.
+// 'version' matches BTree.version.
+typedef struct BTFinger {
+    bool enabled;
+    u32 pid;
+    u64 version;
+    bool has_low;
+    bool has_high;
+    u32 low_size;
+    u32 high_size;
+    char* low;
+    char* high;
+    u64 hits;
+    u64 misses;
+} BTFinger;
+
 typedef struct BTree {
     u32 root_page_id;
     int (*cmp)(const void*, u32, const void*, u32);
+    u32 (*hint)(const void*, u32);
+    BTAllocPolicy alloc_policy;
+    u32 page_size;
+    BTSlotFormat slot_format;
+    u32 merge_threshold;
+    u32 freelist_pid;
+    u32 free_page_count;
+    u64 version;
+    BTFinger finger;
+    bool concurrent;
+    u64 root_latch;
+    bool counted;
+    u32 count;
 } BTree;
 
+// High key of a page of concurrent tree (see Concurrency). Key is never
+// changed once set, replaced keys stay linked through 'prev' until
+// the page is destroyed as readers without latch may still use them.
+typedef struct BTHighKey {
+    struct BTHighKey* prev;
+    u32 size;
+    char data[];
+} BTHighKey;
+
+// Page of concurrent tree also has a version latch and B-link fields:
+// high key and pid of the right sibling at the same level, keys at or
+// past the high key are found there. Page without high key is bounded
+// only by its parent.
 typedef struct BTPage {
     BTPageHdr* hdr;
     BTCellPtr* cell_ptrs;
     BTFreeBlock* freeblocks;
     char* pdata;
     BTree* btree;
+    u64 latch;
+    BTHighKey* high;
+    BTHighKey* high_keys;
+    u32 right_pid;
 } BTPage;
 
 typedef enum BTPageSetStatus {
     Ok,
     NotEnoughSpace,
     PayloadTooBig,
-    FreeBlockNotFound
+    FreeBlockNotFound,
+    KeyNotFound
 } BTPageSetStatus;
 
 typedef struct BTPageSplitResult {
@@ -74,62 +203,444 @@ typedef struct BTPageSplitResult {
     BTPage* new_page;
 } BTPageSplitResult;
 
+// Page geometry
+// All sizes are derived from the page size stored in page header.
+//////////////////////////////////////////////////
+
+u32 page_data_size(u32 page_size) {
+    return page_size - PAGE_HDR_SIZE - PAGE_FREE_BLOCK_SIZE;
+}
+
+u32 max_payload_size(u32 page_size) {
+    return page_data_size(page_size) / 4;
+}
+
+u32 min_local_payload_size(u32 page_size) {
+    return page_data_size(page_size) / 8;
+}
+
+// Key size is stored in u16 so it's capped for large pages.
+u32 max_key_size(u32 page_size) {
+    u32 size = max_payload_size(page_size) - sizeof(u32);
+    return size < UINT16_MAX ? size : UINT16_MAX;
+}
+
+u32 overflow_data_size(u32 page_size) {
+    return page_size - PAGE_HDR_SIZE;
+}
+
+u32 page_slot_size(BTPage* page) {
+    return page->hdr->slot_format == CompactSlots ? PAGE_COMPACT_SLOT_SIZE : PAGE_CELL_PTR_SIZE;
+}
+
+// Varints
+// Unsigned LEB128: 7 bits per byte, low bits first,
+// high bit is set on every byte but the last one.
+//////////////////////////////////////////////////
+
+u32 varint_size(u32 v) {
+    u32 n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+u32 varint_put(char* dest, u32 v) {
+    u32 n = 0;
+    while (v >= 0x80) {
+        dest[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    dest[n++] = (char)v;
+    return n;
+}
+
+u32 varint_get(const char* src, u32* v) {
+    const u8* s = (const u8*)src;
+    u32 n = 0;
+    u32 shift = 0;
+    u32 result = 0;
+    while (s[n] & 0x80) {
+        result |= (u32)(s[n++] & 0x7F) << shift;
+        shift += 7;
+    }
+    result |= (u32)s[n++] << shift;
+    *v = result;
+    return n;
+}
+
 u32 page_counter = 0;
-BTPage* buffer[100];
+u32 page_version_counter = 0;
+u32 defrag_counter = 0;
+u32 buffer_capacity = 0;
+BTPage** buffer = NULL;
 
 int compare_integers(const void* a, u32 a_sz, const void* b, u32 b_sz) {
     return *(int*)a - *(int*)b;
 }
 
-BTPage* page_new(BTree* btree) {
-    char* pdata = calloc(1, PAGE_SIZE);
-    BTPage* page = calloc(1, sizeof(BTPage));
-    page->hdr = (BTPageHdr*)pdata;
-    page->btree = btree;
-    page->hdr->pid = page_counter++;
-    page->hdr->freeblock_count = 1;
-    page->hdr->freespace = PAGE_DATA_SIZE;
-    page->freeblocks = (BTFreeBlock*)(pdata + PAGE_HDR_SIZE);
-    page->freeblocks->start_offset = PAGE_SIZE - PAGE_DATA_SIZE;
-    page->freeblocks->end_offset = PAGE_SIZE;
-    page->cell_ptrs = (BTCellPtr*)(pdata + PAGE_HDR_SIZE);
-    page->pdata = pdata;
-    buffer[page->hdr->pid] = page;
-    return page;
+u32 hint_integers(const void* key, u32 key_size) {
+    (void)key_size;
+    // key in the cell may be unaligned
+    int k;
+    memcpy(&k, key, sizeof(int));
+    return (u32)k ^ 0x80000000;
+}
+
+int binary_collation(const void* key1, u32 key1_size, const void* key2, u32 key2_size) {
+    // thx sqlite
+    int rc, n;
+    n = key1_size < key2_size ? key1_size : key2_size;
+    assert(key1 && key2);
+    rc = memcmp(key1, key2, n);
+    if (rc == 0) {
+        rc = key1_size - key2_size;
+    }
+    return rc;
+}
+
+// First 4 bytes of the key in big endian order, zero padded.
+u32 hint_binary(const void* key, u32 key_size) {
+    const u8* k = key;
+    u32 hint = 0;
+    for (u32 i = 0; i < 4; i++) {
+        hint = (hint << 8) | (i < key_size ? k[i] : 0);
+    }
+    return hint;
+}
+
+// Buffers replaced by larger ones, concurrent readers may
+// still use them so they are kept until reset_buffer.
+BTPage** retired_buffers[32];
+u32 retired_buffer_count = 0;
+
+// Page frames are allocated and released under this lock
+// for concurrent trees (see Concurrency).
+pthread_mutex_t page_alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void buffer_reserve(u32 pid) {
+    if (pid < buffer_capacity) {
+        return;
+    }
+
+    u32 capacity = buffer_capacity == 0 ? 128 : buffer_capacity;
+    while (capacity <= pid) {
+        capacity *= 2;
+    }
+
+    // grown buffer is published before its capacity
+    BTPage** grown = calloc(capacity, sizeof(BTPage*));
+    assert(grown != NULL);
+    if (buffer != NULL) {
+        memcpy(grown, buffer, buffer_capacity * sizeof(BTPage*));
+        assert(retired_buffer_count < 32);
+        retired_buffers[retired_buffer_count++] = buffer;
+    }
+    __atomic_store_n(&buffer, grown, __ATOMIC_RELEASE);
+    __atomic_store_n(&buffer_capacity, capacity, __ATOMIC_RELEASE);
+}
+
+// Page versions come from a single counter, page never gets back a
+// version it had before even when its content is rebuilt or its pid
+// reused. Version 0 is never given out.
+void page_bump_version(BTPage* page) {
+    page->hdr->version = __atomic_add_fetch(&page_version_counter, 1, __ATOMIC_RELAXED);
 }
 
-BTPage* page_blank() {
-    char* pdata = calloc(1, PAGE_SIZE);
+// Empty page that is not registered in the buffer (has no pid).
+BTPage* page_blank(u32 page_size) {
+    assert(page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE);
+
+    char* pdata = calloc(1, page_size);
     BTPage* page = calloc(1, sizeof(BTPage));
     page->hdr = (BTPageHdr*)pdata;
+    page->hdr->page_size = page_size;
     page->hdr->freeblock_count = 1;
-    page->hdr->freespace = PAGE_DATA_SIZE;
+    page->hdr->freespace = page_data_size(page_size);
     page->freeblocks = (BTFreeBlock*)(pdata + PAGE_HDR_SIZE);
-    page->freeblocks->start_offset = PAGE_SIZE - PAGE_DATA_SIZE;
-    page->freeblocks->end_offset = PAGE_SIZE;
+    *page->freeblocks = (BTFreeBlock) { .start_offset = page_size - page_data_size(page_size), .end_offset = page_size };
     page->cell_ptrs = (BTCellPtr*)(pdata + PAGE_HDR_SIZE);
     page->pdata = pdata;
     return page;
 }
 
 void page_destroy(BTPage* page) {
+    while (page->high_keys != NULL) {
+        BTHighKey* prev = page->high_keys->prev;
+        free(page->high_keys);
+        page->high_keys = prev;
+    }
     free(page->pdata);
     free(page);
 }
 
+// Set B-link fields of concurrent tree page, key data is NULL
+// for unbounded page. Right link is published before the key.
+void page_set_high(BTPage* page, Value key, u32 right_pid) {
+    BTHighKey* high = NULL;
+    if (key.data != NULL) {
+        high = malloc(sizeof(BTHighKey) + key.size);
+        assert(high != NULL);
+        high->prev = page->high_keys;
+        high->size = key.size;
+        memcpy(high->data, key.data, key.size);
+        page->high_keys = high;
+    }
+    __atomic_store_n(&page->right_pid, right_pid, __ATOMIC_RELEASE);
+    __atomic_store_n(&page->high, high, __ATOMIC_RELEASE);
+}
+
+Value page_high_key(BTPage* page) {
+    BTHighKey* high = __atomic_load_n(&page->high, __ATOMIC_ACQUIRE);
+    if (high == NULL) {
+        return (Value) { .data = NULL, .size = 0 };
+    }
+    return (Value) { .data = high->data, .size = high->size };
+}
+
+// Page of concurrent tree split into itself and 'right' at 'sep':
+// right page takes over high key and right link of the page.
+void page_blink_split(BTPage* page, BTPage* right, Value sep) {
+    if (page->btree == NULL || !page->btree->concurrent) {
+        return;
+    }
+    page_set_high(right, page_high_key(page), page->right_pid);
+    page_set_high(page, sep, right->hdr->pid);
+}
+
+// Free pages
+// Pids of free pages are listed in trunk pages: number of listed pids
+// followed by the pids right after page header, 'rightmost_pid' links
+// to the next trunk. Head of the list is kept in BTree.freelist_pid.
+// Frames of listed pages are released, only trunks stay in the buffer.
+/////////////////////////////////////////////////
+
+u32 freelist_capacity(u32 page_size) {
+    return (page_size - PAGE_HDR_SIZE) / sizeof(u32) - 1;
+}
+
+u32* freelist_trunk(BTPage* page) {
+    return (u32*)(page->pdata + PAGE_HDR_SIZE);
+}
+
+// Release page, pages of a tree go to its free list.
+// Page is added to the head trunk, when there is no room
+// the page itself becomes the new head trunk.
+void page_free_locked(BTree* btree, BTPage* page, u32 pid) {
+    btree->free_page_count++;
+    if (btree->freelist_pid != NO_PID) {
+        u32* trunk = freelist_trunk(buffer[btree->freelist_pid]);
+        if (trunk[0] < freelist_capacity(btree->page_size)) {
+            trunk[1 + trunk[0]++] = pid;
+            page_destroy(page);
+            buffer[pid] = NULL;
+            return;
+        }
+    }
+
+    memset(page->pdata, 0, btree->page_size);
+    page->hdr->pid = pid;
+    page->hdr->page_size = btree->page_size;
+    page_bump_version(page);
+    page->hdr->rightmost_pid = btree->freelist_pid;
+    btree->freelist_pid = pid;
+}
+
+void page_free(u32 pid) {
+    BTPage* page = buffer[pid];
+    BTree* btree = page->btree;
+    if (btree == NULL) {
+        page_destroy(page);
+        buffer[pid] = NULL;
+        return;
+    }
+
+    if (btree->concurrent) {
+        pthread_mutex_lock(&page_alloc_mutex);
+        page_free_locked(btree, page, pid);
+        pthread_mutex_unlock(&page_alloc_mutex);
+        return;
+    }
+    page_free_locked(btree, page, pid);
+}
+
+// Take pid from the free list, NO_PID if the list is empty.
+// Head trunk is taken once all pids listed in it are taken.
+u32 freelist_pop(BTree* btree) {
+    if (btree->freelist_pid == NO_PID) {
+        return NO_PID;
+    }
+
+    btree->free_page_count--;
+    BTPage* head = buffer[btree->freelist_pid];
+    u32* trunk = freelist_trunk(head);
+    if (trunk[0] > 0) {
+        return trunk[trunk[0]--];
+    }
+
+    u32 pid = head->hdr->pid;
+    btree->freelist_pid = head->hdr->rightmost_pid;
+    page_destroy(head);
+    buffer[pid] = NULL;
+    return pid;
+}
+
+u32 btree_free_page_count(BTree* btree) {
+    return btree->free_page_count;
+}
+
+// New page, pid is taken from free list of the tree if there is one.
+BTPage* page_new(BTree* btree) {
+    BTPage* page = page_blank(btree != NULL ? btree->page_size : PAGE_SIZE);
+    page->btree = btree;
+    page->right_pid = NO_PID;
+    page->hdr->alloc_policy = btree != NULL ? btree->alloc_policy : FirstFit;
+    page->hdr->slot_format = btree != NULL ? btree->slot_format : WideSlots;
+    page->hdr->counted = btree != NULL && btree->counted;
+    page_bump_version(page);
+
+    bool locked = btree != NULL && btree->concurrent;
+    if (locked) {
+        pthread_mutex_lock(&page_alloc_mutex);
+    }
+    page->hdr->pid = btree != NULL ? freelist_pop(btree) : NO_PID;
+    if (page->hdr->pid == NO_PID) {
+        page->hdr->pid = page_counter++;
+    }
+    buffer_reserve(page->hdr->pid);
+    buffer[page->hdr->pid] = page;
+    if (locked) {
+        pthread_mutex_unlock(&page_alloc_mutex);
+    }
+    return page;
+}
+
+// Recompute in-memory pointers from page header.
+// Needed whenever page content is replaced wholesale (e.g. after split).
+void page_reload(BTPage* page) {
+    page->hdr = (BTPageHdr*)page->pdata;
+    page->cell_ptrs = (BTCellPtr*)(page->pdata + PAGE_HDR_SIZE);
+    page->freeblocks = (BTFreeBlock*)(page->pdata + PAGE_HDR_SIZE + page->hdr->cell_count * page_slot_size(page));
+}
+
 BTCellPtr* page_cellptr_at(BTPage* page, u16 pos) {
     return page->cell_ptrs + pos;
 }
 
+u16* page_compact_slot_at(BTPage* page, u16 pos) {
+    return (u16*)page->cell_ptrs + pos;
+}
+
 BTFreeBlock* page_freeblock_at(BTPage* page, u16 pos) {
     return page->freeblocks + pos;
 }
 
+// Free block array follows the slots, after an odd number of compact
+// slots it is only 2 byte aligned so entries are copied in and out.
+BTFreeBlock page_freeblock_get(BTPage* page, u16 pos) {
+    BTFreeBlock fb;
+    memcpy(&fb, (char*)page->freeblocks + pos * PAGE_FREE_BLOCK_SIZE, sizeof(BTFreeBlock));
+    return fb;
+}
+
+void page_freeblock_set(BTPage* page, u16 pos, BTFreeBlock fb) {
+    memcpy((char*)page->freeblocks + pos * PAGE_FREE_BLOCK_SIZE, &fb, sizeof(BTFreeBlock));
+}
+
+// Payloads larger then max_payload_size don't fit into the page.
+// Page keeps only the key and a prefix of data (local payload)
+// followed by pid of the first overflow page, the rest of data
+// is stored in a chain of overflow pages.
+bool cell_overflows(u32 page_size, u32 key_size, u32 data_size) {
+    return key_size + data_size > max_payload_size(page_size);
+}
+
+// Size of local payload (key, data prefix and overflow pid).
+u32 cell_local_size(u32 page_size, u32 key_size, u32 data_size) {
+    if (!cell_overflows(page_size, key_size, data_size)) {
+        return key_size + data_size;
+    }
+
+    u32 size = key_size + sizeof(u32);
+    u32 min_size = min_local_payload_size(page_size);
+    return size > min_size ? size : min_size;
+}
+
+// Size of data prefix stored in the page.
+u32 cell_local_data_size(u32 page_size, u32 key_size, u32 data_size) {
+    if (!cell_overflows(page_size, key_size, data_size)) {
+        return data_size;
+    }
+    return cell_local_size(page_size, key_size, data_size) - key_size - sizeof(u32);
+}
+
+// Cell as seen through the slot array, regardless of slot format.
+// Cell starts at 'offset' with 'header_size' bytes of varint
+// sizes (compact slots only) followed by key and local data.
+typedef struct BTCell {
+    u32 offset;
+    u32 header_size;
+    u32 key_size;
+    u32 data_size;
+} BTCell;
+
+BTCell page_cell_at(BTPage* page, u16 pos) {
+    BTCell cell;
+    if (page->hdr->slot_format == CompactSlots) {
+        cell.offset = *page_compact_slot_at(page, pos);
+        const char* src = page->pdata + cell.offset;
+        u32 n = varint_get(src, &cell.key_size);
+        n += varint_get(src + n, &cell.data_size);
+        cell.header_size = n;
+    } else {
+        BTCellPtr* cellptr = page_cellptr_at(page, pos);
+        cell.offset = cellptr->offset;
+        cell.header_size = 0;
+        cell.key_size = cellptr->key_size;
+        cell.data_size = cellptr->data_size;
+    }
+    return cell;
+}
+
+u32 page_cell_offset(BTPage* page, u16 pos) {
+    if (page->hdr->slot_format == CompactSlots) {
+        return *page_compact_slot_at(page, pos);
+    }
+    return page_cellptr_at(page, pos)->offset;
+}
+
+void page_set_cell_offset(BTPage* page, u16 pos, u32 offset) {
+    if (page->hdr->slot_format == CompactSlots) {
+        *page_compact_slot_at(page, pos) = offset;
+    } else {
+        page_cellptr_at(page, pos)->offset = offset;
+    }
+}
+
+// Size of varint header of the cell, 0 for wide slots.
+u32 page_cell_header_size(BTPage* page, u32 key_size, u32 data_size) {
+    if (page->hdr->slot_format == CompactSlots) {
+        return varint_size(key_size) + varint_size(data_size);
+    }
+    return 0;
+}
+
+u32 cell_size(u32 page_size, BTCell* cell) {
+    return cell->header_size + cell_local_size(page_size, cell->key_size, cell->data_size);
+}
+
+u32 page_cell_size(BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    return cell_size(page->hdr->page_size, &cell);
+}
+
 u32 page_compute_freespace(BTPage* page) {
     u32 freespace = 0;
     for (int i = 0; i < page->hdr->freeblock_count; i++) {
-        BTFreeBlock* fb = page_freeblock_at(page, i);
-        int space = fb->end_offset - fb->start_offset;
+        BTFreeBlock fb = page_freeblock_get(page, i);
+        int space = fb.end_offset - fb.start_offset;
         freespace += space;
     }
     return freespace;
@@ -137,7 +648,7 @@ u32 page_compute_freespace(BTPage* page) {
 
 typedef struct BTCanAllocResult {
     bool can_alloc;
-    u16 size;
+    u32 size;
     BTFreeBlock* freeblock;
 } BTCanAllocResult;
 
@@ -146,10 +657,11 @@ typedef struct BTCanAllocResult {
 int page_freeblock_alloc(BTPage* page) {
     assert(page->hdr->freeblock_count > 0);
 
-    BTFreeBlock* fb = page->freeblocks;
-    int fb_size = fb->end_offset - fb->start_offset;
+    BTFreeBlock fb = page_freeblock_get(page, 0);
+    int fb_size = fb.end_offset - fb.start_offset;
     if (fb_size >= PAGE_FREE_BLOCK_SIZE) {
-        fb->start_offset += PAGE_FREE_BLOCK_SIZE;
+        fb.start_offset += PAGE_FREE_BLOCK_SIZE;
+        page_freeblock_set(page, 0, fb);
         page->hdr->freespace -= PAGE_FREE_BLOCK_SIZE;
         return Ok;
     } else {
@@ -159,7 +671,7 @@ int page_freeblock_alloc(BTPage* page) {
 
 void page_freeblocks_move_all(BTPage* page) {
     char* src = (char*)page_freeblock_at(page, 0);
-    char* dest = src + PAGE_CELL_PTR_SIZE;
+    char* dest = src + page_slot_size(page);
     page->freeblocks = (BTFreeBlock*)dest;
     memmove(dest, src, PAGE_FREE_BLOCK_SIZE * page->hdr->freeblock_count);
 }
@@ -170,16 +682,14 @@ void page_freeblocks_move(BTPage* page, u16 pos) {
     memmove(dest, src, PAGE_FREE_BLOCK_SIZE * (page->hdr->freeblock_count - pos));
 }
 
-int page_freeblock_insert(BTPage* page, u16 pos, u16 start, u16 end) {
+int page_freeblock_insert(BTPage* page, u16 pos, u32 start, u32 end) {
     int rc = page_freeblock_alloc(page);
     if (rc != Ok) {
         return NotEnoughSpace;
     }
 
     page_freeblocks_move(page, pos);
-    BTFreeBlock* b = page_freeblock_at(page, pos);
-    b->start_offset = start;
-    b->end_offset = end;
+    page_freeblock_set(page, pos, (BTFreeBlock) { .start_offset = start, .end_offset = end });
     page->hdr->freeblock_count++;
     return Ok;
 }
@@ -187,19 +697,21 @@ int page_freeblock_insert(BTPage* page, u16 pos, u16 start, u16 end) {
 void page_freeblock_remove(BTPage* page, u16 pos) {
     assert(pos < page->hdr->freeblock_count);
     BTFreeBlock* dest = page_freeblock_at(page, pos);
-    if (pos == 0 && page->hdr->freeblock_count == 1) {
-        // there is always at least on free block
+    if (pos == 0) {
+        // first free block borders the freeblock array and is
+        // where new cell pointers come from so it is always kept, even when empty
         return;
     }
 
     BTFreeBlock* src = page_freeblock_at(page, pos + 1);
-    u16 nblocks = PAGE_FREE_BLOCK_SIZE * (page->hdr->freeblock_count - pos);
+    u32 nblocks = PAGE_FREE_BLOCK_SIZE * (page->hdr->freeblock_count - pos - 1);
     memmove(dest, src, nblocks);
     page->hdr->freeblock_count--;
     page->hdr->freespace += PAGE_FREE_BLOCK_SIZE;
 
-    BTFreeBlock* first = page->freeblocks;
-    first->start_offset -= PAGE_FREE_BLOCK_SIZE;
+    BTFreeBlock first = page_freeblock_get(page, 0);
+    first.start_offset -= PAGE_FREE_BLOCK_SIZE;
+    page_freeblock_set(page, 0, first);
 }
 
 
@@ -210,11 +722,13 @@ int page_cell_alloc(BTPage* page) {
         return NotEnoughSpace;
     }
 
-    BTFreeBlock* fb = page->freeblocks;
-    int fb_size = fb->end_offset - fb->start_offset;
-    if (fb_size >= PAGE_CELL_PTR_SIZE) {
-        fb->start_offset += PAGE_CELL_PTR_SIZE;
-        page->hdr->freespace -= PAGE_CELL_PTR_SIZE;
+    u32 slot_size = page_slot_size(page);
+    BTFreeBlock fb = page_freeblock_get(page, 0);
+    u32 fb_size = fb.end_offset - fb.start_offset;
+    if (fb_size >= slot_size) {
+        fb.start_offset += slot_size;
+        page_freeblock_set(page, 0, fb);
+        page->hdr->freespace -= slot_size;
         return Ok;
     } else {
         return NotEnoughSpace;
@@ -222,87 +736,142 @@ int page_cell_alloc(BTPage* page) {
 }
 
 void page_cell_dealloc(BTPage* page) {
-    page->freeblocks->start_offset -= PAGE_FREE_BLOCK_SIZE;
+    BTFreeBlock fb = page_freeblock_get(page, 0);
+    fb.start_offset -= page_slot_size(page);
+    page_freeblock_set(page, 0, fb);
+    page->hdr->freespace += page_slot_size(page);
 }
 
-// Return the end offset of the first free block 
-// that is larger then or equal to the specified size parameter.
-// Allocation policy is: first-fit.
-// If there is no free block large enough to satisfy size
-// parameter, then -1 is returned.
-int page_space_alloc(BTPage* page, u16 size) {
-    assert(size > 0 && size < PAGE_DATA_SIZE);
+// Size class of the free block, floor(log2(size)).
+int page_size_class(u32 size) {
+    assert(size > 0);
+    return 31 - __builtin_clz(size);
+}
+
+// Return position of the free block that should be used
+// to allocate 'size' bytes according to page allocation policy.
+// If there is no free block large enough -1 is returned.
+int page_freeblock_find(BTPage* page, u32 size) {
+    int found = -1;
+    u32 found_size = 0;
+    int found_class = 0;
+    int size_class = page_size_class(size);
 
     for (int i = 0; i < page->hdr->freeblock_count; i++) {
-        BTFreeBlock* b = page_freeblock_at(page, i);
-        u16 block_size = b->end_offset - b->start_offset;
-        if (block_size >= size) {
-            int offset = b->end_offset;
-            b->end_offset -= size;
-            page->hdr->freespace -= size;
+        BTFreeBlock b = page_freeblock_get(page, i);
+        u32 block_size = b.end_offset - b.start_offset;
+        if (block_size < size) {
+            continue;
+        }
+
+        switch (page->hdr->alloc_policy) {
+        case BestFit:
             if (block_size == size) {
-                page_freeblock_remove(page, i);
+                return i;
             }
-            return offset;
-        } else {
-            continue;
+            if (found == -1 || block_size < found_size) {
+                found = i;
+                found_size = block_size;
+            }
+            break;
+        case SizeClassFit: {
+            int block_class = page_size_class(block_size);
+            if (block_class == size_class) {
+                return i;
+            }
+            if (found == -1 || block_class < found_class) {
+                found = i;
+                found_class = block_class;
+            }
+            break;
+        }
+        default:
+            return i;
         }
     }
 
-    return -1;
+    return found;
 }
 
-int page_space_dealloc(BTPage* page, u16 start, u16 end) {
+// Return the end offset of the free block chosen by page
+// allocation policy that is larger then or equal to the specified size parameter.
+// If there is no free block large enough to satisfy size
+// parameter, then -1 is returned.
+int page_space_alloc(BTPage* page, u32 size) {
+    assert(size > 0 && size < page_data_size(page->hdr->page_size));
+
+    int i = page_freeblock_find(page, size);
+    if (i == -1) {
+        return -1;
+    }
+
+    BTFreeBlock b = page_freeblock_get(page, i);
+    u32 block_size = b.end_offset - b.start_offset;
+    int offset = b.end_offset;
+    b.end_offset -= size;
+    page_freeblock_set(page, i, b);
+    page->hdr->freespace -= size;
+    if (block_size == size) {
+        page_freeblock_remove(page, i);
+    }
+    return offset;
+}
+
+int page_space_dealloc(BTPage* page, u32 start, u32 end) {
     assert(start < end);
-    assert(end <= PAGE_SIZE);
+    assert(end <= page->hdr->page_size);
     assert(page->hdr->freeblock_count > 0);
 
     int rc;
     int size = end - start;
 
-    BTFreeBlock* first = page->freeblocks;
-    BTFreeBlock* last = page->freeblocks + page->hdr->freeblock_count - 1;
-    if (first->start_offset == end) {
-        first->start_offset = start;
+    u16 last_pos = page->hdr->freeblock_count - 1;
+    BTFreeBlock first = page_freeblock_get(page, 0);
+    BTFreeBlock last = page_freeblock_get(page, last_pos);
+    if (first.start_offset == end) {
+        first.start_offset = start;
+        page_freeblock_set(page, 0, first);
         page->hdr->freespace += size;
         return Ok;
-    } else if (first->start_offset > end) {
+    } else if (first.start_offset > end) {
         if (page_freeblock_insert(page, 0, start, end) == Ok) {
             page->hdr->freespace += size;
             return Ok;
         }
         return NotEnoughSpace;
-    } else if (last->end_offset == start) {
-        last->end_offset = end;
+    } else if (last.end_offset == start) {
+        last.end_offset = end;
+        page_freeblock_set(page, last_pos, last);
         page->hdr->freespace += size;
         return Ok;
-    } else if (last->end_offset < start) {
+    } else if (last.end_offset < start) {
         if (page_freeblock_insert(page, page->hdr->freeblock_count, start, end) == Ok) {
             page->hdr->freespace += size;
             return Ok;
         }
         return NotEnoughSpace;
     } else {
-        BTFreeBlock* left = NULL;
-        BTFreeBlock* right = NULL;
         for (int i = 0; i < page->hdr->freeblock_count - 1; i++) {
-            left = page->freeblocks + i;
-            right = page->freeblocks + i + 1;
+            BTFreeBlock left = page_freeblock_get(page, i);
+            BTFreeBlock right = page_freeblock_get(page, i + 1);
 
-            if (left->end_offset == start && end == right->start_offset) {
-                left->end_offset = right->end_offset;
+            if (left.end_offset == start && end == right.start_offset) {
+                left.end_offset = right.end_offset;
+                page_freeblock_set(page, i, left);
                 page->hdr->freespace += size;
-                page_freeblock_remove(page, i);
+                page_freeblock_remove(page, i + 1);
                 return Ok;
-            } else if (left->end_offset == start && end < right->start_offset) {
+            } else if (left.end_offset == start && end < right.start_offset) {
                 page->hdr->freespace += size;
-                left->end_offset = end;
+                left.end_offset = end;
+                page_freeblock_set(page, i, left);
                 return Ok;
-            } else if (left->end_offset < start && end == right->end_offset) {
+            } else if (left.end_offset < start && end == right.start_offset) {
                 page->hdr->freespace += size;
-                right->start_offset = start;
+                right.start_offset = start;
+                page_freeblock_set(page, i + 1, right);
                 return Ok;
-            } else if (left->end_offset < start && end < right->start_offset) {
+            } else if (left.end_offset < start && end < right.start_offset) {
                 if (page_freeblock_insert(page, i + 1, start, end) == Ok) {
                     page->hdr->freespace += size;
                     return Ok;
@@ -318,214 +887,134 @@ int page_space_dealloc(BTPage* page, u16 start, u16 end) {
     return NotEnoughSpace;
 }
 
-void page_mergesort_cells(BTCellPtr* cells[], int from, int to) {
-    if (to - from > 1) {
-        int mid = from + (to - from) / 2;
-        page_mergesort_cells(cells, from, mid);
-        page_mergesort_cells(cells, mid, to);
-
-        int left_size = mid - from;
-        BTCellPtr* left[left_size];
-        for (int i = 0; i < left_size; i++) {
-            left[i] = cells[from + i];
-        }
-
-        int right_size = to - mid;
-        BTCellPtr* right[right_size];
-        for (int i = 0; i < right_size; i++) {
-            right[i] = cells[mid + i];
-        }
-
-        int i = from;
-        int l = 0;
-        int r = 0;
-        while (l < left_size && r < right_size) {
-            if (left[l]->offset <= right[r]->offset) {
-                cells[i] = left[l];
-                l++;
-            } else {
-                cells[i] = right[r];
-                r++;
-            }
-            i++;
-        }
-
-        while (l < left_size) {
-            cells[i] = left[l];
-            l++;
-            i++;
-        }
-
-        while (r < right_size) {
-            cells[i] = right[r];
-            r++;
-            i++;
-        }
-    }
-}
+// Scratch frame used by defragmentation, one per thread.
+// It grows to the largest page size defragmented by the thread.
+static __thread char* defrag_scratch = NULL;
+static __thread u32 defrag_scratch_size = 0;
 
-int page_cellptr_find_by_offset(BTCellPtr* cells[], int n, u16 offset) {
-    for (int i = 0; i < n; i++) {
-        if (cells[i]->offset >= offset) {
-            return i;
-        }
+char* defrag_scratch_reserve(u32 size) {
+    if (size > defrag_scratch_size) {
+        defrag_scratch = realloc(defrag_scratch, size);
+        assert(defrag_scratch != NULL);
+        defrag_scratch_size = size;
     }
-    return -1;
+    return defrag_scratch;
 }
 
+// Compact all payloads to the end of the page leaving a single free block.
+// Payloads are copied into scratch frame in slot order and then
+// copied back in one go, so the cost is O(cells) regardless of
+// the number of free blocks.
+// Payload of the cell that lies within 'extra_freeblock' (if any) is
+// treated as free space, the caller is expected to rewrite that cell.
 void page_defragment(BTPage* page, BTFreeBlock* extra_freeblock) {
-    printf("Defraging page!!!\n");
+    defrag_counter++;
 
+    u32 page_size = page->hdr->page_size;
+    char* scratch = defrag_scratch_reserve(page_size);
     int cell_count = page->hdr->cell_count;
-    int freeblock_count = page->hdr->freeblock_count;
-    if (extra_freeblock != NULL) {
-        freeblock_count++;
-    }
-
-    // copy freeblocks into local arr
-    BTFreeBlock* freeblocks[freeblock_count];
-    int k = 0;
-    for (int i = 0; i < freeblock_count; i++) {
-        BTFreeBlock* curr = page->freeblocks + i;
-        if (extra_freeblock != NULL) {
-            if (curr->start_offset > extra_freeblock->start_offset) {
-                freeblocks[k++] = extra_freeblock;
-            }
-        }
-        freeblocks[k++] = curr;
-    }
+    u32 write_offset = page_size;
 
-    // copy cells into local arr
-    // and sort them by offset
-    BTCellPtr* cell_ptrs[cell_count];
     for (int i = 0; i < cell_count; i++) {
-        cell_ptrs[i] = page->cell_ptrs + i;
-    }
-    page_mergesort_cells(cell_ptrs, 0, cell_count);
-
-    for (int i = freeblock_count - 1; i >= 1; i--) {
-        BTFreeBlock* curr = freeblocks[i];
-        BTFreeBlock* prev = freeblocks[i - 1];
-        int slide = curr->end_offset - curr->start_offset;
-
-        void* src = page->pdata + prev->end_offset;
-        void* dest = src + slide;
-        u16 n = prev->end_offset - curr->start_offset;
-        memmove(dest, src, n);
-
-        // update cell pointers
-        int cell_idx = page_cellptr_find_by_offset(cell_ptrs, cell_count, prev->end_offset);
-        for (int i = cell_idx; i < cell_count; i++) {
-            BTCellPtr* cellptr = page_cellptr_at(page, i);
-            u16 cell_offset = cellptr->offset;
-
-            if (cell_offset >= prev->end_offset && cell_offset < curr->start_offset) {
-                cellptr->offset += slide;
-            } else {
-                break;
-            }
+        u32 offset = page_cell_offset(page, i);
+        if (extra_freeblock != NULL
+            && offset >= extra_freeblock->start_offset
+            && offset < extra_freeblock->end_offset) {
+            continue;
         }
 
-        // extend prev pointer
-        prev->end_offset += slide;
+        u32 size = page_cell_size(page, i);
+        write_offset -= size;
+        memcpy(scratch + write_offset, page->pdata + offset, size);
+        page_set_cell_offset(page, i, write_offset);
     }
 
-    // copy first and only valid freeblock into page
-    BTFreeBlock* first_fb = page->freeblocks;
-    memcpy(first_fb, freeblocks, sizeof(BTFreeBlock));
+    memcpy(page->pdata + write_offset, scratch + write_offset, page_size - write_offset);
+
+    // first and only free block takes over
+    // the space of freeblock entries that are gone
+    BTFreeBlock first_fb = {
+        .start_offset = PAGE_HDR_SIZE + cell_count * page_slot_size(page) + PAGE_FREE_BLOCK_SIZE,
+        .end_offset = write_offset
+    };
+    page_freeblock_set(page, 0, first_fb);
 
     // update page metadata
     page->hdr->freeblock_count = 1;
-    page->hdr->freespace = first_fb->end_offset - first_fb->start_offset;
+    page->hdr->freespace = first_fb.end_offset - first_fb.start_offset;
 }
 
-u16 page_estimate_freespace_after_defrag(BTPage* page) {
+u32 page_estimate_freespace_after_defrag(BTPage* page) {
     int freeblocks = page->hdr->freeblock_count - 1;
     return freeblocks * PAGE_FREE_BLOCK_SIZE + page->hdr->freespace;
 }
 
-Value page_key_at(BTPage* page, u16 pos) {
-    BTCellPtr* cellptr = page_cellptr_at(page, pos);
+Value page_cell_key(BTPage* page, BTCell* cell) {
     Value v = {
-        .size = cellptr->key_size,
-        .data = page->pdata + cellptr->offset
+        .size = cell->key_size,
+        .data = page->pdata + cell->offset + cell->header_size
     };
     return v;
 }
 
-Value page_data_at(BTPage* page, u16 pos) {
-    BTCellPtr* cellptr = page_cellptr_at(page, pos);
+// Return data stored in the page, for overflown cells
+// this is only the local prefix of data.
+Value page_cell_data(BTPage* page, BTCell* cell) {
     Value v = {
-        .size = cellptr->data_size,
-        .data = page->pdata + cellptr->offset + cellptr->key_size
+        .size = cell_local_data_size(page->hdr->page_size, cell->key_size, cell->data_size),
+        .data = page->pdata + cell->offset + cell->header_size + cell->key_size
     };
     return v;
 }
 
-BTCellPtr* page_find_cellptr(BTPage* page, const void* key, u32 key_size) {
-    if (page->hdr->cell_count == 0) {
-        return NULL;
-    }
-
-    BTCellPtr* mid_cell;
-    char* mid_cell_key;
-    int lo = 0;
-    int hi = page->hdr->cell_count - 1;
-    int mid;
-    while (lo <= hi) {
-        mid = (lo + hi) / 2;
-        mid_cell = page_cellptr_at(page, mid);
-        mid_cell_key = &page->pdata[mid_cell->offset];
-
-        int rcmp = page->btree->cmp(
-            key, key_size,
-            mid_cell_key, mid_cell->key_size
-        );
-
-        if (rcmp == 0) {
-            return mid_cell;
-        } else if (rcmp > 0) {
-            lo = mid + 1;
-        } else {
-            hi = mid - 1;
-        }
-    }
+Value page_key_at(BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    return page_cell_key(page, &cell);
+}
 
-    return NULL;
+Value page_data_at(BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    return page_cell_data(page, &cell);
 }
 
-Value page_data_by_key(BTPage* page, const void* key, u32 key_size) {
-    BTCellPtr* cellptr = page_find_cellptr(page, key, key_size);
-    Value v = { .size = 0, .data = 0 };
-    if (cellptr != NULL) {
-        v.size = cellptr->data_size;
-        v.data = page->pdata + cellptr->offset + cellptr->key_size;
+// Value of the cell as returned by btree_get, data is NULL
+// for values stored in overflow pages.
+Value page_value_at(BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    Value v = { .data = NULL, .size = cell.data_size };
+    if (!cell_overflows(page->hdr->page_size, cell.key_size, cell.data_size)) {
+        v.data = page_cell_data(page, &cell).data;
     }
     return v;
 }
 
-u16 page_insertion_point(BTPage* page, const void* key, u32 key_size) {
-    if (page->hdr->cell_count == 0) {
-        return 0;
-    }
+// Return pid of the first overflow page of the cell.
+u32 page_overflow_pid(BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    assert(cell_overflows(page->hdr->page_size, cell.key_size, cell.data_size));
 
-    BTCellPtr* cell;
-    char* cell_key;
-    u16 lo = 0;
-    u16 hi = page->hdr->cell_count;
-    u16 mid;
+    u32 pid;
+    char* src = page->pdata + cell.offset + cell_size(page->hdr->page_size, &cell) - sizeof(u32);
+    memcpy(&pid, src, sizeof(u32));
+    return pid;
+}
 
-    while (lo < hi) {
-        mid = (lo + hi) / 2;
-        cell = page_cellptr_at(page, mid);
-        cell_key = &page->pdata[cell->offset];
+// Hint search kernels
+// Hints are non-decreasing along the cell pointer array so in-page
+// search can first narrow down the range of cells by hints only.
+// Each kernel returns position of the first cell with hint >= 'hint'.
+//////////////////////////////////////////////////
 
-        int cmp_res = page->btree->cmp(
-            key, key_size,
-            cell_key, cell->key_size
-        );
+typedef u16 (*BTHintLowerBound)(const BTCellPtr* cells, u16 n, u32 hint);
 
-        if (cmp_res > 0) {
+#define HINT_BLOCK_SIZE 16
+
+u16 hint_lower_bound_binary(const BTCellPtr* cells, u16 n, u32 hint) {
+    u16 lo = 0;
+    u16 hi = n;
+    while (lo < hi) {
+        u16 mid = (lo + hi) / 2;
+        if (cells[mid].key_hint < hint) {
             lo = mid + 1;
         } else {
             hi = mid;
@@ -534,302 +1023,3278 @@ u16 page_insertion_point(BTPage* page, const void* key, u32 key_size) {
     return lo;
 }
 
-void page_move_cells(BTPage* page, u16 from) {
-    BTCellPtr* src = page_cellptr_at(page, from);
-    BTCellPtr* dest = src + 1;
-    memmove(dest, src, PAGE_CELL_PTR_SIZE * (page->hdr->cell_count - from));
-}
-
-int page_insert_freespace(
-    BTPage* page,
-    int size
-) {
-    BTFreeBlock* first = page->freeblocks;
-    first->end_offset -= size;
-    first->start_offset += PAGE_FREE_BLOCK_SIZE;
-    // page->hdr->freespace -= size;
+u16 hint_lower_bound_branchless(const BTCellPtr* cells, u16 n, u32 hint) {
+    if (n == 0) {
+        return 0;
+    }
 
-    if (page->hdr->freeblock_count > 1) {
-        page_freeblocks_move(page, 1);
+    const BTCellPtr* base = cells;
+    while (n > 1) {
+        u16 half = n / 2;
+        base = base[half].key_hint < hint ? base + half : base;
+        n -= half;
     }
+    return (base - cells) + (base->key_hint < hint);
+}
 
-    BTFreeBlock* new_second = page->freeblocks + 1;
-    new_second->start_offset = first->end_offset;
-    new_second->end_offset = new_second->start_offset + size;
-    page->hdr->freespace -= PAGE_FREE_BLOCK_SIZE;
-    page->hdr->freeblock_count++;
+#ifdef HINT_SIMD
 
-    return Ok;
-}
+// Hints are unsigned, SIMD compare is signed, so both sides are biased.
+#define HINT_BIAS 0x80000000
 
-int page_leaf_insert(
+__attribute__((target("sse4.2")))
+u16 hint_lower_bound_sse42(const BTCellPtr* cells, u16 n, u32 hint) {
+    __m128i bias = _mm_set1_epi32(HINT_BIAS);
+    __m128i key = _mm_xor_si128(_mm_set1_epi32(hint), bias);
+    u16 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i h = _mm_setr_epi32(
+            cells[i].key_hint, cells[i + 1].key_hint,
+            cells[i + 2].key_hint, cells[i + 3].key_hint
+        );
+        __m128i lt = _mm_cmpgt_epi32(key, _mm_xor_si128(h, bias));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(lt));
+        if (mask != 0xF) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    while (i < n && cells[i].key_hint < hint) {
+        i++;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+u16 hint_lower_bound_avx2(const BTCellPtr* cells, u16 n, u32 hint) {
+    // hint is the first field of 16 byte cell pointer
+    const int stride = PAGE_CELL_PTR_SIZE / sizeof(u32);
+    __m256i index = _mm256_setr_epi32(
+        0, stride, 2 * stride, 3 * stride,
+        4 * stride, 5 * stride, 6 * stride, 7 * stride
+    );
+    __m256i bias = _mm256_set1_epi32(HINT_BIAS);
+    __m256i key = _mm256_xor_si256(_mm256_set1_epi32(hint), bias);
+    u16 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i h = _mm256_i32gather_epi32((const int*)(cells + i), index, 4);
+        __m256i lt = _mm256_cmpgt_epi32(key, _mm256_xor_si256(h, bias));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+        if (mask != 0xFF) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    while (i < n && cells[i].key_hint < hint) {
+        i++;
+    }
+    return i;
+}
+
+// Branchless binary search down to a block of HINT_BLOCK_SIZE cells,
+// then linear SIMD scan within the block.
+__attribute__((target("sse4.2")))
+u16 hint_lower_bound_blocked_sse42(const BTCellPtr* cells, u16 n, u32 hint) {
+    const BTCellPtr* base = cells;
+    while (n > HINT_BLOCK_SIZE) {
+        u16 half = n / 2;
+        base = base[half].key_hint < hint ? base + half : base;
+        n -= half;
+    }
+    return (base - cells) + hint_lower_bound_sse42(base, n, hint);
+}
+
+__attribute__((target("avx2")))
+u16 hint_lower_bound_blocked_avx2(const BTCellPtr* cells, u16 n, u32 hint) {
+    const BTCellPtr* base = cells;
+    while (n > HINT_BLOCK_SIZE) {
+        u16 half = n / 2;
+        base = base[half].key_hint < hint ? base + half : base;
+        n -= half;
+    }
+    return (base - cells) + hint_lower_bound_avx2(base, n, hint);
+}
+
+#endif
+
+// Kernel used by in-page search, chosen at startup based on cpu features.
+BTHintLowerBound hint_lower_bound = hint_lower_bound_branchless;
+
+__attribute__((constructor))
+void hint_lower_bound_init() {
+#ifdef HINT_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        hint_lower_bound = hint_lower_bound_blocked_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        hint_lower_bound = hint_lower_bound_blocked_sse42;
+    }
+#endif
+}
+
+bool page_has_hints(BTPage* page) {
+    return page->btree != NULL
+        && page->btree->hint != NULL
+        && page->hdr->slot_format == WideSlots;
+}
+
+u32 page_key_hint(BTPage* page, const void* key, u32 key_size) {
+    if (!page_has_hints(page)) {
+        return 0;
+    }
+    return page->btree->hint(key, key_size);
+}
+
+// Compare the key with the key of the cell at given position.
+// Full keys are compared only when hints are equal.
+int page_compare_at(BTPage* page, u16 pos, const void* key, u32 key_size, u32 key_hint) {
+    if (page->hdr->slot_format == CompactSlots) {
+        Value cell_key = page_key_at(page, pos);
+        return page->btree->cmp(key, key_size, cell_key.data, cell_key.size);
+    }
+
+    BTCellPtr* cell = page_cellptr_at(page, pos);
+    if (key_hint != cell->key_hint) {
+        return key_hint < cell->key_hint ? -1 : 1;
+    }
+    return page->btree->cmp(
+        key, key_size,
+        page->pdata + cell->offset, cell->key_size
+    );
+}
+
+// Narrow down search to cells [lo, hi) that have the same hint as the key.
+// Cells before that range are smaller and cells after it are larger then the key.
+void page_hint_range(BTPage* page, u32 key_hint, u16* lo, u16* hi) {
+    u16 n = page->hdr->cell_count;
+    if (!page_has_hints(page)) {
+        *lo = 0;
+        *hi = n;
+        return;
+    }
+
+    *lo = hint_lower_bound(page->cell_ptrs, n, key_hint);
+    *hi = n;
+    if (key_hint != UINT32_MAX) {
+        *hi = *lo + hint_lower_bound(page->cell_ptrs + *lo, n - *lo, key_hint + 1);
+    }
+}
+
+// Search for the key in cells [range_lo, range_hi), see page_hint_range.
+int page_find_cell_in(
+    BTPage* page,
+    const void* key, u32 key_size, u32 key_hint,
+    u16 range_lo, u16 range_hi
+) {
+    int lo = range_lo;
+    int hi = range_hi - 1;
+    int mid;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        int rcmp = page_compare_at(page, mid, key, key_size, key_hint);
+
+        if (rcmp == 0) {
+            return mid;
+        } else if (rcmp > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+// Return position of the cell with given key or -1 if there is no such cell.
+int page_find_cell(BTPage* page, const void* key, u32 key_size) {
+    if (page->hdr->cell_count == 0) {
+        return -1;
+    }
+
+    u32 key_hint = page_key_hint(page, key, key_size);
+    u16 lo, hi;
+    page_hint_range(page, key_hint, &lo, &hi);
+    return page_find_cell_in(page, key, key_size, key_hint, lo, hi);
+}
+
+Value page_data_by_key(BTPage* page, const void* key, u32 key_size) {
+    int pos = page_find_cell(page, key, key_size);
+    Value v = { .size = 0, .data = 0 };
+    if (pos != -1) {
+        v = page_data_at(page, pos);
+    }
+    return v;
+}
+
+u16 page_insertion_point(BTPage* page, const void* key, u32 key_size) {
+    if (page->hdr->cell_count == 0) {
+        return 0;
+    }
+
+    u32 key_hint = page_key_hint(page, key, key_size);
+    u16 lo, hi, mid;
+    page_hint_range(page, key_hint, &lo, &hi);
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        int cmp_res = page_compare_at(page, mid, key, key_size, key_hint);
+
+        if (cmp_res > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void page_move_cells(BTPage* page, u16 from) {
+    u32 slot_size = page_slot_size(page);
+    char* src = (char*)page->cell_ptrs + from * slot_size;
+    char* dest = src + slot_size;
+    memmove(dest, src, slot_size * (page->hdr->cell_count - from));
+}
+
+int page_insert_freespace(
+    BTPage* page,
+    int size
+) {
+    BTFreeBlock first = page_freeblock_get(page, 0);
+    first.end_offset -= size;
+    first.start_offset += PAGE_FREE_BLOCK_SIZE;
+    page_freeblock_set(page, 0, first);
+    // page->hdr->freespace -= size;
+
+    if (page->hdr->freeblock_count > 1) {
+        page_freeblocks_move(page, 1);
+    }
+
+    BTFreeBlock new_second = { .start_offset = first.end_offset, .end_offset = first.end_offset + size };
+    page_freeblock_set(page, 1, new_second);
+    page->hdr->freespace -= PAGE_FREE_BLOCK_SIZE;
+    page->hdr->freeblock_count++;
+
+    return Ok;
+}
+
+// Write cell content at 'offset' and point slot at 'pos' to it.
+void page_write_cell(
+    BTPage* page, u16 pos, u32 offset,
+    const void* key, u32 key_size,
+    const void* local, u32 local_size,
+    u32 data_size
+) {
+    char* dest = page->pdata + offset;
+    if (page->hdr->slot_format == CompactSlots) {
+        dest += varint_put(dest, key_size);
+        dest += varint_put(dest, data_size);
+    } else {
+        BTCellPtr* cellptr = page_cellptr_at(page, pos);
+        cellptr->key_hint = page_key_hint(page, key, key_size);
+        cellptr->key_size = key_size;
+        cellptr->data_size = data_size;
+    }
+    page_set_cell_offset(page, pos, offset);
+    memcpy(dest, key, key_size);
+    memcpy(dest + key_size, local, local_size);
+}
+
+// Insert or overwrite cell.
+// 'local' holds local part of data ('local_size' bytes) as it
+// should be stored in the page (see cell_local_size), 'data_size'
+// is the full size of data.
+int page_cell_insert(
     BTPage* page,
     const void* key, u32 key_size,
-    const void* data, u32 data_size
+    const void* local, u32 local_size,
+    u32 data_size
 ) {
 
-    int payload_size = key_size + data_size;
-    printf("got %d, max payload size: %d\n", payload_size, MAX_PAYLOAD_SIZE);
-    if (payload_size > MAX_PAYLOAD_SIZE) {
+    u32 page_size = page->hdr->page_size;
+    u32 payload_size = key_size + local_size;
+    if (payload_size > max_payload_size(page_size)) {
         return PayloadTooBig;
     }
+    assert(payload_size == cell_local_size(page_size, key_size, data_size));
 
-    u16 data_offset;
-    u16 key_offset;
-    BTCellPtr* cellptr = page_find_cellptr(page, key, key_size);
+    u32 new_size = page_cell_header_size(page, key_size, data_size) + payload_size;
+    u32 cell_offset;
+    int pos = page_find_cell(page, key, key_size);
 
-    if (cellptr == NULL) {
+    if (pos == -1) {
         // key to insert doesn't exist in current page
 
-        u16 required_space = payload_size + PAGE_CELL_PTR_SIZE;
+        u32 required_space = new_size + page_slot_size(page);
         if (page->hdr->freespace < required_space) {
             if (page_estimate_freespace_after_defrag(page) >= required_space) {
                 page_defragment(page, NULL);
             } else {
-                printf("not enough free space, have: %d required: %d\n",
-                    page->hdr->freespace, required_space
-                );
                 return NotEnoughSpace;
             }
         }
 
         int rc = page_cell_alloc(page);
         if (rc != Ok) {
-            printf("can't fit new cell into first free block\n");
             return FreeBlockNotFound;
         }
 
-        int size = key_size + data_size;
-        int offset = page_space_alloc(page, size);
+        int offset = page_space_alloc(page, new_size);
         if (offset == -1) {
-            printf("there are no freeblocks >= %d bytes\n", size);
             page_cell_dealloc(page);
             return FreeBlockNotFound;
         }
 
         // okay, there is enough space for both cellptr and payload
         // find insertion point for cellptr 
-        u16 ins_point = page_insertion_point(page, key, key_size);
-        cellptr = page_cellptr_at(page, ins_point);
+        pos = page_insertion_point(page, key, key_size);
 
         // we need move free blocks to make space for new cell
         page_freeblocks_move_all(page);
 
         // if new cell should be inserted somewhere within 
         // existing cells then move other cells to the right to make space 
-        if (ins_point < page->hdr->cell_count) {
-            page_move_cells(page, ins_point);
+        if (pos < page->hdr->cell_count) {
+            page_move_cells(page, pos);
         }
 
         // update page hdr
         page->hdr->cell_count++;
 
-        // calculate byte offsets for key and data payload
-        data_offset = offset - data_size;
-        key_offset = data_offset - key_size;
+        cell_offset = offset - new_size;
     } else {
         // overwrite
-        u16 curr_size = cellptr->key_size + cellptr->data_size;
-        u16 new_size = key_size + data_size;
-        int diff = curr_size - new_size;
+        u32 curr_start = page_cell_offset(page, pos);
+        u32 curr_size = page_cell_size(page, pos);
+        int diff = (int)curr_size - (int)new_size;
 
         if (diff >= 0) {
             // new payload can fit within the space old payload takes
             // just overwrite it 
-            key_offset = cellptr->offset + diff;
-            data_offset = key_offset + key_size;
+            cell_offset = curr_start + diff;
 
             if (diff > 0) {
                 // there will be some free space after writting new data 
                 // deallocate that space (add it to the list of free blocks)
-                u16 start = cellptr->offset;
-                u16 end = cellptr->offset + diff;
-                if (page_space_dealloc(page, start, end) != Ok) {
+                if (page_space_dealloc(page, curr_start, curr_start + diff) != Ok) {
                     // todo: 
                     // see if we can defrag here to avoid splitting
                     return NotEnoughSpace;
                 }
             }
         } else {
-            u16 curr_start = cellptr->offset;
-            u16 curr_end = curr_start + curr_size;
+            u32 curr_end = curr_start + curr_size;
             int new_offset;
 
+            // check upfront if defrag can make enough space
+            // so that we never have to undo the dealloc
+            u32 space_after_defrag = page_estimate_freespace_after_defrag(page) + curr_size;
+            if (space_after_defrag < new_size) {
+                // defrag wont help
+                // insert fails
+                return NotEnoughSpace;
+            }
+
             // try to dealloc old data
             // dealloc can fail in some cases if there is not enough space for new free block
+            // either way defrag treats old data as free space
+            BTFreeBlock extra_fb = { .start_offset = curr_start, .end_offset = curr_end };
             if (page_space_dealloc(page, curr_start, curr_end) != Ok) {
-
                 // ok, dealloc failed
-                // lets see if we can make enough space by defragmenting the page
-                int space_after_defrag = page_estimate_freespace_after_defrag(page) + curr_size;
-                if (space_after_defrag >= new_size) {
-                    // things look good, lets defrag and write new data
-                    BTFreeBlock extra_fb = { .start_offset = curr_start, .end_offset = curr_end };
-                    page_defragment(page, &extra_fb);
-                    new_offset = page_space_alloc(page, new_size);
-                } else {
-                    // defrag wont help
-                    // insert fails
-                    return NotEnoughSpace;
-                }
+                // defrag page and write new data
+                page_defragment(page, &extra_fb);
+                new_offset = page_space_alloc(page, new_size);
             } else {
                 new_offset = page_space_alloc(page, new_size);
                 if (new_offset == -1) {
-                    int space_after_defrag = page_estimate_freespace_after_defrag(page) + curr_size;
-                    if (space_after_defrag >= new_size) {
-                        // things look good, lets defrag and write new data
-                        BTFreeBlock extra_fb = { .start_offset = curr_start, .end_offset = curr_end };
-                        page_defragment(page, &extra_fb);
-                        new_offset = page_space_alloc(page, new_size);
-                    } else {
-                        // undo dealloc made in the begging
-                        // always succeeds
-                        int r = page_space_alloc(page, curr_size);
-                        assert(r != -1);
-                        return NotEnoughSpace;
-                    }
+                    // old data is already in free blocks, defrag and try again
+                    page_defragment(page, &extra_fb);
+                    new_offset = page_space_alloc(page, new_size);
                 }
             }
             assert(new_offset != -1);
 
             // at this point we have deallocated the old data
             // and we are sure that there is enough space for new data
-
-            data_offset = new_offset - data_size;
-            key_offset = data_offset - key_size;
+            cell_offset = new_offset - new_size;
         }
     }
 
-    // copy payload into data section
-    memcpy(page->pdata + data_offset, data, data_size);
-    memcpy(page->pdata + key_offset, key, key_size);
-
-    // update cellptr
-    cellptr->key_size = key_size;
-    cellptr->data_size = data_size;
-    cellptr->offset = key_offset;
-
+    page_write_cell(page, pos, cell_offset, key, key_size, local, local_size, data_size);
     return Ok;
 }
 
+int page_leaf_insert(
+    BTPage* page,
+    const void* key, u32 key_size,
+    const void* data, u32 data_size
+) {
+    return page_cell_insert(page, key, key_size, data, data_size, data_size);
+}
+
+// Return position of the first cell that goes to the right page.
+// Cells are split by their byte size so that both halves
+// end up with roughly the same amount of used space.
 int page_find_splitpoint(BTPage* page) {
-    assert(page->hdr->cell_count > 0);
+    assert(page->hdr->cell_count > 1);
+
+    int slot_size = page_slot_size(page);
+    int total = 0;
+    for (int i = 0; i < page->hdr->cell_count; i++) {
+        total += slot_size + page_cell_size(page, i);
+    }
 
-    int bytes_to_take = (PAGE_SIZE - PAGE_HDR_SIZE) / 2;
+    int bytes_to_take = total / 2;
     int taken = 0;
 
     for (int i = 0; i < page->hdr->cell_count; i++) {
-        BTCellPtr* cellptr = page_cellptr_at(page, i);
-        int sz = PAGE_CELL_PTR_SIZE + cellptr->data_size + cellptr->key_size;
-        taken += sz;
-        if (taken > bytes_to_take) {
-            return i;
+        int sz = slot_size + page_cell_size(page, i);
+        if (taken + sz / 2 > bytes_to_take) {
+            return i > 0 ? i : 1;
         }
+        taken += sz;
     }
 
-    return -1;
+    return page->hdr->cell_count - 1;
 }
 
-// BTPageSplitResult page_leaf_split(BTPage* page) {
-//     assert(page->hdr->is_leaf == 1);
+// Allocate slot after the last cell of the page together
+// with 'size' bytes of cell space. Return position of the new cell.
+// Caller must make sure that the page is compact (single free block)
+// e.g. freshly created. Returns -1 if there is not enough space.
+int page_append_alloc(BTPage* page, u32 size) {
+    if (page->hdr->freespace < size + page_slot_size(page)) {
+        return -1;
+    }
 
-//     BTPage* left = page_blank();
-//     left->hdr->is_leaf = page->hdr->is_leaf;
-//     left->hdr->pid = page->hdr->pid;
+    if (page_cell_alloc(page) != Ok) {
+        return -1;
+    }
 
-//     BTPage* right = page_new(page->btree);
-//     right->hdr->is_leaf = page->hdr->is_leaf;
+    int offset = page_space_alloc(page, size);
+    if (offset == -1) {
+        page_cell_dealloc(page);
+        return -1;
+    }
 
-//     int splitpoint = page_find_splitpoint(page);
+    page_freeblocks_move_all(page);
+    u16 pos = page->hdr->cell_count++;
+    page_set_cell_offset(page, pos, offset - size);
+    return pos;
+}
 
+// Append cell after the last cell of the page.
+// Caller must make sure that key is larger then all keys in the page
+// and that the page is compact (single free block) e.g. freshly created.
+int page_append_cell(
+    BTPage* page,
+    const void* key, u32 key_size,
+    const void* data, u32 data_size
+) {
+    u32 size = page_cell_header_size(page, key_size, data_size) + key_size + data_size;
+    int pos = page_append_alloc(page, size);
+    if (pos == -1) {
+        return NotEnoughSpace;
+    }
 
-//     // copy first half of cells and their payloads to 'left' page
-//     for (int i = 0; i < splitpoint; i++) {
+    page_write_cell(page, pos, page_cell_offset(page, pos), key, key_size, data, data_size, data_size);
+    return Ok;
+}
 
-//         // get source and destination cell pointers
-//         BTCellPtr* src_cellptr = page_cellptr_at(page, i);
-//         BTCellPtr* dest_cellptr = page_cellptr_at(left, i);
+// Copy cells [from, to) of 'src' page to the end of 'dest' page.
+// Both pages must use the same slot format.
+void page_copy_cells(BTPage* src, BTPage* dest, u16 from, u16 to) {
+    assert(src->hdr->slot_format == dest->hdr->slot_format);
 
-//         // update metadata of left page
-//         int payload_size = src_cellptr->key_size + src_cellptr->data_size;
-//         left->hdr->freespace_end -= payload_size;
-//         left->hdr->freespace -= (payload_size + PAGE_CELL_PTR_SIZE);
-//         left->hdr->cell_count++;
+    for (u16 i = from; i < to; i++) {
+        u32 src_offset = page_cell_offset(src, i);
+        u32 size = page_cell_size(src, i);
+        int pos = page_append_alloc(dest, size);
+        assert(pos != -1);
 
-//         // update destination cell pointer metadata
-//         dest_cellptr->offset = left->hdr->freespace_end;
-//         dest_cellptr->data_size = src_cellptr->data_size;
-//         dest_cellptr->key_size = src_cellptr->key_size;
+        u32 dest_offset = page_cell_offset(dest, pos);
+        if (src->hdr->slot_format == WideSlots) {
+            *page_cellptr_at(dest, pos) = *page_cellptr_at(src, i);
+            page_cellptr_at(dest, pos)->offset = dest_offset;
+        }
+        memcpy(dest->pdata + dest_offset, src->pdata + src_offset, size);
+    }
+}
 
-//         // copy key and data payload
-//         memcpy(
-//             left->pdata + dest_cellptr->offset,
-//             page->pdata + src_cellptr->offset,
-//             payload_size
-//         );
-//     }
+// Replace content of 'page' with content of 'src' page, keeping page id
+// and version.
+void page_replace(BTPage* page, BTPage* src) {
+    assert(page->hdr->page_size == src->hdr->page_size);
+    src->hdr->pid = page->hdr->pid;
+    src->hdr->version = page->hdr->version;
+    memcpy(page->pdata, src->pdata, page->hdr->page_size);
+    page_reload(page);
+}
 
-//     // copy second half of cells and their payloads to 'right' page
-//     int right_cell_pos = 0;
-//     for (int i = splitpoint; i < page->hdr->cell_count; i++) {
-//         // get source and destination cell pointers
-//         BTCellPtr* src_cellptr = page_cellptr_at(page, i);
-//         BTCellPtr* dest_cellptr = page_cellptr_at(right, right_cell_pos);
+BTPageSplitResult page_leaf_split(BTPage* page) {
+    assert(page->hdr->is_leaf == 1);
 
-//         // update right page metadata
-//         int payload_size = src_cellptr->key_size + src_cellptr->data_size;
-//         right->hdr->freespace_end -= payload_size;
-//         right->hdr->cell_count++;
-//         right->hdr->freespace -= (payload_size + PAGE_CELL_PTR_SIZE);
+    BTPage* left = page_blank(page->hdr->page_size);
+    left->hdr->is_leaf = page->hdr->is_leaf;
+    left->hdr->alloc_policy = page->hdr->alloc_policy;
+    left->hdr->slot_format = page->hdr->slot_format;
+    left->hdr->counted = page->hdr->counted;
 
-//         // update destination cell pointer metadata
-//         dest_cellptr->offset = right->hdr->freespace_end;
-//         dest_cellptr->data_size = src_cellptr->data_size;
-//         dest_cellptr->key_size = src_cellptr->key_size;
+    BTPage* right = page_new(page->btree);
+    right->hdr->is_leaf = page->hdr->is_leaf;
 
-//         // copy data
-//         memcpy(
-//             right->pdata + dest_cellptr->offset,
-//             page->pdata + src_cellptr->offset,
-//             payload_size
-//         );
+    // 'right' goes between the page and its next leaf
+    right->hdr->rightmost_pid = page->hdr->rightmost_pid;
+    right->hdr->prev_pid = page->hdr->pid;
+    left->hdr->rightmost_pid = right->hdr->pid;
+    left->hdr->prev_pid = page->hdr->prev_pid;
+    if (right->hdr->rightmost_pid != NO_PID) {
+        buffer[right->hdr->rightmost_pid]->hdr->prev_pid = right->hdr->pid;
+    }
 
-//         // advence cellptr position of right page
-//         right_cell_pos++;
-//     }
+    int splitpoint = page_find_splitpoint(page);
 
-//     // here we copy the contents of left page (helper struct) into original page
-//     memcpy(page->pdata, left->pdata, PAGE_SIZE);
-//     page_destroy(left);
+    // copy first half of cells and their payloads to 'left' page
+    // and second half to 'right' page
+    page_copy_cells(page, left, 0, splitpoint);
+    page_copy_cells(page, right, splitpoint, page->hdr->cell_count);
 
-//     return (BTPageSplitResult) {
-//         .status = Ok, .page = page, .new_page = right
-//     };
-// }
+    // here we copy the contents of left page (helper struct) into original page
+    page_replace(page, left);
+    page_destroy(left);
+    page_bump_version(page);
+    page_blink_split(page, right, page_key_at(right, 0));
 
-BTree* btree_new(int (*cmp)(const void*, u32, const void*, u32)) {
-    BTree* btree = malloc(sizeof(BTree));
-    BTPage* root_page = page_new(btree);
-    root_page->hdr->is_leaf = 1;
+    return (BTPageSplitResult) {
+        .status = Ok, .page = page, .new_page = right
+    };
+}
 
-    u32 root_page_id = root_page->hdr->pid;
-    buffer[root_page_id] = root_page;
+u32 page_child_at(BTPage* page, u16 pos) {
+    assert(page->hdr->is_leaf == 0);
+    if (pos == page->hdr->cell_count) {
+        return page->hdr->rightmost_pid;
+    }
+    u32 pid;
+    memcpy(&pid, page_data_at(page, pos).data, sizeof(u32));
+    return pid;
+}
 
-    btree->root_page_id = root_page_id;
-    btree->cmp = cmp;
-    return btree;
+void page_set_child_at(BTPage* page, u16 pos, u32 pid) {
+    assert(page->hdr->is_leaf == 0);
+    if (pos == page->hdr->cell_count) {
+        page->hdr->rightmost_pid = pid;
+    } else {
+        memcpy((char*)page_data_at(page, pos).data, &pid, sizeof(u32));
+    }
 }
 
-void btree_destroy(BTree* btree) {
-    free(btree);
+// Data of internal cell is the child pid, in counted
+// tree it is followed by entry count of the child.
+u32 page_child_data_size(BTPage* page) {
+    return page->hdr->counted ? 2 * sizeof(u32) : sizeof(u32);
 }
 
-void reset_buffer() {
-    for (int i = 0; i < 100; i++) {
-        if (buffer[i] != NULL) {
-            page_destroy(buffer[i]);
+// Entry count of the child at given position, 0 if tree is not counted.
+u32 page_child_count(BTPage* page, u16 pos) {
+    assert(page->hdr->is_leaf == 0);
+    if (!page->hdr->counted) {
+        return 0;
+    }
+    if (pos == page->hdr->cell_count) {
+        return page->hdr->prev_pid;
+    }
+    u32 count;
+    memcpy(&count, (char*)page_data_at(page, pos).data + sizeof(u32), sizeof(u32));
+    return count;
+}
+
+void page_set_child_count(BTPage* page, u16 pos, u32 count) {
+    assert(page->hdr->is_leaf == 0);
+    if (!page->hdr->counted) {
+        return;
+    }
+    if (pos == page->hdr->cell_count) {
+        page->hdr->prev_pid = count;
+    } else {
+        memcpy((char*)page_data_at(page, pos).data + sizeof(u32), &count, sizeof(u32));
+    }
+}
+
+// Number of entries in the subtree of the page.
+u32 page_subtree_count(BTPage* page) {
+    if (page->hdr->is_leaf) {
+        return page->hdr->cell_count;
+    }
+    u32 count = 0;
+    for (u16 i = 0; i <= page->hdr->cell_count; i++) {
+        count += page_child_count(page, i);
+    }
+    return count;
+}
+
+// Return position of the child page that may contain the key.
+// Cell at position i points to the page with keys smaller then cell key,
+// so this is the first cell with key larger then searched key
+// or cell_count if there is no such cell (rightmost page).
+// Only cells [lo, hi) are searched, see page_hint_range.
+u16 page_child_position_in(BTPage* page, const void* key, u32 key_size, u32 key_hint, u16 lo, u16 hi) {
+    u16 mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        int cmp_res = page_compare_at(page, mid, key, key_size, key_hint);
+
+        if (cmp_res >= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        buffer[i] = NULL;
     }
+    return lo;
+}
+
+u16 page_child_position(BTPage* page, const void* key, u32 key_size) {
+    u32 key_hint = page_key_hint(page, key, key_size);
+    u16 lo, hi;
+    page_hint_range(page, key_hint, &lo, &hi);
+    return page_child_position_in(page, key, key_size, key_hint, lo, hi);
+}
+
+// Split internal page into two.
+// Middle cell is not copied to any page, its key is written into 'sep'
+// (must hold at least max_payload_size bytes) and its child
+// becomes rightmost child of the left page.
+BTPageSplitResult page_internal_split(BTPage* page, char* sep, u32* sep_size) {
+    assert(page->hdr->is_leaf == 0);
+
+    BTPage* left = page_blank(page->hdr->page_size);
+    left->hdr->is_leaf = page->hdr->is_leaf;
+    left->hdr->alloc_policy = page->hdr->alloc_policy;
+    left->hdr->slot_format = page->hdr->slot_format;
+    left->hdr->counted = page->hdr->counted;
+
+    BTPage* right = page_new(page->btree);
+    right->hdr->is_leaf = page->hdr->is_leaf;
+
+    int splitpoint = page_find_splitpoint(page);
+
+    Value sep_key = page_key_at(page, splitpoint);
+    memcpy(sep, sep_key.data, sep_key.size);
+    *sep_size = sep_key.size;
+
+    page_copy_cells(page, left, 0, splitpoint);
+    left->hdr->rightmost_pid = page_child_at(page, splitpoint);
+    page_set_child_count(left, left->hdr->cell_count, page_child_count(page, splitpoint));
+
+    page_copy_cells(page, right, splitpoint + 1, page->hdr->cell_count);
+    right->hdr->rightmost_pid = page->hdr->rightmost_pid;
+    page_set_child_count(right, right->hdr->cell_count, page_child_count(page, page->hdr->cell_count));
+
+    page_replace(page, left);
+    page_destroy(left);
+    page_blink_split(page, right, (Value) { .data = sep, .size = *sep_size });
+
+    return (BTPageSplitResult) {
+        .status = Ok, .page = page, .new_page = right
+    };
+}
+
+// Insert into page, defragmenting it when free space is
+// large enough but too scattered to fit the new cell.
+int page_insert(
+    BTPage* page,
+    const void* key, u32 key_size,
+    const void* local, u32 local_size,
+    u32 data_size
+) {
+    int rc = page_cell_insert(page, key, key_size, local, local_size, data_size);
+    if (rc == FreeBlockNotFound) {
+        page_defragment(page, NULL);
+        rc = page_cell_insert(page, key, key_size, local, local_size, data_size);
+    }
+    if (rc == FreeBlockNotFound) {
+        rc = NotEnoughSpace;
+    }
+    return rc;
+}
+
+// Insert internal cell pointing to the child with 'count' entries.
+int page_insert_child(BTPage* page, const void* key, u32 key_size, u32 child_pid, u32 count) {
+    u32 data[2] = { child_pid, count };
+    u32 data_size = page_child_data_size(page);
+    return page_insert(page, key, key_size, data, data_size, data_size);
+}
+
+// Insert separator key into internal page.
+// Keys smaller then separator are in 'left_pid' page
+// and the rest is in 'right_pid' page.
+// In counted tree entries of the split page are divided between
+// the halves, 'left_pid' page gets its actual count.
+int page_internal_insert(
+    BTPage* page,
+    const void* key, u32 key_size,
+    u32 left_pid, u32 right_pid
+) {
+    u16 pos = page_insertion_point(page, key, key_size);
+    u32 count = page_child_count(page, pos);
+    u32 left_count = page->hdr->counted ? page_subtree_count(buffer[left_pid]) : 0;
+    int rc = page_insert_child(page, key, key_size, left_pid, left_count);
+    if (rc != Ok) {
+        return rc;
+    }
+
+    // cell (or rightmost pid) after the new one used to point
+    // to the page that was split, now it points to its right half
+    page_set_child_at(page, pos + 1, right_pid);
+    page_set_child_count(page, pos + 1, count - left_count);
+    return Ok;
+}
+
+// Remove slot at given position, the slots after it and the
+// freeblock array are moved to the left. Cell space is not released.
+void page_remove_slot(BTPage* page, u16 pos) {
+    assert(pos < page->hdr->cell_count);
+
+    u32 slot_size = page_slot_size(page);
+    char* dest = (char*)page->cell_ptrs + pos * slot_size;
+    char* end = (char*)(page->freeblocks + page->hdr->freeblock_count);
+    memmove(dest, dest + slot_size, end - dest - slot_size);
+
+    page->hdr->cell_count--;
+    page->freeblocks = (BTFreeBlock*)((char*)page->freeblocks - slot_size);
+    BTFreeBlock first = page_freeblock_get(page, 0);
+    first.start_offset -= slot_size;
+    page_freeblock_set(page, 0, first);
+    page->hdr->freespace += slot_size;
+}
+
+// Delete cell at given position.
+// Cell space is returned to free blocks (merged with neighbouring
+// free blocks), when there is no room for a new free block entry
+// the page is defragmented instead.
+void page_delete_at(BTPage* page, u16 pos) {
+    u32 start = page_cell_offset(page, pos);
+    u32 end = start + page_cell_size(page, pos);
+    if (page_space_dealloc(page, start, end) != Ok) {
+        BTFreeBlock extra_fb = { .start_offset = start, .end_offset = end };
+        page_defragment(page, &extra_fb);
+    }
+    page_remove_slot(page, pos);
+}
+
+int page_leaf_delete(BTPage* page, const void* key, u32 key_size) {
+    int pos = page_find_cell(page, key, key_size);
+    if (pos == -1) {
+        return KeyNotFound;
+    }
+    page_delete_at(page, pos);
+    return Ok;
+}
+
+// Delete cells at given positions (sorted, unique) in one pass.
+// Slots of remaining cells are moved once and the page
+// is compacted, so cell space is reclaimed at once.
+void page_delete_batch(BTPage* page, const u16* positions, u16 n) {
+    if (n == 0) {
+        return;
+    }
+
+    u32 slot_size = page_slot_size(page);
+    char* slots = (char*)page->cell_ptrs;
+    u16 cell_count = page->hdr->cell_count;
+    u16 write = positions[0];
+    for (u16 i = 0; i < n; i++) {
+        assert(i == 0 || positions[i - 1] < positions[i]);
+        u16 from = positions[i] + 1;
+        u16 to = i + 1 < n ? positions[i + 1] : cell_count;
+        memmove(slots + write * slot_size, slots + from * slot_size, (to - from) * slot_size);
+        write += to - from;
+    }
+
+    page->hdr->cell_count = write;
+    page_reload(page);
+    page_defragment(page, NULL);
+}
+
+// Underflow
+// Page that is filled below merge threshold after delete is merged
+// with its sibling when both fit into one page, otherwise cells are
+// moved from the sibling so that both pages are about equally filled.
+/////////////////////////////////////////////////
+
+// Space taken by slots and cells, i.e. used space of defragmented page.
+u32 page_used_size(BTPage* page) {
+    return page_data_size(page->hdr->page_size) - page_estimate_freespace_after_defrag(page);
+}
+
+bool page_underflows(BTPage* page, u32 merge_threshold) {
+    u32 data_size = page_data_size(page->hdr->page_size);
+    return (u64)page_used_size(page) * 100 < (u64)data_size * merge_threshold;
+}
+
+// Return position of the child with given pid in internal page.
+u16 page_child_index(BTPage* page, u32 pid) {
+    for (u16 i = 0; i < page->hdr->cell_count; i++) {
+        if (page_child_at(page, i) == pid) {
+            return i;
+        }
+    }
+    assert(page->hdr->rightmost_pid == pid);
+    return page->hdr->cell_count;
+}
+
+// Insert copy of the cell at 'pos' of 'src' page,
+// local part of overflown data is copied together with overflow pid.
+int page_insert_copy(BTPage* page, BTPage* src, u16 pos) {
+    BTCell cell = page_cell_at(src, pos);
+    Value key = page_cell_key(src, &cell);
+    Value data = page_cell_data(src, &cell);
+    u32 local_size = cell_local_size(src->hdr->page_size, cell.key_size, cell.data_size) - cell.key_size;
+    return page_insert(page, key.data, key.size, data.data, local_size, cell.data_size);
+}
+
+// Check if 'right' page fits into 'left' page, for internal
+// pages separator of the pair in parent is moved down as well.
+bool page_can_merge(BTPage* left, BTPage* right, Value sep) {
+    u32 size = page_used_size(left) + page_used_size(right);
+    if (!left->hdr->is_leaf) {
+        u32 data_size = page_child_data_size(left);
+        size += page_slot_size(left) + page_cell_header_size(left, sep.size, data_size) + sep.size + data_size;
+    }
+    return size <= page_data_size(left->hdr->page_size);
+}
+
+// Move all cells of 'right' page into 'left' page.
+// Internal pages get separator cell pointing to the rightmost
+// child of 'left' page and take over rightmost child of 'right' page,
+// leaves take over the next link of 'right' page.
+void page_merge(BTPage* left, BTPage* right, Value sep) {
+    if (left->hdr->is_leaf) {
+        left->hdr->rightmost_pid = right->hdr->rightmost_pid;
+        if (right->hdr->rightmost_pid != NO_PID) {
+            buffer[right->hdr->rightmost_pid]->hdr->prev_pid = left->hdr->pid;
+        }
+    } else {
+        u32 count = page_child_count(left, left->hdr->cell_count);
+        int rc = page_insert_child(left, sep.data, sep.size, left->hdr->rightmost_pid, count);
+        assert(rc == Ok);
+        left->hdr->rightmost_pid = right->hdr->rightmost_pid;
+        page_set_child_count(left, left->hdr->cell_count, page_child_count(right, right->hdr->cell_count));
+    }
+
+    for (u16 i = 0; i < right->hdr->cell_count; i++) {
+        int rc = page_insert_copy(left, right, i);
+        assert(rc == Ok);
+    }
+}
+
+// Move cells from the fuller page of the pair to the other one until
+// both hold about the same amount of data. 'sep' holds separator key
+// of the pair in parent (must hold at least max_payload_size bytes),
+// it is replaced with the new separator.
+void page_redistribute(BTPage* left, BTPage* right, char* sep, u32* sep_size) {
+    bool is_leaf = left->hdr->is_leaf;
+    u32 slot_size = page_slot_size(left);
+
+    // move first cells of right page to the left
+    while (right->hdr->cell_count > 1) {
+        u32 size = slot_size + page_cell_size(right, 0);
+        if (page_used_size(left) + size >= page_used_size(right) - size) {
+            break;
+        }
+
+        if (is_leaf) {
+            int rc = page_insert_copy(left, right, 0);
+            assert(rc == Ok);
+        } else {
+            // separator goes down to the left page,
+            // first key of the right page goes up
+            u32 count = page_child_count(left, left->hdr->cell_count);
+            int rc = page_insert_child(left, sep, *sep_size, left->hdr->rightmost_pid, count);
+            assert(rc == Ok);
+            left->hdr->rightmost_pid = page_child_at(right, 0);
+            page_set_child_count(left, left->hdr->cell_count, page_child_count(right, 0));
+            Value key = page_key_at(right, 0);
+            memcpy(sep, key.data, key.size);
+            *sep_size = key.size;
+        }
+        page_delete_at(right, 0);
+    }
+
+    // move last cells of left page to the right
+    while (left->hdr->cell_count > 1) {
+        u16 last = left->hdr->cell_count - 1;
+        u32 size = slot_size + page_cell_size(left, last);
+        if (page_used_size(right) + size >= page_used_size(left) - size) {
+            break;
+        }
+
+        if (is_leaf) {
+            int rc = page_insert_copy(right, left, last);
+            assert(rc == Ok);
+        } else {
+            // separator goes down to the right page,
+            // last key of the left page goes up
+            u32 count = page_child_count(left, left->hdr->cell_count);
+            int rc = page_insert_child(right, sep, *sep_size, left->hdr->rightmost_pid, count);
+            assert(rc == Ok);
+            left->hdr->rightmost_pid = page_child_at(left, last);
+            page_set_child_count(left, left->hdr->cell_count, page_child_count(left, last));
+            Value key = page_key_at(left, last);
+            memcpy(sep, key.data, key.size);
+            *sep_size = key.size;
+        }
+        page_delete_at(left, last);
+    }
+
+    if (is_leaf) {
+        Value key = page_key_at(right, 0);
+        memcpy(sep, key.data, key.size);
+        *sep_size = key.size;
+    }
+}
+
+BTree* btree_new_with_config(
+    int (*cmp)(const void*, u32, const void*, u32),
+    BTreeConfig* config
+) {
+    BTree* btree = malloc(sizeof(BTree));
+    btree->alloc_policy = config->alloc_policy;
+    btree->hint = config->hint;
+    btree->page_size = config->page_size != 0 ? config->page_size : PAGE_SIZE;
+    btree->slot_format = config->slot_format;
+    btree->merge_threshold = config->merge_threshold != 0 ? config->merge_threshold : MERGE_THRESHOLD;
+    btree->freelist_pid = NO_PID;
+    btree->free_page_count = 0;
+    btree->version = 0;
+    btree->concurrent = config->concurrent;
+    btree->root_latch = 0;
+    btree->counted = config->counted;
+    btree->count = 0;
+    btree->finger = (BTFinger) { .enabled = !config->disable_finger && !config->concurrent && !config->counted, .pid = NO_PID };
+    if (btree->finger.enabled) {
+        btree->finger.low = malloc(max_key_size(btree->page_size));
+        btree->finger.high = malloc(max_key_size(btree->page_size));
+    }
+    assert(btree->merge_threshold <= 50);
+    assert(btree->page_size >= MIN_PAGE_SIZE && btree->page_size <= MAX_PAGE_SIZE);
+    assert(btree->slot_format == WideSlots || btree->page_size <= MAX_COMPACT_PAGE_SIZE);
+    assert(btree->slot_format == WideSlots || !btree->concurrent);
+    assert(!btree->counted || !btree->concurrent);
+    BTPage* root_page = page_new(btree);
+    root_page->hdr->is_leaf = 1;
+    root_page->hdr->rightmost_pid = NO_PID;
+    root_page->hdr->prev_pid = NO_PID;
+
+    u32 root_page_id = root_page->hdr->pid;
+    buffer[root_page_id] = root_page;
+
+    btree->root_page_id = root_page_id;
+    btree->cmp = cmp;
+    return btree;
+}
+
+BTree* btree_new(int (*cmp)(const void*, u32, const void*, u32)) {
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = NULL, .page_size = PAGE_SIZE };
+    return btree_new_with_config(cmp, &config);
+}
+
+void btree_destroy(BTree* btree) {
+    free(btree->finger.low);
+    free(btree->finger.high);
+    free(btree);
+}
+
+// Overflow pages
+// Overflow page holds overflow_data_size bytes of data right after
+// the page header, 'rightmost_pid' links to the next page in the chain.
+// Chain length follows from data size so the last link is not used.
+/////////////////////////////////////////////////
+
+u32 overflow_page_count(u32 page_size, u32 size) {
+    u32 capacity = overflow_data_size(page_size);
+    return (size + capacity - 1) / capacity;
+}
+
+// Write data into a new chain of overflow pages.
+// Return pid of the first page in the chain.
+u32 overflow_write(BTree* btree, const char* data, u32 size) {
+    assert(size > 0);
+
+    u32 capacity = overflow_data_size(btree->page_size);
+    u32 first_pid = 0;
+    BTPage* prev = NULL;
+    while (size > 0) {
+        BTPage* page = page_new(btree);
+        u32 n = size < capacity ? size : capacity;
+        memcpy(page->pdata + PAGE_HDR_SIZE, data, n);
+
+        if (prev == NULL) {
+            first_pid = page->hdr->pid;
+        } else {
+            prev->hdr->rightmost_pid = page->hdr->pid;
+        }
+
+        prev = page;
+        data += n;
+        size -= n;
+    }
+    return first_pid;
+}
+
+void overflow_free(u32 pid, u32 size) {
+    for (u32 i = overflow_page_count(buffer[pid]->hdr->page_size, size); i > 0; i--) {
+        u32 next_pid = buffer[pid]->hdr->rightmost_pid;
+        page_free(pid);
+        pid = next_pid;
+    }
+}
+
+// Release overflow pages of the cell at given position, if any.
+void page_free_overflow(BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    u32 local_data_size = cell_local_data_size(page->hdr->page_size, cell.key_size, cell.data_size);
+    if (cell.data_size > local_data_size) {
+        overflow_free(page_overflow_pid(page, pos), cell.data_size - local_data_size);
+    }
+}
+
+// Build local part of data that is stored in the page.
+// That is data itself if the cell fits into the page, otherwise the tail
+// of data is moved to new overflow pages and local part is data prefix
+// followed by the first overflow pid, built in 'local' buffer
+// (must hold at least max_payload_size bytes).
+const void* overflow_local(
+    BTree* btree,
+    u32 key_size,
+    const void* data, u32 data_size,
+    char* local, u32* local_size
+) {
+    u32 page_size = btree->page_size;
+    *local_size = cell_local_size(page_size, key_size, data_size) - key_size;
+    if (!cell_overflows(page_size, key_size, data_size)) {
+        return data;
+    }
+
+    u32 prefix_size = cell_local_data_size(page_size, key_size, data_size);
+    u32 overflow_pid = overflow_write(btree, (const char*)data + prefix_size, data_size - prefix_size);
+    memcpy(local, data, prefix_size);
+    memcpy(local + prefix_size, &overflow_pid, sizeof(u32));
+    return local;
+}
+
+// Stream over value in chunks: local part of the value
+// and then data of each overflow page. Chunks point directly
+// into page memory and are valid until the tree is modified.
+typedef struct BTValueStream {
+    Value local;
+    bool local_done;
+    u32 next_pid;
+    u32 remaining;
+} BTValueStream;
+
+void value_stream_open(BTValueStream* stream, BTPage* page, u16 pos) {
+    BTCell cell = page_cell_at(page, pos);
+    stream->local = page_cell_data(page, &cell);
+    stream->local_done = false;
+    stream->next_pid = 0;
+    stream->remaining = cell.data_size - stream->local.size;
+    if (stream->remaining > 0) {
+        stream->next_pid = page_overflow_pid(page, pos);
+    }
+}
+
+// Move to the next chunk of the value.
+// Return false when the whole value has been read.
+bool value_stream_next(BTValueStream* stream, Value* chunk) {
+    if (!stream->local_done) {
+        stream->local_done = true;
+        if (stream->local.size > 0) {
+            *chunk = stream->local;
+            return true;
+        }
+    }
+
+    if (stream->remaining == 0) {
+        return false;
+    }
+
+    BTPage* page = buffer[stream->next_pid];
+    chunk->data = page->pdata + PAGE_HDR_SIZE;
+    u32 capacity = overflow_data_size(page->hdr->page_size);
+    chunk->size = stream->remaining < capacity ? stream->remaining : capacity;
+    stream->remaining -= chunk->size;
+    stream->next_pid = page->hdr->rightmost_pid;
+    return true;
+}
+
+// Crumbs
+// Internal pages on the path from root to leaf, kept by the caller
+// (usually on the stack). Internal page has at least two children
+// and pids are 32 bit, so there are at most BT_MAX_DEPTH of them.
+/////////////////////////////////////////////////
+
+#define BT_MAX_DEPTH 32
+
+typedef struct BTCrumbs {
+    u8 n;
+    BTPage* crumbs[BT_MAX_DEPTH];
+} BTCrumbs;
+
+void btcrumbs_init(BTCrumbs* crumbs) {
+    crumbs->n = 0;
+}
+
+void btcrumbs_push(BTCrumbs* crumbs, BTPage* page) {
+    assert(crumbs->n < BT_MAX_DEPTH);
+    u8 pos = crumbs->n++;
+    crumbs->crumbs[pos] = page;
+}
+
+BTPage* btcrumbs_pop(BTCrumbs* crumbs) {
+    assert(crumbs->n > 0);
+    u8 pos = --crumbs->n;
+    return crumbs->crumbs[pos];
+}
+
+// BTREE top
+//////////////////////////////////////////////////
+
+void finger_set_fence(char* dest, u32* dest_size, bool* has, Value fence) {
+    *has = fence.data != NULL;
+    if (*has) {
+        memcpy(dest, fence.data, fence.size);
+        *dest_size = fence.size;
+    }
+}
+
+// Descend from root to the leaf page that may contain the key.
+// Internal pages on the way are pushed to crumbs (if not NULL).
+// Fences of the leaf (if not NULL) are set to the closest separators
+// on the path, data is NULL when there is none. They point into
+// internal pages and are valid until the tree is modified.
+BTPage* btree_descend(
+    BTree* btree,
+    const void* key, u32 key_size,
+    BTCrumbs* crumbs,
+    Value* low, Value* high
+) {
+    BTPage* curr = buffer[btree->root_page_id];
+    if (crumbs != NULL) {
+        btcrumbs_init(crumbs);
+    }
+    if (low != NULL) {
+        *low = (Value) { .data = NULL, .size = 0 };
+    }
+    if (high != NULL) {
+        *high = (Value) { .data = NULL, .size = 0 };
+    }
+
+    while (!curr->hdr->is_leaf) {
+        if (crumbs != NULL) {
+            btcrumbs_push(crumbs, curr);
+        }
+        u16 pos = page_child_position(curr, key, key_size);
+        if (low != NULL && pos > 0) {
+            *low = page_key_at(curr, pos - 1);
+        }
+        if (high != NULL && pos < curr->hdr->cell_count) {
+            *high = page_key_at(curr, pos);
+        }
+        curr = buffer[page_child_at(curr, pos)];
+    }
+    return curr;
+}
+
+// Descend from root to the leaf page that may contain the key.
+// Internal pages on the way are pushed to crumbs, lookups
+// that don't need the path pass NULL. Leaf becomes the finger.
+BTPage* btree_find_leaf(BTree* btree, const void* key, u32 key_size, BTCrumbs* crumbs) {
+    if (!btree->finger.enabled) {
+        return btree_descend(btree, key, key_size, crumbs, NULL, NULL);
+    }
+
+    Value low, high;
+    BTPage* curr = btree_descend(btree, key, key_size, crumbs, &low, &high);
+    BTFinger* finger = &btree->finger;
+    finger->pid = curr->hdr->pid;
+    finger->version = btree->version;
+    finger_set_fence(finger->low, &finger->low_size, &finger->has_low, low);
+    finger_set_fence(finger->high, &finger->high_size, &finger->has_high, high);
+    return curr;
+}
+
+// Leaf that may contain the key, taken from the finger when
+// the key is within its fences, otherwise found by descent.
+// Path is not recorded, see btree_find_leaf.
+BTPage* btree_seek_leaf(BTree* btree, const void* key, u32 key_size) {
+    BTFinger* finger = &btree->finger;
+    if (finger->enabled) {
+        if (finger->pid != NO_PID && finger->version == btree->version
+            && (!finger->has_low || btree->cmp(key, key_size, finger->low, finger->low_size) >= 0)
+            && (!finger->has_high || btree->cmp(key, key_size, finger->high, finger->high_size) < 0)) {
+            finger->hits++;
+            return buffer[finger->pid];
+        }
+        finger->misses++;
+    }
+    return btree_find_leaf(btree, key, key_size, NULL);
+}
+
+// Insert separator of split 'left' and 'right' pages into parent page
+// popped from crumbs. Parent pages are split as needed all the way up,
+// new root is created when root page itself was split.
+int btree_promote(
+    BTree* btree,
+    BTCrumbs* crumbs,
+    BTPage* left,
+    BTPage* right,
+    const void* key,
+    u32 key_size
+) {
+    u32 left_pid = left->hdr->pid;
+    u32 right_pid = right->hdr->pid;
+
+    if (crumbs->n == 0) {
+        BTPage* new_root = page_new(btree);
+        new_root->hdr->is_leaf = 0;
+        new_root->hdr->rightmost_pid = right_pid;
+        u32 left_count = btree->counted ? page_subtree_count(left) : 0;
+        int rc = page_insert_child(new_root, key, key_size, left_pid, left_count);
+        assert(rc == Ok);
+        page_set_child_count(new_root, 1, btree->count - left_count);
+        btree->root_page_id = new_root->hdr->pid;
+        return Ok;
+    }
+
+    BTPage* parent = btcrumbs_pop(crumbs);
+    int rc = page_internal_insert(parent, key, key_size, left_pid, right_pid);
+    if (rc != NotEnoughSpace) {
+        return rc;
+    }
+
+    // split parent into left and right pages
+    char split_key[max_payload_size(btree->page_size)];
+    u32 split_key_size;
+    BTPageSplitResult split = page_internal_split(parent, split_key, &split_key_size);
+    assert(split.status == Ok);
+
+    // insert separator into appropriate page
+    // if key is >= split key then insert into right page
+    // else insert into left page
+    BTPage* target = parent;
+    if (btree->cmp(key, key_size, split_key, split_key_size) >= 0) {
+        target = split.new_page;
+    }
+    rc = page_internal_insert(target, key, key_size, left_pid, right_pid);
+    assert(rc == Ok);
+
+    // promote split key through parents
+    return btree_promote(btree, crumbs, parent, split.new_page, split_key, split_key_size);
+}
+
+// Add 'delta' to entry counts of counted tree on the path to the key,
+// crumbs hold internal pages of the path and are left as they are.
+void btree_count_path(BTree* btree, BTCrumbs* crumbs, const void* key, u32 key_size, int delta) {
+    if (!btree->counted) {
+        return;
+    }
+    btree->count += delta;
+    for (u8 i = 0; i < crumbs->n; i++) {
+        BTPage* page = crumbs->crumbs[i];
+        u16 pos = page_child_position(page, key, key_size);
+        page_set_child_count(page, pos, page_child_count(page, pos) + delta);
+    }
+}
+
+// Fix underflow of 'page' after delete, crumbs hold its parents.
+// Page is merged with or borrows from its left sibling (right one for the
+// first child), parent that loses a separator is fixed the same way.
+// Root page with a single child is replaced by the child.
+void btree_rebalance(BTree* btree, BTCrumbs* crumbs, BTPage* page) {
+    if (crumbs->n == 0) {
+        if (!page->hdr->is_leaf && page->hdr->cell_count == 0) {
+            btree->version++;
+            btree->root_page_id = page->hdr->rightmost_pid;
+            page_free(page->hdr->pid);
+        }
+        return;
+    }
+
+    if (!page_underflows(page, btree->merge_threshold)) {
+        return;
+    }
+
+    BTPage* parent = btcrumbs_pop(crumbs);
+    if (parent->hdr->cell_count == 0) {
+        return;
+    }
+
+    btree->version++;
+    u16 pos = page_child_index(parent, page->hdr->pid);
+    u16 i = pos > 0 ? pos - 1 : pos;
+    BTPage* left = buffer[page_child_at(parent, i)];
+    BTPage* right = buffer[page_child_at(parent, i + 1)];
+    Value sep = page_key_at(parent, i);
+    u32 count = page_child_count(parent, i) + page_child_count(parent, i + 1);
+
+    page_bump_version(left);
+    page_bump_version(right);
+    if (page_can_merge(left, right, sep)) {
+        page_merge(left, right, sep);
+        if (btree->concurrent) {
+            page_set_high(left, page_high_key(right), right->right_pid);
+        }
+        page_delete_at(parent, i);
+        page_set_child_at(parent, i, left->hdr->pid);
+        page_set_child_count(parent, i, count);
+        page_free(right->hdr->pid);
+        btree_rebalance(btree, crumbs, parent);
+        return;
+    }
+
+    char new_sep[max_payload_size(btree->page_size)];
+    u32 new_sep_size = sep.size;
+    memcpy(new_sep, sep.data, sep.size);
+    page_redistribute(left, right, new_sep, &new_sep_size);
+    if (btree->concurrent) {
+        page_set_high(left, (Value) { .data = new_sep, .size = new_sep_size }, right->hdr->pid);
+    }
+
+    // separator is replaced, new one may not fit so it is
+    // inserted the same way as after split
+    page_delete_at(parent, i);
+    page_set_child_count(parent, i, count);
+    btcrumbs_push(crumbs, parent);
+    int rc = btree_promote(btree, crumbs, left, right, new_sep, new_sep_size);
+    assert(rc == Ok);
+}
+
+int btree_insert(
+    BTree* btree,
+    const void* key, u32 key_size,
+    const void* data, u32 data_size
+) {
+    u32 page_size = btree->page_size;
+    if (key_size > max_key_size(page_size)) {
+        return PayloadTooBig;
+    }
+
+    char local[max_payload_size(page_size)];
+    u32 local_size;
+    const void* local_data = overflow_local(btree, key_size, data, data_size, local, &local_size);
+
+    // counted tree needs the path of every new key
+    BTCrumbs crumbs;
+    BTPage* leaf = btree->counted
+        ? btree_find_leaf(btree, key, key_size, &crumbs)
+        : btree_seek_leaf(btree, key, key_size);
+
+    // overflow pages of overwritten value are released once new value is in
+    u32 old_overflow_pid = 0;
+    u32 old_overflow_size = 0;
+    int old_pos = page_find_cell(leaf, key, key_size);
+    if (old_pos != -1) {
+        BTCell old = page_cell_at(leaf, old_pos);
+        if (cell_overflows(page_size, old.key_size, old.data_size)) {
+            old_overflow_pid = page_overflow_pid(leaf, old_pos);
+            old_overflow_size = old.data_size - cell_local_data_size(page_size, old.key_size, old.data_size);
+        }
+    } else {
+        btree_count_path(btree, &crumbs, key, key_size, 1);
+    }
+
+    int rc = page_insert(leaf, key, key_size, local_data, local_size, data_size);
+    if (rc == NotEnoughSpace) {
+        // path to the leaf is needed only for split
+        leaf = btree_find_leaf(btree, key, key_size, &crumbs);
+        btree->version++;
+
+        // split leaf into left and right pages
+        BTPageSplitResult split = page_leaf_split(leaf);
+        assert(split.status == Ok);
+
+        // split key is the leftmost key of right page
+        char split_key[max_payload_size(page_size)];
+        Value leftmost = page_key_at(split.new_page, 0);
+        u32 split_key_size = leftmost.size;
+        memcpy(split_key, leftmost.data, leftmost.size);
+
+        // insert new item into appropriate page
+        // if key is >= split key then insert into right page
+        // else insert into left page
+        BTPage* target = leaf;
+        if (btree->cmp(key, key_size, split_key, split_key_size) >= 0) {
+            target = split.new_page;
+        }
+        rc = page_insert(target, key, key_size, local_data, local_size, data_size);
+        assert(rc == Ok);
+
+        // promote split key through parents
+        rc = btree_promote(btree, &crumbs, leaf, split.new_page, split_key, split_key_size);
+    }
+
+    if (rc == Ok && old_overflow_size > 0) {
+        overflow_free(old_overflow_pid, old_overflow_size);
+    }
+
+    return rc;
+}
+
+// Return value stored under the key.
+// Returned value is empty (data is NULL, size is 0) if key doesn't exist.
+// Values stored in overflow pages can't be returned as a single chunk
+// of memory, for them data is NULL and size is the size of the value,
+// use btree_get_stream to read them.
+Value btree_get(BTree* btree, const void* key, u32 key_size) {
+    BTPage* leaf = btree_seek_leaf(btree, key, key_size);
+
+    Value v = { .size = 0, .data = NULL };
+    int pos = page_find_cell(leaf, key, key_size);
+    if (pos == -1) {
+        return v;
+    }
+    return page_value_at(leaf, pos);
+}
+
+// Open stream over value stored under the key.
+// Return KeyNotFound if key doesn't exist.
+int btree_get_stream(BTree* btree, const void* key, u32 key_size, BTValueStream* stream) {
+    BTPage* leaf = btree_seek_leaf(btree, key, key_size);
+
+    int pos = page_find_cell(leaf, key, key_size);
+    if (pos == -1) {
+        return KeyNotFound;
+    }
+
+    value_stream_open(stream, leaf, pos);
+    return Ok;
+}
+
+// Multi get
+// Keys of the batch are sorted and looked up in key order. Path of the
+// previous key is kept together with high fence of every page on it,
+// next key goes back only to the lowest page that covers it and
+// descends from there. So every page is visited once per batch and
+// all keys in the same leaf are found from a single visit.
+// Results are returned in the original order of keys.
+/////////////////////////////////////////////////
+
+// Keys are radix sorted by hint, keys with the same hint are then
+// sorted with compare function.
+typedef struct BTMultiGetKey {
+    Value key;
+    u32 hint;
+    u32 index;
+} BTMultiGetKey;
+
+// Page on the path and the smallest key that is past it (data is NULL if none).
+typedef struct BTPathLevel {
+    BTPage* page;
+    Value high;
+} BTPathLevel;
+
+static __thread BTree* multi_get_btree = NULL;
+
+int compare_multi_get_keys(const void* a, const void* b) {
+    const BTMultiGetKey* ka = a;
+    const BTMultiGetKey* kb = b;
+    return multi_get_btree->cmp(ka->key.data, ka->key.size, kb->key.data, kb->key.size);
+}
+
+// Sort keys by hint (LSD radix sort, byte at a time) and then
+// runs of keys with equal hint with compare function.
+// 'tmp' must hold 'n' keys.
+void multi_get_sort(BTree* btree, BTMultiGetKey* keys, BTMultiGetKey* tmp, u32 n) {
+    for (u32 shift = 0; shift < 32; shift += 8) {
+        u32 offsets[257] = { 0 };
+        for (u32 i = 0; i < n; i++) {
+            offsets[((keys[i].hint >> shift) & 0xff) + 1]++;
+        }
+        if (offsets[((keys[0].hint >> shift) & 0xff) + 1] == n) {
+            continue;
+        }
+        for (u32 b = 1; b <= 256; b++) {
+            offsets[b] += offsets[b - 1];
+        }
+        for (u32 i = 0; i < n; i++) {
+            tmp[offsets[(keys[i].hint >> shift) & 0xff]++] = keys[i];
+        }
+        memcpy(keys, tmp, n * sizeof(BTMultiGetKey));
+    }
+
+    multi_get_btree = btree;
+    u32 start = 0;
+    for (u32 i = 1; i <= n; i++) {
+        if (i == n || keys[i].hint != keys[start].hint) {
+            if (i - start > 1) {
+                qsort(keys + start, i - start, sizeof(BTMultiGetKey), compare_multi_get_keys);
+            }
+            start = i;
+        }
+    }
+}
+
+// Look up 'n' keys, value of keys[i] is written to out[i]
+// (see btree_get for values of missing and overflown keys).
+void btree_multi_get(BTree* btree, const Value* keys, u32 n, Value* out) {
+    if (n == 0) {
+        return;
+    }
+
+    BTMultiGetKey* sorted = malloc(2 * n * sizeof(BTMultiGetKey));
+    for (u32 i = 0; i < n; i++) {
+        u32 hint = btree->hint != NULL ? btree->hint(keys[i].data, keys[i].size) : 0;
+        sorted[i] = (BTMultiGetKey) { .key = keys[i], .hint = hint, .index = i };
+    }
+    multi_get_sort(btree, sorted, sorted + n, n);
+
+    BTPathLevel path[BT_MAX_DEPTH + 1];
+    u32 depth = 0;
+    for (u32 i = 0; i < n; i++) {
+        Value key = sorted[i].key;
+
+        // keys are sorted so the page covers the key if it is below its high fence
+        while (depth > 0 && path[depth - 1].high.data != NULL
+            && btree->cmp(key.data, key.size, path[depth - 1].high.data, path[depth - 1].high.size) >= 0) {
+            depth--;
+        }
+        if (depth == 0) {
+            path[depth++] = (BTPathLevel) { .page = buffer[btree->root_page_id], .high = { .data = NULL, .size = 0 } };
+        }
+
+        BTPathLevel* top = path + depth - 1;
+        while (!top->page->hdr->is_leaf) {
+            u16 pos = page_child_position(top->page, key.data, key.size);
+            BTPathLevel child = { .page = buffer[page_child_at(top->page, pos)], .high = top->high };
+            if (pos < top->page->hdr->cell_count) {
+                child.high = page_key_at(top->page, pos);
+            }
+            path[depth++] = child;
+            top = path + depth - 1;
+        }
+        BTPage* leaf = top->page;
+
+        Value* v = out + sorted[i].index;
+        *v = (Value) { .data = NULL, .size = 0 };
+        int pos = page_find_cell(leaf, key.data, key.size);
+        if (pos != -1) {
+            *v = page_value_at(leaf, pos);
+        }
+    }
+    free(sorted);
+}
+
+// Interleaved lookups
+// For trees larger than the cache every step of a descent waits for
+// memory: page struct, page header, slots probed by in-page search
+// and the cell whose key is compared. Lookups of the batch are run as
+// small state machines, a number of them in flight at once. Each step
+// issues prefetch for the memory the lookup needs next and switches
+// to another lookup, so the loads overlap (asynchronous memory access
+// chaining). In-page search on hints advances one probe per step,
+// pages without hints are searched at once.
+/////////////////////////////////////////////////
+
+#define BT_MAX_IN_FLIGHT 64
+#define SLOTS_PER_CACHE_LINE (64 / PAGE_CELL_PTR_SIZE)
+
+// Stage of the lookup, named by the memory it waits for.
+typedef enum BTLookupStage {
+    LookupPage,
+    LookupHeader,
+    LookupHints,
+    LookupCell,
+    LookupSlots
+} BTLookupStage;
+
+// Hint search narrows cells down to [lo, lo + n).
+typedef struct BTLookup {
+    BTLookupStage stage;
+    BTPage* page;
+    u32 index;
+    u32 hint;
+    u16 lo;
+    u16 n;
+} BTLookup;
+
+// Prefetch slots probed by the first steps of in-page search.
+void page_prefetch_slots(BTPage* page) {
+    u16 n = page->hdr->cell_count;
+    char* slots = (char*)page->cell_ptrs;
+    u32 slot_size = page_slot_size(page);
+    for (u32 i = 1; i < 8; i++) {
+        __builtin_prefetch(slots + (n * i / 8) * slot_size);
+    }
+}
+
+// End of the run of cells with given hint that starts at 'pos'.
+// Runs are usually short so they are searched by galloping.
+u16 page_hint_run_end(BTPage* page, u16 pos, u32 hint) {
+    u16 n = page->hdr->cell_count;
+    const BTCellPtr* cells = page->cell_ptrs;
+    u16 lo = pos;
+    u16 hi = pos;
+    u16 step = 1;
+    while (hi < n && cells[hi].key_hint == hint) {
+        lo = hi + 1;
+        hi = step < n - hi ? hi + step : n;
+        step *= 2;
+    }
+
+    while (lo < hi) {
+        u16 mid = (lo + hi) / 2;
+        if (cells[mid].key_hint == hint) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Finish search in the page with cells [lo, hi) left.
+// Lookup moves to the child page or writes the value and returns true.
+bool lookup_finish(BTLookup* lookup, const Value* keys, Value* out, u16 lo, u16 hi) {
+    BTPage* page = lookup->page;
+    Value key = keys[lookup->index];
+    if (!page->hdr->is_leaf) {
+        u16 pos = page_child_position_in(page, key.data, key.size, lookup->hint, lo, hi);
+        lookup->page = buffer[page_child_at(page, pos)];
+        lookup->stage = LookupPage;
+        __builtin_prefetch(lookup->page);
+        return false;
+    }
+
+    Value* v = out + lookup->index;
+    *v = (Value) { .data = NULL, .size = 0 };
+    int pos = page_find_cell_in(page, key.data, key.size, lookup->hint, lo, hi);
+    if (pos != -1) {
+        *v = page_value_at(page, pos);
+    }
+    return true;
+}
+
+// Advance lookup by one step, return true when it is done.
+bool lookup_step(BTLookup* lookup, const Value* keys, Value* out) {
+    BTPage* page = lookup->page;
+    const BTCellPtr* cells = page->cell_ptrs;
+    switch (lookup->stage) {
+    case LookupPage:
+        __builtin_prefetch(page->pdata);
+        lookup->stage = LookupHeader;
+        return false;
+
+    case LookupHeader:
+        if (!page_has_hints(page)) {
+            page_prefetch_slots(page);
+            lookup->stage = LookupSlots;
+            return false;
+        }
+        lookup->lo = 0;
+        lookup->n = page->hdr->cell_count;
+        __builtin_prefetch(cells + lookup->n / 2);
+        lookup->stage = LookupHints;
+        return false;
+
+    case LookupHints:
+        // same steps as hint_lower_bound_branchless, slots within
+        // a cache line are probed without switching
+        while (lookup->n > 1) {
+            u16 half = lookup->n / 2;
+            if (cells[lookup->lo + half].key_hint < lookup->hint) {
+                lookup->lo += half;
+            }
+            lookup->n -= half;
+            if (lookup->n > SLOTS_PER_CACHE_LINE) {
+                __builtin_prefetch(cells + lookup->lo + lookup->n / 2);
+                return false;
+            }
+        }
+        if (lookup->n == 1 && cells[lookup->lo].key_hint < lookup->hint) {
+            lookup->lo++;
+        }
+
+        // cells with the same hint need full key compare
+        lookup->n = page_hint_run_end(page, lookup->lo, lookup->hint) - lookup->lo;
+        if (lookup->n == 0) {
+            return lookup_finish(lookup, keys, out, lookup->lo, lookup->lo);
+        }
+        __builtin_prefetch(page->pdata + cells[lookup->lo].offset);
+        lookup->stage = LookupCell;
+        return false;
+
+    case LookupCell:
+        return lookup_finish(lookup, keys, out, lookup->lo, lookup->lo + lookup->n);
+
+    case LookupSlots:
+        return lookup_finish(lookup, keys, out, 0, page->hdr->cell_count);
+    }
+    return false;
+}
+
+// Look up 'n' keys with up to 'in_flight' lookups interleaved,
+// value of keys[i] is written to out[i] (see btree_get).
+// Finger is not used nor updated.
+void btree_get_interleaved(BTree* btree, const Value* keys, u32 n, Value* out, u32 in_flight) {
+    assert(in_flight > 0 && in_flight <= BT_MAX_IN_FLIGHT);
+
+    BTLookup lookups[BT_MAX_IN_FLIGHT];
+    BTPage* root = buffer[btree->root_page_id];
+    u32 next = 0;
+    u32 active = 0;
+    for (; active < in_flight && next < n; active++) {
+        Value key = keys[next];
+        lookups[active] = (BTLookup) {
+            .stage = LookupPage, .page = root, .index = next++,
+            .hint = page_key_hint(root, key.data, key.size)
+        };
+    }
+
+    u32 i = 0;
+    while (active > 0) {
+        BTLookup* lookup = lookups + i;
+        if (lookup_step(lookup, keys, out)) {
+            // slot takes the next key or the last active lookup
+            if (next < n) {
+                Value key = keys[next];
+                *lookup = (BTLookup) {
+                    .stage = LookupPage, .page = root, .index = next++,
+                    .hint = page_key_hint(root, key.data, key.size)
+                };
+            } else {
+                *lookup = lookups[--active];
+                i = i < active ? i : 0;
+                continue;
+            }
+        }
+        i = i + 1 < active ? i + 1 : 0;
+    }
+}
+
+// Delete the key and its value, leaf that underflows is rebalanced.
+// Return KeyNotFound if key doesn't exist.
+int btree_delete(BTree* btree, const void* key, u32 key_size) {
+    // counted tree needs the path of every deleted key
+    BTCrumbs crumbs;
+    BTPage* leaf = btree->counted
+        ? btree_find_leaf(btree, key, key_size, &crumbs)
+        : btree_seek_leaf(btree, key, key_size);
+
+    int pos = page_find_cell(leaf, key, key_size);
+    if (pos == -1) {
+        return KeyNotFound;
+    }
+
+    page_free_overflow(leaf, pos);
+    page_delete_at(leaf, pos);
+    btree_count_path(btree, &crumbs, key, key_size, -1);
+
+    // path to the leaf is needed only for rebalance
+    if (page_underflows(leaf, btree->merge_threshold)) {
+        if (!btree->counted) {
+            btree_find_leaf(btree, key, key_size, &crumbs);
+        }
+        btree_rebalance(btree, &crumbs, leaf);
+    }
+    return Ok;
+}
+
+// Batch delete
+// Deleted keys are only marked (tombstones) and every leaf is compacted
+// once when the batch is committed, instead of moving its slot array
+// once per deleted key. Keys stay visible until the batch is committed
+// and the tree must not be modified in the meantime.
+/////////////////////////////////////////////////
+
+typedef struct BTTombstone {
+    u32 pid;
+    u16 pos;
+} BTTombstone;
+
+typedef struct BTDeleteBatch {
+    BTree* btree;
+    u32 count;
+    u32 capacity;
+    BTTombstone* tombstones;
+} BTDeleteBatch;
+
+void btree_delete_batch_begin(BTree* btree, BTDeleteBatch* batch) {
+    batch->btree = btree;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->tombstones = NULL;
+}
+
+// Mark key as deleted.
+// Return KeyNotFound if key doesn't exist.
+int btree_delete_batch_add(BTDeleteBatch* batch, const void* key, u32 key_size) {
+    BTPage* leaf = btree_seek_leaf(batch->btree, key, key_size);
+
+    int pos = page_find_cell(leaf, key, key_size);
+    if (pos == -1) {
+        return KeyNotFound;
+    }
+
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        batch->tombstones = realloc(batch->tombstones, batch->capacity * sizeof(BTTombstone));
+        assert(batch->tombstones != NULL);
+    }
+    batch->tombstones[batch->count++] = (BTTombstone) { .pid = leaf->hdr->pid, .pos = pos };
+    return Ok;
+}
+
+int compare_tombstones(const void* a, const void* b) {
+    const BTTombstone* ta = a;
+    const BTTombstone* tb = b;
+    if (ta->pid != tb->pid) {
+        return ta->pid < tb->pid ? -1 : 1;
+    }
+    return (int)ta->pos - (int)tb->pos;
+}
+
+// Delete all marked keys, one leaf at a time.
+// Leaves left underfull are rebalanced after all of them are compacted,
+// rebalance moves cells between leaves and would leave positions of the
+// remaining tombstones stale. Such leaf is found again by one of its
+// deleted keys, kept as [u32 size][key] entries in 'underfull'.
+// Return the number of deleted keys.
+u32 btree_delete_batch_commit(BTDeleteBatch* batch) {
+    if (batch->count == 0) {
+        return 0;
+    }
+    BTree* btree = batch->btree;
+    qsort(batch->tombstones, batch->count, sizeof(BTTombstone), compare_tombstones);
+
+    u32 deleted = 0;
+    u16* positions = NULL;
+    char* underfull = NULL;
+    u32 underfull_size = 0;
+    u32 underfull_capacity = 0;
+    u32 i = 0;
+    while (i < batch->count) {
+        BTPage* leaf = buffer[batch->tombstones[i].pid];
+        positions = realloc(positions, leaf->hdr->cell_count * sizeof(u16));
+
+        u16 n = 0;
+        for (; i < batch->count && batch->tombstones[i].pid == leaf->hdr->pid; i++) {
+            u16 pos = batch->tombstones[i].pos;
+            if (n > 0 && positions[n - 1] == pos) {
+                continue;
+            }
+            page_free_overflow(leaf, pos);
+            positions[n++] = pos;
+        }
+
+        // key is copied before it is deleted, entry is kept only
+        // if the leaf underflows
+        Value key = page_key_at(leaf, positions[0]);
+        u32 entry_size = sizeof(u32) + key.size;
+        if (underfull_size + entry_size > underfull_capacity) {
+            underfull_capacity = 2 * (underfull_size + entry_size);
+            underfull = realloc(underfull, underfull_capacity);
+            assert(underfull != NULL);
+        }
+        memcpy(underfull + underfull_size, &key.size, sizeof(u32));
+        memcpy(underfull + underfull_size + sizeof(u32), key.data, key.size);
+
+        if (btree->counted) {
+            BTCrumbs crumbs;
+            btree_find_leaf(btree, key.data, key.size, &crumbs);
+            btree_count_path(btree, &crumbs, key.data, key.size, -(int)n);
+        }
+        page_delete_batch(leaf, positions, n);
+        deleted += n;
+        if (page_underflows(leaf, btree->merge_threshold)) {
+            underfull_size += entry_size;
+        }
+    }
+
+    for (u32 offset = 0; offset < underfull_size;) {
+        u32 key_size;
+        memcpy(&key_size, underfull + offset, sizeof(u32));
+        const char* key = underfull + offset + sizeof(u32);
+        offset += sizeof(u32) + key_size;
+
+        // leaf may have been merged or refilled by earlier rebalance
+        BTCrumbs crumbs;
+        BTPage* leaf = btree_find_leaf(btree, key, key_size, &crumbs);
+        if (page_underflows(leaf, btree->merge_threshold)) {
+            btree_rebalance(btree, &crumbs, leaf);
+        }
+    }
+
+    free(underfull);
+    free(positions);
+    free(batch->tombstones);
+    batch->tombstones = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+    return deleted;
+}
+
+// Range delete
+// Keys in a range are deleted top-down: children of an internal page that
+// lie fully inside the range are released together with their subtrees
+// and unlinked at once, only the children holding the bounds are visited.
+// Cost is proportional to tree height and the number of freed pages.
+// Pages on the two edge paths are rebalanced afterwards.
+/////////////////////////////////////////////////
+
+// Release pages of the subtree, overflow pages of its values included.
+// Return the number of entries it held.
+u32 btree_free_subtree(BTree* btree, BTPage* page) {
+    u32 count = 0;
+    if (page->hdr->is_leaf) {
+        count = page->hdr->cell_count;
+        for (u16 i = 0; i < count; i++) {
+            page_free_overflow(page, i);
+        }
+    } else {
+        for (u16 i = 0; i <= page->hdr->cell_count; i++) {
+            count += btree_free_subtree(btree, buffer[page_child_at(page, i)]);
+        }
+    }
+    page_free(page->hdr->pid);
+    return count;
+}
+
+// Position of the first (last) child of internal page with keys in the
+// range, missing bound (NULL) means the first (last) child of the page.
+u16 page_range_first_child(BTPage* page, const void* low, u32 low_size) {
+    return low != NULL ? page_child_position(page, low, low_size) : 0;
+}
+
+u16 page_range_last_child(BTPage* page, const void* high, u32 high_size) {
+    return high != NULL ? page_insertion_point(page, high, high_size) : page->hdr->cell_count;
+}
+
+// Delete keys in [low, high) from the subtree of the page, missing bound
+// is unbounded but at least one is given. Children holding a bound are
+// trimmed, children in between are released. First and last leaf that
+// were trimmed are set to 'first' and 'last'. Return number of deleted keys.
+u32 page_delete_range(
+    BTree* btree, BTPage* page,
+    const void* low, u32 low_size,
+    const void* high, u32 high_size,
+    BTPage** first, BTPage** last
+) {
+    if (page->hdr->is_leaf) {
+        u16 from = low != NULL ? page_insertion_point(page, low, low_size) : 0;
+        u16 to = high != NULL ? page_insertion_point(page, high, high_size) : page->hdr->cell_count;
+        u16 positions[to > from ? to - from : 1];
+        for (u16 i = from; i < to; i++) {
+            page_free_overflow(page, i);
+            positions[i - from] = i;
+        }
+        page_delete_batch(page, positions, to > from ? to - from : 0);
+        if (*first == NULL) {
+            *first = page;
+        }
+        *last = page;
+        return to > from ? to - from : 0;
+    }
+
+    u16 a = page_range_first_child(page, low, low_size);
+    u16 b = page_range_last_child(page, high, high_size);
+    u32 deleted = 0;
+
+    // bound children get only the bound they hold, the other
+    // side of the range is past their keys
+    if (low != NULL) {
+        BTPage* child = buffer[page_child_at(page, a)];
+        u32 n = page_delete_range(btree, child, low, low_size, b > a ? NULL : high, high_size, first, last);
+        page_set_child_count(page, a, page_child_count(page, a) - n);
+        deleted += n;
+    }
+    if (high != NULL && (b > a || low == NULL)) {
+        BTPage* child = buffer[page_child_at(page, b)];
+        u32 n = page_delete_range(btree, child, b > a ? NULL : low, low_size, high, high_size, first, last);
+        page_set_child_count(page, b, page_child_count(page, b) - n);
+        deleted += n;
+    }
+
+    // children in [c0, c1] are inside the range
+    int c0 = low != NULL ? a + 1 : a;
+    int c1 = high != NULL ? b - 1 : b;
+    if (c1 < c0) {
+        return deleted;
+    }
+    for (int i = c0; i <= c1; i++) {
+        deleted += btree_free_subtree(btree, buffer[page_child_at(page, i)]);
+    }
+
+    // cells of released children are removed, when the rightmost child
+    // goes the last kept child takes its place
+    u16 n = page->hdr->cell_count;
+    u16 from = c0;
+    u16 to = c1;
+    if (c1 == n) {
+        assert(c0 > 0);
+        u32 count = page_child_count(page, c0 - 1);
+        page->hdr->rightmost_pid = page_child_at(page, c0 - 1);
+        page_set_child_count(page, n, count);
+        from = c0 - 1;
+        to = n - 1;
+    }
+    u16 positions[to - from + 1];
+    for (u16 i = from; i <= to; i++) {
+        positions[i - from] = i;
+    }
+    page_delete_batch(page, positions, to - from + 1);
+    return deleted;
+}
+
+// Descend to the leaf at the edge of deleted range (see page_delete_range),
+// internal pages on the way are pushed to crumbs.
+BTPage* btree_descend_range_edge(BTree* btree, const void* key, u32 key_size, bool high, BTCrumbs* crumbs) {
+    btcrumbs_init(crumbs);
+    BTPage* page = buffer[btree->root_page_id];
+    while (!page->hdr->is_leaf) {
+        btcrumbs_push(crumbs, page);
+        u16 pos = high ? page_range_last_child(page, key, key_size) : page_range_first_child(page, key, key_size);
+        page = buffer[page_child_at(page, pos)];
+    }
+    return page;
+}
+
+// Fix underflow of pages on the path to the edge of deleted range,
+// level by level from the leaf up.
+void btree_rebalance_range_edge(BTree* btree, const void* key, u32 key_size, bool high) {
+    for (u8 level = 0; ; level++) {
+        BTCrumbs crumbs;
+        BTPage* page = btree_descend_range_edge(btree, key, key_size, high, &crumbs);
+        if (level > crumbs.n) {
+            break;
+        }
+        crumbs.n -= level;
+        if (level > 0) {
+            page = crumbs.crumbs[crumbs.n];
+        }
+        btree_rebalance(btree, &crumbs, page);
+    }
+}
+
+// Delete all keys in [low, high), missing (NULL) bound is unbounded.
+// Return the number of deleted keys.
+u32 btree_delete_range(BTree* btree, const void* low, u32 low_size, const void* high, u32 high_size) {
+    assert(!btree->concurrent);
+    if (low != NULL && high != NULL && btree->cmp(low, low_size, high, high_size) >= 0) {
+        return 0;
+    }
+    btree->version++;
+
+    BTPage* root = buffer[btree->root_page_id];
+    u32 deleted;
+    if (low == NULL && high == NULL && !root->hdr->is_leaf) {
+        // whole tree goes, root becomes empty leaf
+        deleted = btree_free_subtree(btree, root);
+        root = page_new(btree);
+        root->hdr->is_leaf = 1;
+        root->hdr->rightmost_pid = NO_PID;
+        root->hdr->prev_pid = NO_PID;
+        btree->root_page_id = root->hdr->pid;
+        btree->count = 0;
+        return deleted;
+    }
+
+    BTPage* first = NULL;
+    BTPage* last = NULL;
+    deleted = page_delete_range(btree, root, low, low_size, high, high_size, &first, &last);
+    if (btree->counted) {
+        btree->count -= deleted;
+    }
+
+    // leaves between the trimmed ones are released
+    if (low == NULL) {
+        first->hdr->prev_pid = NO_PID;
+    }
+    if (high == NULL) {
+        last->hdr->rightmost_pid = NO_PID;
+    }
+    if (first != last) {
+        first->hdr->rightmost_pid = last->hdr->pid;
+        last->hdr->prev_pid = first->hdr->pid;
+    }
+
+    // page left as the only child of its parent can't be fixed until
+    // the parent is merged, second pass gets to it
+    for (int pass = 0; pass < 2; pass++) {
+        btree_rebalance_range_edge(btree, low, low_size, false);
+        btree_rebalance_range_edge(btree, high, high_size, true);
+    }
+    root = buffer[btree->root_page_id];
+    while (!root->hdr->is_leaf && root->hdr->cell_count == 0) {
+        BTCrumbs crumbs;
+        btcrumbs_init(&crumbs);
+        btree_rebalance(btree, &crumbs, root);
+        root = buffer[btree->root_page_id];
+    }
+    return deleted;
+}
+
+// Bulk load
+// Tree is built bottom-up from sorted input: leaves are filled one after
+// another by appending cells, then each level of internal pages is built
+// from the pages of the level below, until a single root remains.
+/////////////////////////////////////////////////
+
+// Source of key/value pairs for bulk load.
+// 'next' sets key and value of the next pair, returns false
+// when input is exhausted. Keys must be unique and ascending.
+typedef struct BTBulkIterator {
+    bool (*next)(void* ctx, Value* key, Value* value);
+    void* ctx;
+} BTBulkIterator;
+
+// Page of the level being built and the smallest key in its subtree.
+// Keys point to the first key of a leaf, leaves are not modified
+// during the load so no copies are needed.
+typedef struct BTBulkEntry {
+    u32 pid;
+    Value key;
+} BTBulkEntry;
+
+typedef struct BTBulkLevel {
+    u32 count;
+    u32 capacity;
+    BTBulkEntry* entries;
+} BTBulkLevel;
+
+void bulk_level_push(BTBulkLevel* level, BTPage* page, Value key) {
+    if (level->count == level->capacity) {
+        level->capacity = level->capacity == 0 ? 64 : level->capacity * 2;
+        level->entries = realloc(level->entries, level->capacity * sizeof(BTBulkEntry));
+        assert(level->entries != NULL);
+    }
+    level->entries[level->count++] = (BTBulkEntry) { .pid = page->hdr->pid, .key = key };
+}
+
+// Append cell after the last cell of the page being loaded.
+// Cells are written back to back from the end of the page and slots
+// from its start, free block is set up when the page is closed.
+// Return false if the cell would fill the page above 'fill_factor'
+// percent, first cell is always appended.
+bool bulk_page_append(
+    BTPage* page,
+    u32 fill_factor,
+    Value key,
+    const void* local, u32 local_size,
+    u32 data_size
+) {
+    u16 n = page->hdr->cell_count;
+    u32 page_size = page->hdr->page_size;
+    u32 slot_size = page_slot_size(page);
+    u32 size = page_cell_header_size(page, key.size, data_size) + key.size + local_size;
+    u32 end = n == 0 ? page_size : page_cell_offset(page, n - 1);
+
+    if (n > 0) {
+        u32 slots_end = PAGE_HDR_SIZE + (n + 1) * slot_size + PAGE_FREE_BLOCK_SIZE;
+        u32 used = page_size - end + size + (n + 1) * slot_size;
+        if (slots_end + size > end || (u64)used * 100 > (u64)page_data_size(page_size) * fill_factor) {
+            return false;
+        }
+    }
+
+    page->hdr->cell_count++;
+    page_write_cell(page, n, end - size, key.data, key.size, local, local_size, data_size);
+    return true;
+}
+
+// Set up single free block between slots and cells of loaded page.
+void bulk_page_close(BTPage* page) {
+    u16 n = page->hdr->cell_count;
+    u32 end = n == 0 ? page->hdr->page_size : page_cell_offset(page, n - 1);
+
+    page_reload(page);
+    BTFreeBlock fb = { .start_offset = PAGE_HDR_SIZE + n * page_slot_size(page) + PAGE_FREE_BLOCK_SIZE, .end_offset = end };
+    page_freeblock_set(page, 0, fb);
+    page->hdr->freeblock_count = 1;
+    page->hdr->freespace = end - fb.start_offset;
+}
+
+BTPage* bulk_page_new(BTree* btree, u8 is_leaf) {
+    BTPage* page = page_new(btree);
+    page->hdr->is_leaf = is_leaf;
+    return page;
+}
+
+// Build internal pages on top of 'children', parent pages are added to 'parents'.
+// Each child but the first is added as a cell (child key, previous child pid),
+// a page that is full is closed with the previous child as the rightmost one.
+// Entry counts of counted tree follow the pids.
+void bulk_build_level(BTree* btree, BTBulkLevel* children, BTBulkLevel* parents, u32 fill_factor) {
+    BTPage* page = bulk_page_new(btree, 0);
+    bulk_level_push(parents, page, children->entries[0].key);
+    u32 data_size = page_child_data_size(page);
+    u32 prev[2] = { children->entries[0].pid, page_subtree_count(buffer[children->entries[0].pid]) };
+
+    for (u32 i = 1; i < children->count; i++) {
+        BTBulkEntry* child = children->entries + i;
+        if (!bulk_page_append(page, fill_factor, child->key, prev, data_size, data_size)) {
+            page->hdr->rightmost_pid = prev[0];
+            page_set_child_count(page, page->hdr->cell_count, prev[1]);
+            bulk_page_close(page);
+            page = bulk_page_new(btree, 0);
+            bulk_level_push(parents, page, child->key);
+        }
+        prev[0] = child->pid;
+        prev[1] = page_subtree_count(buffer[child->pid]);
+    }
+    page->hdr->rightmost_pid = prev[0];
+    page_set_child_count(page, page->hdr->cell_count, prev[1]);
+    bulk_page_close(page);
+}
+
+// Load sorted input into empty tree.
+// Pages are filled up to 'fill_factor' percent (1 - 100) of their space,
+// lower fill factor leaves room for later inserts without splits.
+// Return PayloadTooBig if some key is too large, pairs loaded so far stay in the tree.
+int btree_bulk_load(BTree* btree, BTBulkIterator* it, u32 fill_factor) {
+    assert(fill_factor > 0 && fill_factor <= 100);
+    btree->version++;
+
+    BTPage* leaf = buffer[btree->root_page_id];
+    assert(leaf->hdr->is_leaf && leaf->hdr->cell_count == 0);
+
+    int rc = Ok;
+    char local[max_payload_size(btree->page_size)];
+    BTBulkLevel level = { .count = 0, .capacity = 0, .entries = NULL };
+    Value key, value;
+    Value prev = { .data = NULL, .size = 0 };
+    while (it->next(it->ctx, &key, &value)) {
+        if (key.size > max_key_size(btree->page_size)) {
+            rc = PayloadTooBig;
+            break;
+        }
+        assert(prev.data == NULL || btree->cmp(key.data, key.size, prev.data, prev.size) > 0);
+
+        u32 local_size;
+        const void* local_data = overflow_local(btree, key.size, value.data, value.size, local, &local_size);
+        if (!bulk_page_append(leaf, fill_factor, key, local_data, local_size, value.size)) {
+            bulk_page_close(leaf);
+            BTPage* next = bulk_page_new(btree, 1);
+            next->hdr->rightmost_pid = NO_PID;
+            next->hdr->prev_pid = leaf->hdr->pid;
+            leaf->hdr->rightmost_pid = next->hdr->pid;
+            leaf = next;
+            bulk_page_append(leaf, fill_factor, key, local_data, local_size, value.size);
+        }
+        if (leaf->hdr->cell_count == 1) {
+            bulk_level_push(&level, leaf, page_key_at(leaf, 0));
+        }
+        prev = page_key_at(leaf, leaf->hdr->cell_count - 1);
+        btree->count++;
+    }
+    bulk_page_close(leaf);
+
+    // build internal levels until there is a single page on top
+    while (level.count > 1) {
+        BTBulkLevel parents = { .count = 0, .capacity = 0, .entries = NULL };
+        bulk_build_level(btree, &level, &parents, fill_factor);
+        free(level.entries);
+        level = parents;
+    }
+
+    if (level.count == 1) {
+        btree->root_page_id = level.entries[0].pid;
+    }
+    free(level.entries);
+    return rc;
+}
+
+// Write batch
+// Puts of the batch are sorted and grouped by the leaf they go to.
+// Each group is merged with cells of its leaf in key order into fresh
+// pages, so the leaf is compacted once no matter how many keys it gets.
+// Leaf that doesn't fit into one page is split into as many equally
+// filled pages as needed at once, their separators are then promoted
+// one after another. Group that is small compared to its leaf is
+// inserted in place, until the leaf is full.
+/////////////////////////////////////////////////
+
+// Leaf is rebuilt when the group has at least 1/RATIO of its cell count.
+#define WRITE_BATCH_REBUILD_RATIO 4
+
+// Cell of the rebuilt leaf, new entry of the batch
+// or cell at 'pos' of the leaf when 'entry' is NULL.
+typedef struct BTWriteItem {
+    const BTMultiGetKey* entry;
+    u16 pos;
+    u32 size;
+} BTWriteItem;
+
+// Append item to the page being rebuilt (see bulk_page_append).
+void write_batch_append(BTree* btree, BTPage* page, BTPage* leaf, const BTWriteItem* item, const Value* values) {
+    bool appended;
+    if (item->entry == NULL) {
+        BTCell cell = page_cell_at(leaf, item->pos);
+        Value key = page_cell_key(leaf, &cell);
+        u32 local_size = cell_local_size(btree->page_size, cell.key_size, cell.data_size) - cell.key_size;
+        appended = bulk_page_append(page, 100, key, key.data + key.size, local_size, cell.data_size);
+    } else {
+        Value key = item->entry->key;
+        Value value = values[item->entry->index];
+        char local[max_payload_size(btree->page_size)];
+        u32 local_size;
+        const void* local_data = overflow_local(btree, key.size, value.data, value.size, local, &local_size);
+        appended = bulk_page_append(page, 100, key, local_data, local_size, value.size);
+    }
+    assert(appended);
+}
+
+// Insert entries into the leaf one by one while they fit.
+// Entries that would allocate or release overflow pages are left
+// to write_batch_apply. Return the number of inserted entries.
+u32 write_batch_insert(BTree* btree, BTPage* leaf, const BTMultiGetKey* entries, u32 n, const Value* values) {
+    u32 page_size = btree->page_size;
+    for (u32 i = 0; i < n; i++) {
+        Value key = entries[i].key;
+        Value value = values[entries[i].index];
+        if (cell_overflows(page_size, key.size, value.size)) {
+            return i;
+        }
+        int pos = page_find_cell(leaf, key.data, key.size);
+        if (pos != -1) {
+            BTCell old = page_cell_at(leaf, pos);
+            if (cell_overflows(page_size, old.key_size, old.data_size)) {
+                return i;
+            }
+        }
+        if (page_insert(leaf, key.data, key.size, value.data, value.size, value.size) != Ok) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Merge sorted 'entries' into the leaf. Overwritten cells are dropped
+// (with their overflow pages), the rest is written into as few pages
+// as possible. Pages beyond the first one are linked after the leaf
+// and their separators are promoted, crumbs hold parents of the leaf.
+void write_batch_apply(
+    BTree* btree,
+    BTCrumbs* crumbs,
+    BTPage* leaf,
+    const BTMultiGetKey* entries, u32 n,
+    const Value* values,
+    BTWriteItem* items
+) {
+    u32 page_size = btree->page_size;
+    u32 slot_size = page_slot_size(leaf);
+    u16 cell_count = leaf->hdr->cell_count;
+
+    // merge cells of the leaf with entries, entry wins on equal keys
+    u32 count = 0;
+    u32 total = 0;
+    u16 pos = 0;
+    u32 i = 0;
+    while (pos < cell_count || i < n) {
+        int cmp = 1;
+        if (pos < cell_count && i < n) {
+            Value key = page_key_at(leaf, pos);
+            cmp = btree->cmp(key.data, key.size, entries[i].key.data, entries[i].key.size);
+        } else if (pos < cell_count) {
+            cmp = -1;
+        }
+
+        BTWriteItem* item = items + count++;
+        if (cmp < 0) {
+            *item = (BTWriteItem) { .entry = NULL, .pos = pos, .size = page_cell_size(leaf, pos) };
+            pos++;
+        } else {
+            if (cmp == 0) {
+                page_free_overflow(leaf, pos++);
+            }
+            Value key = entries[i].key;
+            u32 data_size = values[entries[i].index].size;
+            u32 size = page_cell_header_size(leaf, key.size, data_size) + cell_local_size(page_size, key.size, data_size);
+            *item = (BTWriteItem) { .entry = entries + i, .pos = 0, .size = size };
+            i++;
+        }
+        total += item->size + slot_size;
+    }
+
+    // pages are filled up to an equal share of the total size,
+    // page is closed earlier when the next item doesn't fit
+    u32 capacity = page_data_size(page_size);
+    u32 page_count = (total + capacity - 1) / capacity;
+    u32 share = total / page_count;
+
+    BTPage* first = page_blank(page_size);
+    first->btree = btree;
+    first->hdr->is_leaf = 1;
+    first->hdr->alloc_policy = leaf->hdr->alloc_policy;
+    first->hdr->slot_format = leaf->hdr->slot_format;
+    first->hdr->counted = leaf->hdr->counted;
+    first->hdr->prev_pid = leaf->hdr->prev_pid;
+
+    u32 next_pid = leaf->hdr->rightmost_pid;
+    u32 pages_n = 1;
+    BTPage* page = first;
+    u32 taken = 0;
+    u32 page_taken = 0;
+    for (u32 j = 0; j < count; j++) {
+        u32 size = items[j].size + slot_size;
+        if (page_taken > 0 && (taken + size / 2 > share * pages_n || page_taken + size > capacity)) {
+            BTPage* next = bulk_page_new(btree, 1);
+            next->hdr->prev_pid = page == first ? leaf->hdr->pid : page->hdr->pid;
+            page->hdr->rightmost_pid = next->hdr->pid;
+            bulk_page_close(page);
+            page = next;
+            pages_n++;
+            page_taken = 0;
+        }
+        write_batch_append(btree, page, leaf, items + j, values);
+        taken += size;
+        page_taken += size;
+    }
+
+    page->hdr->rightmost_pid = next_pid;
+    bulk_page_close(page);
+    if (page != first && next_pid != NO_PID) {
+        buffer[next_pid]->hdr->prev_pid = page->hdr->pid;
+    }
+
+    page_replace(leaf, first);
+    page_destroy(first);
+    if (pages_n == 1) {
+        return;
+    }
+    page_bump_version(leaf);
+
+    // new pages follow the leaf in the leaf chain
+    btree->version++;
+    char sep[max_payload_size(page_size)];
+    BTPage* left = leaf;
+    for (u32 j = 1; j < pages_n; j++) {
+        BTPage* right = buffer[left->hdr->rightmost_pid];
+        Value key = page_key_at(right, 0);
+        u32 sep_size = key.size;
+        memcpy(sep, key.data, key.size);
+
+        // path to the left page, crumbs of the leaf are used for the first one
+        BTCrumbs path;
+        if (j > 1) {
+            BTPage* found = btree_descend(btree, sep, sep_size, &path, NULL, NULL);
+            assert(found == left);
+            crumbs = &path;
+        }
+        page_blink_split(left, right, (Value) { .data = sep, .size = sep_size });
+        int rc = btree_promote(btree, crumbs, left, right, sep, sep_size);
+        assert(rc == Ok);
+        left = right;
+    }
+}
+
+// Insert or overwrite 'n' keys, keys[i] is set to values[i].
+// When a key is given more than once the last value wins.
+// Return PayloadTooBig if some key is too large, nothing is written then.
+int btree_write_batch(BTree* btree, const Value* keys, const Value* values, u32 n) {
+    for (u32 i = 0; i < n; i++) {
+        if (keys[i].size > max_key_size(btree->page_size)) {
+            return PayloadTooBig;
+        }
+    }
+    if (n == 0) {
+        return Ok;
+    }
+
+    BTMultiGetKey* sorted = malloc(2 * n * sizeof(BTMultiGetKey));
+    for (u32 i = 0; i < n; i++) {
+        u32 hint = btree->hint != NULL ? btree->hint(keys[i].data, keys[i].size) : 0;
+        sorted[i] = (BTMultiGetKey) { .key = keys[i], .hint = hint, .index = i };
+    }
+    multi_get_sort(btree, sorted, sorted + n, n);
+
+    // keep the last entry of equal keys
+    u32 unique = 0;
+    for (u32 i = 0; i < n; i++) {
+        BTMultiGetKey* prev = sorted + unique - 1;
+        if (unique > 0 && btree->cmp(prev->key.data, prev->key.size, sorted[i].key.data, sorted[i].key.size) == 0) {
+            if (sorted[i].index > prev->index) {
+                *prev = sorted[i];
+            }
+            continue;
+        }
+        sorted[unique++] = sorted[i];
+    }
+
+    BTWriteItem* items = NULL;
+    u32 items_capacity = 0;
+    u32 i = 0;
+    while (i < unique) {
+        BTCrumbs crumbs;
+        Value high;
+        Value key = sorted[i].key;
+        BTPage* leaf = btree_descend(btree, key.data, key.size, &crumbs, NULL, &high);
+
+        u32 end = i + 1;
+        while (end < unique && (high.data == NULL
+            || btree->cmp(sorted[end].key.data, sorted[end].key.size, high.data, high.size) < 0)) {
+            end++;
+        }
+
+        if (btree->counted) {
+            int added = 0;
+            for (u32 j = i; j < end; j++) {
+                added += page_find_cell(leaf, sorted[j].key.data, sorted[j].key.size) == -1;
+            }
+            btree_count_path(btree, &crumbs, key.data, key.size, added);
+        }
+
+        // small group is cheaper to insert in place than to rebuild the leaf
+        if ((end - i) * WRITE_BATCH_REBUILD_RATIO < leaf->hdr->cell_count) {
+            i += write_batch_insert(btree, leaf, sorted + i, end - i, values);
+        }
+        if (i < end) {
+            u32 needed = leaf->hdr->cell_count + end - i;
+            if (needed > items_capacity) {
+                items_capacity = needed;
+                items = realloc(items, items_capacity * sizeof(BTWriteItem));
+                assert(items != NULL);
+            }
+            write_batch_apply(btree, &crumbs, leaf, sorted + i, end - i, values, items);
+        }
+        i = end;
+    }
+
+    free(items);
+    free(sorted);
+    return Ok;
+}
+
+// Cursor
+// Cursor walks leaves in either direction through their sibling links.
+// Keys and values it returns point directly into page memory
+// and are valid until the tree is modified.
+/////////////////////////////////////////////////
+
+typedef struct BTCursor {
+    BTree* btree;
+    BTPage* page;
+    u16 pos;
+    // set by btree_prefix_scan, cells before prefix_end of the page
+    // have the prefix
+    const void* prefix;
+    u32 prefix_size;
+    u16 prefix_end;
+} BTCursor;
+
+// Move cursor to the next leaf while it is past the last cell of
+// its page, empty leaves are skipped. Return false at the end of the tree.
+bool cursor_settle(BTCursor* cursor) {
+    while (cursor->page != NULL && cursor->pos >= cursor->page->hdr->cell_count) {
+        u32 next_pid = cursor->page->hdr->rightmost_pid;
+        cursor->page = next_pid != NO_PID ? buffer[next_pid] : NULL;
+        cursor->pos = 0;
+    }
+    return cursor->page != NULL;
+}
+
+// Position cursor at the first key that is >= key,
+// or at the first key of the tree if key is NULL.
+// Return false if there is no such key.
+bool btree_cursor_seek(BTCursor* cursor, BTree* btree, const void* key, u32 key_size) {
+    cursor->btree = btree;
+    cursor->pos = 0;
+    cursor->prefix = NULL;
+
+    if (key == NULL) {
+        BTPage* page = buffer[btree->root_page_id];
+        while (!page->hdr->is_leaf) {
+            page = buffer[page_child_at(page, 0)];
+        }
+        cursor->page = page;
+    } else {
+        cursor->page = btree_seek_leaf(btree, key, key_size);
+        cursor->pos = page_insertion_point(cursor->page, key, key_size);
+    }
+    return cursor_settle(cursor);
+}
+
+// Move cursor to the last cell before its position, going to previous
+// leaves when it is at the first cell, empty leaves are skipped.
+// Return false at the start of the tree.
+bool cursor_settle_prev(BTCursor* cursor) {
+    while (cursor->page != NULL && cursor->pos == 0) {
+        u32 prev_pid = cursor->page->hdr->prev_pid;
+        cursor->page = prev_pid != NO_PID ? buffer[prev_pid] : NULL;
+        cursor->pos = cursor->page != NULL ? cursor->page->hdr->cell_count : 0;
+    }
+    if (cursor->page != NULL) {
+        cursor->pos--;
+    }
+    return cursor->page != NULL;
+}
+
+// Position cursor at the last key that is <= key,
+// or at the last key of the tree if key is NULL.
+// Return false if there is no such key.
+bool btree_cursor_seek_for_prev(BTCursor* cursor, BTree* btree, const void* key, u32 key_size) {
+    cursor->btree = btree;
+    cursor->prefix = NULL;
+
+    if (key == NULL) {
+        BTPage* page = buffer[btree->root_page_id];
+        while (!page->hdr->is_leaf) {
+            page = buffer[page->hdr->rightmost_pid];
+        }
+        cursor->page = page;
+        cursor->pos = page->hdr->cell_count;
+    } else {
+        cursor->page = btree_seek_leaf(btree, key, key_size);
+        // first cell with larger key, the one before it is the result
+        cursor->pos = page_child_position(cursor->page, key, key_size);
+    }
+    return cursor_settle_prev(cursor);
+}
+
+bool cursor_settle_prefix(BTCursor* cursor);
+
+// Return false when there are no more keys.
+bool btree_cursor_next(BTCursor* cursor) {
+    if (cursor->page == NULL) {
+        return false;
+    }
+    cursor->pos++;
+    return cursor->prefix != NULL ? cursor_settle_prefix(cursor) : cursor_settle(cursor);
+}
+
+// Return false when there are no more keys.
+bool btree_cursor_prev(BTCursor* cursor) {
+    if (cursor->page == NULL) {
+        return false;
+    }
+    return cursor_settle_prev(cursor);
+}
+
+bool btree_cursor_valid(BTCursor* cursor) {
+    return cursor->page != NULL;
+}
+
+Value btree_cursor_key(BTCursor* cursor) {
+    assert(cursor->page != NULL);
+    return page_key_at(cursor->page, cursor->pos);
+}
+
+// Same as btree_get, data is NULL for values stored in overflow
+// pages, use btree_cursor_stream to read them.
+Value btree_cursor_value(BTCursor* cursor) {
+    assert(cursor->page != NULL);
+    return page_value_at(cursor->page, cursor->pos);
+}
+
+void btree_cursor_stream(BTCursor* cursor, BTValueStream* stream) {
+    assert(cursor->page != NULL);
+    value_stream_open(stream, cursor->page, cursor->pos);
+}
+
+void btree_cursor_close(BTCursor* cursor) {
+    cursor->btree = NULL;
+    cursor->page = NULL;
+    cursor->pos = 0;
+    cursor->prefix = NULL;
+}
+
+bool key_has_prefix(Value key, const void* prefix, u32 prefix_size) {
+    return key.size >= prefix_size && memcmp(key.data, prefix, prefix_size) == 0;
+}
+
+// Cursor is at a key >= prefix, so keys with the prefix form a run
+// starting at its position. Find the end of the run in the page,
+// it is the whole rest of the page when the last key matches.
+u16 page_prefix_end(BTPage* page, u16 pos, const void* prefix, u32 prefix_size) {
+    u16 n = page->hdr->cell_count;
+    if (key_has_prefix(page_key_at(page, n - 1), prefix, prefix_size)) {
+        return n;
+    }
+    u16 low = pos;
+    u16 high = n - 1;
+    while (low < high) {
+        u16 mid = low + (high - low) / 2;
+        if (key_has_prefix(page_key_at(page, mid), prefix, prefix_size)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Find the run of keys with the prefix in the page cursor has just
+// entered, cursor ends if its key does not match.
+bool cursor_prefix_run(BTCursor* cursor) {
+    cursor->prefix_end = page_prefix_end(cursor->page, cursor->pos, cursor->prefix, cursor->prefix_size);
+    if (cursor->pos >= cursor->prefix_end) {
+        cursor->page = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Settle cursor like cursor_settle and end it at the first key without
+// the prefix. Keys are compared only when the cursor enters a leaf,
+// within the page it is enough to check the position.
+bool cursor_settle_prefix(BTCursor* cursor) {
+    if (cursor->pos < cursor->prefix_end) {
+        return true;
+    }
+    // run ended inside the page, next key does not match
+    if (cursor->pos < cursor->page->hdr->cell_count) {
+        cursor->page = NULL;
+        return false;
+    }
+    return cursor_settle(cursor) && cursor_prefix_run(cursor);
+}
+
+// Position cursor at the first key starting with the prefix, cursor
+// then stops at the first key that does not have it. Keys are compared
+// bytewise, so tree must use binary_collation for them to be contiguous.
+// Prefix must stay valid while the cursor is used, only
+// btree_cursor_next is bounded by it.
+// Return false if no key has the prefix.
+bool btree_prefix_scan(BTCursor* cursor, BTree* btree, const void* prefix, u32 prefix_size) {
+    assert(btree->cmp == binary_collation);
+    cursor->btree = btree;
+    cursor->page = btree_seek_leaf(btree, prefix, prefix_size);
+    cursor->pos = page_insertion_point(cursor->page, prefix, prefix_size);
+    cursor->prefix = prefix;
+    cursor->prefix_size = prefix_size;
+    return cursor_settle(cursor) && cursor_prefix_run(cursor);
+}
+
+// Continuation of a paginated scan, the last key read and the leaf it
+// was read from with its version. Leaf is valid while its version is
+// unchanged, changes elsewhere in the tree don't affect it. Token is
+// sizeof(BTScanToken) + key_size bytes with no pointers, it can be
+// copied around as is.
+typedef struct BTScanToken {
+    u32 pid;
+    u32 version;
+    u32 key_size;
+    char key[];
+} BTScanToken;
+
+// Token of the key at the cursor, caller frees it.
+BTScanToken* btree_cursor_token(BTCursor* cursor) {
+    assert(cursor->page != NULL);
+    Value key = page_key_at(cursor->page, cursor->pos);
+    BTScanToken* token = malloc(sizeof(BTScanToken) + key.size);
+    assert(token != NULL);
+    token->pid = cursor->page->hdr->pid;
+    token->version = cursor->page->hdr->version;
+    token->key_size = key.size;
+    memcpy(token->key, key.data, key.size);
+    return token;
+}
+
+// Position cursor at the first key after the token key. Leaf of the
+// token is searched directly when its version didn't change since
+// the token was taken, keys may have been added or removed from it
+// so position is found by the key. Otherwise the key is sought from root.
+// Return false if there are no more keys.
+bool btree_cursor_resume(BTCursor* cursor, BTree* btree, const BTScanToken* token) {
+    cursor->btree = btree;
+    cursor->prefix = NULL;
+    // freed page is either gone or has a new version
+    BTPage* leaf = token->pid < page_counter ? buffer[token->pid] : NULL;
+    if (leaf != NULL && leaf->btree == btree && leaf->hdr->version == token->version) {
+        cursor->page = leaf;
+    } else {
+        cursor->page = btree_seek_leaf(btree, token->key, token->key_size);
+    }
+    cursor->pos = page_child_position(cursor->page, token->key, token->key_size);
+    return cursor_settle(cursor);
+}
+
+// Order statistics
+// Internal cells of counted tree hold entry counts of their child
+// subtrees (count of the rightmost child is kept in the page header),
+// so rank of a key is the sum of counts left of its path and the k-th
+// key is found by walking down the counts, without scanning leaves.
+/////////////////////////////////////////////////
+
+// Number of keys smaller than the key.
+u32 btree_rank(BTree* btree, const void* key, u32 key_size) {
+    assert(btree->counted);
+    u32 rank = 0;
+    u32 total = btree->count;
+    BTPage* page = buffer[btree->root_page_id];
+    while (!page->hdr->is_leaf) {
+        // counts are summed from the closer end of the page
+        u16 n = page->hdr->cell_count;
+        u16 pos = page_child_position(page, key, key_size);
+        u32 child_total = page_child_count(page, pos);
+        if (pos <= n / 2) {
+            for (u16 i = 0; i < pos; i++) {
+                rank += page_child_count(page, i);
+            }
+        } else {
+            u32 right = 0;
+            for (u16 i = pos + 1; i <= n; i++) {
+                right += page_child_count(page, i);
+            }
+            rank += total - child_total - right;
+        }
+        total = child_total;
+        page = buffer[page_child_at(page, pos)];
+    }
+    return rank + page_insertion_point(page, key, key_size);
+}
+
+// Key at position k (from 0) in key order. Key is empty (data is NULL)
+// when the tree has at most k keys, otherwise it points into page memory
+// and is valid until the tree is modified.
+Value btree_select(BTree* btree, u32 k) {
+    assert(btree->counted);
+    if (k >= btree->count) {
+        return (Value) { .data = NULL, .size = 0 };
+    }
+
+    BTPage* page = buffer[btree->root_page_id];
+    while (!page->hdr->is_leaf) {
+        u16 pos = 0;
+        while (pos < page->hdr->cell_count && k >= page_child_count(page, pos)) {
+            k -= page_child_count(page, pos);
+            pos++;
+        }
+        page = buffer[page_child_at(page, pos)];
+    }
+    return page_key_at(page, k);
+}
+
+// Number of keys in [low, high), missing (NULL) bound is unbounded.
+u32 btree_count_range(BTree* btree, const void* low, u32 low_size, const void* high, u32 high_size) {
+    u32 start = low != NULL ? btree_rank(btree, low, low_size) : 0;
+    u32 end = high != NULL ? btree_rank(btree, high, high_size) : btree->count;
+    return end > start ? end - start : 0;
+}
+
+// Concurrency
+// Trees created with 'concurrent' config can be read and written by many
+// threads at once through btree_get_concurrent and btree_insert_concurrent
+// (optimistic lock coupling). Every page has a version latch: odd version
+// means the page is locked by a writer, each unlock bumps the version.
+// Readers take no latch and write no shared memory, they remember the
+// version of a page, read it and check the version didn't change,
+// otherwise they restart from the root. Page content read meanwhile may
+// be torn so it is bounds checked before use.
+// Pages are also linked B-link style: a split sets high key of the page
+// to the separator and its right link to the new page before the parent
+// is updated, search with key at or past the high key moves right.
+// Writers descend the same way and lock the leaf they modify (its right
+// sibling too when the leaf is split). The split is then promoted with
+// one latch held at a time (see btree_promote_concurrent). Root pid is
+// guarded by a latch of its own.
+// Other operations need exclusive access to the tree. Values stored
+// in overflow pages are not supported by concurrent operations.
+/////////////////////////////////////////////////
+
+// Version of the latch, false if it is locked.
+bool latch_read(u64* latch, u64* version) {
+    *version = __atomic_load_n(latch, __ATOMIC_ACQUIRE);
+    return (*version & 1) == 0;
+}
+
+// True if nothing was written under the latch since it was read.
+bool latch_check(u64* latch, u64 version) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(latch, __ATOMIC_RELAXED) == version;
+}
+
+// Lock the latch if it is still at 'version'.
+bool latch_upgrade(u64* latch, u64 version) {
+    return __atomic_compare_exchange_n(latch, &version, version + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void latch_unlock(u64* latch) {
+    __atomic_fetch_add(latch, 1, __ATOMIC_RELEASE);
+}
+
+// Page registered under pid, NULL if there is none. Capacity is read
+// first, buffer it was published with is at least as large.
+BTPage* buffer_page_optimistic(u32 pid) {
+    if (pid >= __atomic_load_n(&buffer_capacity, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    BTPage** pages = __atomic_load_n(&buffer, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(pages + pid, __ATOMIC_ACQUIRE);
+}
+
+// Cell at given position read without latch, false if it
+// doesn't lie within the page (page is being modified).
+bool page_cell_at_optimistic(BTPage* page, u16 pos, BTCell* cell) {
+    u32 page_size = page->btree->page_size;
+    *cell = page_cell_at(page, pos);
+    u32 size = cell_local_size(page_size, cell->key_size, cell->data_size);
+    return (u64)cell->offset + size <= page_size;
+}
+
+// In-page search without latch. Sets position of the first cell with key
+// larger than the key ('upper') or not smaller than it. Returns false
+// if the page is inconsistent.
+bool page_search_optimistic(BTPage* page, const void* key, u32 key_size, u32 key_hint, bool upper, u16* pos) {
+    u32 page_size = page->btree->page_size;
+    u16 n = page->hdr->cell_count;
+    if (n > (page_size - PAGE_HDR_SIZE) / PAGE_CELL_PTR_SIZE) {
+        return false;
+    }
+
+    u16 lo = 0;
+    u16 hi = n;
+    if (page_has_hints(page)) {
+        lo = hint_lower_bound(page->cell_ptrs, n, key_hint);
+        if (key_hint != UINT32_MAX) {
+            hi = lo + hint_lower_bound(page->cell_ptrs + lo, n - lo, key_hint + 1);
+        }
+    }
+
+    while (lo < hi) {
+        u16 mid = (lo + hi) / 2;
+        BTCell cell;
+        if (!page_cell_at_optimistic(page, mid, &cell)) {
+            return false;
+        }
+        Value cell_key = page_cell_key(page, &cell);
+        int cmp = page->btree->cmp(key, key_size, cell_key.data, cell_key.size);
+        if (cmp > 0 || (upper && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return true;
+}
+
+// Child page of internal page that may contain the key, read without latch.
+// NO_PID if the page is inconsistent.
+u32 page_child_optimistic(BTPage* page, const void* key, u32 key_size, u32 key_hint) {
+    u16 pos;
+    if (!page_search_optimistic(page, key, key_size, key_hint, true, &pos)) {
+        return NO_PID;
+    }
+    if (pos == page->hdr->cell_count) {
+        return page->hdr->rightmost_pid;
+    }
+    BTCell cell;
+    if (!page_cell_at_optimistic(page, pos, &cell) || cell.data_size != sizeof(u32)) {
+        return NO_PID;
+    }
+    u32 pid;
+    memcpy(&pid, page_cell_data(page, &cell).data, sizeof(u32));
+    return pid;
+}
+
+// Current root and its version.
+BTPage* btree_root_optimistic(BTree* btree, u64* root_version, u64* version) {
+    if (!latch_read(&btree->root_latch, root_version)) {
+        return NULL;
+    }
+    BTPage* root = buffer_page_optimistic(__atomic_load_n(&btree->root_page_id, __ATOMIC_ACQUIRE));
+    if (root == NULL || !latch_read(&root->latch, version) || !latch_check(&btree->root_latch, *root_version)) {
+        return NULL;
+    }
+    return root;
+}
+
+// Step from 'page' at 'version' to its child that may contain the key.
+// NULL if the page was modified meanwhile.
+BTPage* page_descend_optimistic(BTPage* page, u64 version, const void* key, u32 key_size, u32 key_hint, u64* child_version) {
+    u32 pid = page_child_optimistic(page, key, key_size, key_hint);
+    if (pid == NO_PID || !latch_check(&page->latch, version)) {
+        return NULL;
+    }
+    BTPage* child = buffer_page_optimistic(pid);
+    if (child == NULL || !latch_read(&child->latch, child_version) || !latch_check(&page->latch, version)) {
+        return NULL;
+    }
+    return child;
+}
+
+// Page at the level of 'page' (read at 'version') that may contain the key.
+// Right links are followed while the key is at or past the high key, the
+// page was split then and its parent may not know the new sibling yet.
+// NULL if some page was modified meanwhile.
+BTPage* page_move_right_optimistic(BTPage* page, u64* version, const void* key, u32 key_size) {
+    while (true) {
+        Value high = page_high_key(page);
+        if (high.data == NULL || page->btree->cmp(key, key_size, high.data, high.size) < 0) {
+            return page;
+        }
+        BTPage* right = buffer_page_optimistic(__atomic_load_n(&page->right_pid, __ATOMIC_ACQUIRE));
+        u64 right_version;
+        if (right == NULL || !latch_read(&right->latch, &right_version) || !latch_check(&page->latch, *version)) {
+            return NULL;
+        }
+        page = right;
+        *version = right_version;
+    }
+}
+
+// Leaf that may contain the key and its version, internal pages on
+// the way are pushed to 'crumbs' (if given). NULL if some page was
+// modified meanwhile.
+BTPage* btree_descend_optimistic(BTree* btree, const void* key, u32 key_size, u32 key_hint, BTCrumbs* crumbs, u64* version) {
+    u64 root_version;
+    BTPage* page = btree_root_optimistic(btree, &root_version, version);
+    if (page != NULL) {
+        page = page_move_right_optimistic(page, version, key, key_size);
+    }
+
+    while (page != NULL && !page->hdr->is_leaf) {
+        u64 child_version;
+        BTPage* child = page_descend_optimistic(page, *version, key, key_size, key_hint, &child_version);
+        if (child == NULL) {
+            return NULL;
+        }
+        if (crumbs != NULL) {
+            btcrumbs_push(crumbs, page);
+        }
+        *version = child_version;
+        page = page_move_right_optimistic(child, version, key, key_size);
+    }
+    return page;
+}
+
+// Lock the latch, waiting while another writer holds it.
+void latch_lock(u64* latch) {
+    u64 version;
+    while (!latch_read(latch, &version) || !latch_upgrade(latch, version)) {
+        sched_yield();
+    }
+}
+
+// Lock page at the level of locked 'page' that may hold the key,
+// the page is unlocked when the lock moves right.
+BTPage* page_move_right_locked(BTPage* page, const void* key, u32 key_size) {
+    while (true) {
+        Value high = page_high_key(page);
+        if (high.data == NULL || page->btree->cmp(key, key_size, high.data, high.size) < 0) {
+            return page;
+        }
+        BTPage* right = buffer[page->right_pid];
+        latch_unlock(&page->latch);
+        latch_lock(&right->latch);
+        page = right;
+    }
+}
+
+// Insert separator of the split into the parents. 'left' was split
+// into itself and 'right' at 'height' (leaves are at 0), 'crumbs' hold
+// pages above it, which may have been split since. One latch is held
+// at a time: parent is locked, moved right from if the separator is past
+// its high key, and unlocked once the separator is in. When the parent
+// is split too its own separator goes up the same way.
+void btree_promote_concurrent(
+    BTree* btree, BTCrumbs* crumbs, u8 height,
+    u32 left_pid, u32 right_pid,
+    const void* key, u32 key_size
+) {
+    char sep[max_payload_size(btree->page_size)];
+    u32 sep_size = key_size;
+    memcpy(sep, key, key_size);
+
+    while (true) {
+        if (crumbs->n == 0) {
+            latch_lock(&btree->root_latch);
+            if (btree->root_page_id == left_pid) {
+                BTCrumbs root;
+                btcrumbs_init(&root);
+                int rc = btree_promote(btree, &root, buffer[left_pid], buffer[right_pid], sep, sep_size);
+                assert(rc == Ok);
+                latch_unlock(&btree->root_latch);
+                return;
+            }
+            latch_unlock(&btree->root_latch);
+
+            // tree has grown since the path was taken, parent
+            // is found on the new path to the separator. Page split off
+            // the old root is reachable before the new root is installed,
+            // the path is too short until the root split is finished.
+            u32 sep_hint = btree->hint != NULL ? btree->hint(sep, sep_size) : 0;
+            u64 version;
+            while (true) {
+                btcrumbs_init(crumbs);
+                if (btree_descend_optimistic(btree, sep, sep_size, sep_hint, crumbs, &version) != NULL
+                    && crumbs->n > height) {
+                    break;
+                }
+                sched_yield();
+            }
+            crumbs->n -= height;
+        }
+
+        BTPage* parent = btcrumbs_pop(crumbs);
+        latch_lock(&parent->latch);
+        parent = page_move_right_locked(parent, sep, sep_size);
+
+        // child that holds the separator may not be 'left' when splits
+        // of the level below are promoted out of order
+        u32 child_pid = page_child_at(parent, page_child_position(parent, sep, sep_size));
+        int rc = page_internal_insert(parent, sep, sep_size, child_pid, right_pid);
+        if (rc != NotEnoughSpace) {
+            assert(rc == Ok);
+            latch_unlock(&parent->latch);
+            return;
+        }
+
+        char split_key[max_payload_size(btree->page_size)];
+        u32 split_key_size;
+        __atomic_add_fetch(&btree->version, 1, __ATOMIC_RELAXED);
+        BTPageSplitResult split = page_internal_split(parent, split_key, &split_key_size);
+        assert(split.status == Ok);
+
+        BTPage* target = parent;
+        if (btree->cmp(sep, sep_size, split_key, split_key_size) >= 0) {
+            target = split.new_page;
+        }
+        child_pid = page_child_at(target, page_child_position(target, sep, sep_size));
+        rc = page_internal_insert(target, sep, sep_size, child_pid, right_pid);
+        assert(rc == Ok);
+        latch_unlock(&parent->latch);
+
+        height++;
+        left_pid = parent->hdr->pid;
+        right_pid = split.new_page->hdr->pid;
+        sep_size = split_key_size;
+        memcpy(sep, split_key, split_key_size);
+    }
+}
+
+// Copy value of the key into 'dest' (of 'dest_size' bytes), '*size' is set
+// to the size of the value. Return KeyNotFound if key doesn't exist,
+// NotEnoughSpace if the value doesn't fit into 'dest' and PayloadTooBig
+// if the value is stored in overflow pages.
+int btree_get_concurrent(BTree* btree, const void* key, u32 key_size, void* dest, u32 dest_size, u32* size) {
+    assert(btree->concurrent);
+    u32 key_hint = btree->hint != NULL ? btree->hint(key, key_size) : 0;
+
+restart:;
+    u64 version;
+    BTPage* page = btree_descend_optimistic(btree, key, key_size, key_hint, NULL, &version);
+    if (page == NULL) {
+        goto restart;
+    }
+
+    u16 pos;
+    BTCell cell;
+    if (!page_search_optimistic(page, key, key_size, key_hint, false, &pos)) {
+        goto restart;
+    }
+    int rc = KeyNotFound;
+    if (pos < page->hdr->cell_count) {
+        if (!page_cell_at_optimistic(page, pos, &cell)) {
+            goto restart;
+        }
+        Value cell_key = page_cell_key(page, &cell);
+        if (btree->cmp(key, key_size, cell_key.data, cell_key.size) == 0) {
+            *size = cell.data_size;
+            rc = Ok;
+            if (cell_overflows(btree->page_size, cell.key_size, cell.data_size)) {
+                rc = PayloadTooBig;
+            } else if (cell.data_size > dest_size) {
+                rc = NotEnoughSpace;
+            } else {
+                memcpy(dest, page_cell_data(page, &cell).data, cell.data_size);
+            }
+        }
+    }
+
+    if (!latch_check(&page->latch, version)) {
+        goto restart;
+    }
+    return rc;
+}
+
+// Insert or overwrite the key, can run together with other
+// concurrent operations. Return PayloadTooBig if the key or
+// value doesn't fit into the page (see overflow pages).
+int btree_insert_concurrent(
+    BTree* btree,
+    const void* key, u32 key_size,
+    const void* data, u32 data_size
+) {
+    assert(btree->concurrent);
+    u32 page_size = btree->page_size;
+    if (key_size > max_key_size(page_size) || cell_overflows(page_size, key_size, data_size)) {
+        return PayloadTooBig;
+    }
+    u32 key_hint = btree->hint != NULL ? btree->hint(key, key_size) : 0;
+
+    BTCrumbs crumbs;
+    u64 version;
+    BTPage* page;
+    do {
+        btcrumbs_init(&crumbs);
+        page = btree_descend_optimistic(btree, key, key_size, key_hint, &crumbs, &version);
+    } while (page == NULL || !latch_upgrade(&page->latch, version));
+
+    // overflow pages of overwritten value are released once new value is in
+    u32 old_overflow_pid = 0;
+    u32 old_overflow_size = 0;
+    int old_pos = page_find_cell(page, key, key_size);
+    if (old_pos != -1) {
+        BTCell old = page_cell_at(page, old_pos);
+        if (cell_overflows(page_size, old.key_size, old.data_size)) {
+            old_overflow_pid = page_overflow_pid(page, old_pos);
+            old_overflow_size = old.data_size - cell_local_data_size(page_size, old.key_size, old.data_size);
+        }
+    }
+
+    int rc = page_insert(page, key, key_size, data, data_size, data_size);
+    if (rc == NotEnoughSpace) {
+        // split links the right sibling back to the new page, leaves
+        // are locked left to right so waiting for it can't deadlock
+        BTPage* next = page->hdr->rightmost_pid != NO_PID ? buffer[page->hdr->rightmost_pid] : NULL;
+        if (next != NULL) {
+            latch_lock(&next->latch);
+        }
+        // structure changes like in btree_insert, other writers
+        // may split at the same time
+        __atomic_add_fetch(&btree->version, 1, __ATOMIC_RELAXED);
+        BTPageSplitResult split = page_leaf_split(page);
+        assert(split.status == Ok);
+        if (next != NULL) {
+            latch_unlock(&next->latch);
+        }
+
+        char sep[max_payload_size(page_size)];
+        Value leftmost = page_key_at(split.new_page, 0);
+        u32 sep_size = leftmost.size;
+        memcpy(sep, leftmost.data, leftmost.size);
+
+        BTPage* target = page;
+        if (btree->cmp(key, key_size, sep, sep_size) >= 0) {
+            target = split.new_page;
+        }
+        rc = page_insert(target, key, key_size, data, data_size, data_size);
+        assert(rc == Ok);
+        latch_unlock(&page->latch);
+
+        // new page is reachable through the right link until
+        // the parents know it
+        btree_promote_concurrent(btree, &crumbs, 0, page->hdr->pid, split.new_page->hdr->pid, sep, sep_size);
+    } else {
+        latch_unlock(&page->latch);
+    }
+
+    if (rc == Ok && old_overflow_size > 0) {
+        overflow_free(old_overflow_pid, old_overflow_size);
+    }
+    return rc;
+}
+
+void reset_buffer() {
+    for (u32 i = 0; i < buffer_capacity; i++) {
+        if (buffer[i] != NULL) {
+            page_destroy(buffer[i]);
+        }
+        buffer[i] = NULL;
+    }
+    for (u32 i = 0; i < retired_buffer_count; i++) {
+        free(retired_buffers[i]);
+    }
+    retired_buffer_count = 0;
     page_counter = 0;
+    defrag_counter = 0;
 }
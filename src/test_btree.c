@@ -5,24 +5,24 @@
 // Test data 1 
 const u32 td1_key1 = 1;
 const size_t td1_key1_size = sizeof(u32);
-const char* td1_data1 = "111111111111111111111111111111111111111";
-const size_t td1_data1_size = 40;
+const char* td1_data1 = "111111111111111111111";
+const size_t td1_data1_size = 22;
 const size_t td1_entry1_size = td1_key1_size + td1_data1_size;
 
-const size_t td1_freespace3_size = 25;
+const size_t td1_freespace3_size = 21;
 
 const u32 td1_key2 = 4;
 const size_t td1_key2_size = sizeof(u32);
-const char* td1_data2 = "222222222222222222222222222222222222222";
-const size_t td1_data2_size = 40;
+const char* td1_data2 = "222222222222222222222";
+const size_t td1_data2_size = 22;
 const size_t td1_entry2_size = td1_key2_size + td1_data2_size;
 
 const size_t td1_freespace2_size = 20;
 
 const u32 td1_key3 = 8;
 const size_t td1_key3_size = sizeof(u32);
-const char* td1_data3 = "33333333333333333333333333333333";
-const size_t td1_data3_size = 33;
+const char* td1_data3 = "3333333333333333333333333333";
+const size_t td1_data3_size = 29;
 const size_t td1_entry3_size = td1_key3_size + td1_data3_size;
 ////////////////////////////////////////////////////////////////////////
 
@@ -76,21 +76,21 @@ void test_insert_when_empty() {
     // check first input
     TEST_ASSERT_EQUAL_INT(key1, get_key(page, 1));
     TEST_ASSERT_EQUAL_STRING(data1, get_data(page, 1));
-    BTCellPtr* cell1 = page_cellptr_at(page, 1);
+    BTCell cell1 = page_cell_at(page, 1);
     size_t payload1_size = key1_size + data1_size;
-    TEST_ASSERT_EQUAL_INT(PAGE_SIZE - payload1_size, cell1->offset);
-    TEST_ASSERT_EQUAL_INT(key1_size, cell1->key_size);
-    TEST_ASSERT_EQUAL_INT(data1_size, cell1->data_size);
+    TEST_ASSERT_EQUAL_INT(PAGE_SIZE - payload1_size, cell1.offset);
+    TEST_ASSERT_EQUAL_INT(key1_size, cell1.key_size);
+    TEST_ASSERT_EQUAL_INT(data1_size, cell1.data_size);
 
     // because key 321 is smaller then 1234 we expect to
     // find cell of '321' entry at first position
     TEST_ASSERT_EQUAL_INT(key2, get_key(page, 0));
     TEST_ASSERT_EQUAL_STRING(data2, get_data(page, 0));
-    BTCellPtr* cell2 = page_cellptr_at(page, 0);
+    BTCell cell2 = page_cell_at(page, 0);
     size_t payload2_size = key2_size + data2_size;
-    TEST_ASSERT_EQUAL_INT(PAGE_SIZE - payload1_size - payload2_size, cell2->offset);
-    TEST_ASSERT_EQUAL_INT(key2_size, cell2->key_size);
-    TEST_ASSERT_EQUAL_INT(data2_size, cell2->data_size);
+    TEST_ASSERT_EQUAL_INT(PAGE_SIZE - payload1_size - payload2_size, cell2.offset);
+    TEST_ASSERT_EQUAL_INT(key2_size, cell2.key_size);
+    TEST_ASSERT_EQUAL_INT(data2_size, cell2.data_size);
 
     TEST_ASSERT_EQUAL_INT(1, page->hdr->freeblock_count);
     BTFreeBlock* freeblock = page_freeblock_at(page, 0);
@@ -109,17 +109,17 @@ void verify_test_data1(BTree* btree) {
 
 BTree* test_data1() {
     // Test page 1:
-    //   total: 236 bytes
-    //   freespace: 60 bytes
-    //   used: 176 bytes
-    //    - extra freeblocks: 2 (8 bytes)
-    //    - cells: 3 (36 bytes)
-    //    - data: (132 bytes) 
-    //       1. 37 bytes (4 + 33)
-    //       2. 44 bytes (4 + 40)
-    //       3. 44 bytes (4 + 40)
+    //   total: 216 bytes
+    //   freespace: 67 bytes
+    //   used: 149 bytes
+    //    - extra freeblocks: 2 (16 bytes)
+    //    - cells: 3 (48 bytes)
+    //    - data: (85 bytes) 
+    //       1. 33 bytes (4 + 29)
+    //       2. 26 bytes (4 + 22)
+    //       3. 26 bytes (4 + 22)
     // ---------------------------------------------
-    // | f:22 | d:37 | f:20 | d:44 | f: 25 | d: 44 |
+    // | f:26 | d:33 | f:20 | d:26 | f: 21 | d: 26 |
     // ---------------------------------------------
     //
 
@@ -160,39 +160,39 @@ BTree* test_data1() {
     TEST_ASSERT_EQUAL_INT(3, page->hdr->freeblock_count);
     TEST_ASSERT_EQUAL_INT(expected_freespace, page->hdr->freespace);
 
-    BTCellPtr* cp1 = page_find_cellptr(page, &td1_key1, td1_key1_size);
+    BTCell cp1 = page_cell_at(page, page_find_cell(page, &td1_key1, td1_key1_size));
     u32 expected_entry1_offset = PAGE_SIZE - td1_entry1_size;
-    TEST_ASSERT_EQUAL_INT(expected_entry1_offset, cp1->offset);
-    TEST_ASSERT_EQUAL_INT(td1_key1_size, cp1->key_size);
-    TEST_ASSERT_EQUAL_INT(td1_data1_size, cp1->data_size);
+    TEST_ASSERT_EQUAL_INT(expected_entry1_offset, cp1.offset);
+    TEST_ASSERT_EQUAL_INT(td1_key1_size, cp1.key_size);
+    TEST_ASSERT_EQUAL_INT(td1_data1_size, cp1.data_size);
 
     BTFreeBlock* fb3 = page_freeblock_at(page, 2);
     u32 expected_freespace3_offset = expected_entry1_offset - td1_freespace3_size;
     TEST_ASSERT_EQUAL_INT(expected_freespace3_offset, fb3->start_offset);
     TEST_ASSERT_EQUAL_INT(expected_freespace3_offset + td1_freespace3_size, fb3->end_offset);
 
-    BTCellPtr* cp2 = page_find_cellptr(page, &td1_key2, td1_key2_size);
+    BTCell cp2 = page_cell_at(page, page_find_cell(page, &td1_key2, td1_key2_size));
     u32 expected_entry2_offset = expected_freespace3_offset - td1_entry2_size;
-    TEST_ASSERT_EQUAL_INT(expected_entry2_offset, cp2->offset);
-    TEST_ASSERT_EQUAL_INT(td1_key2_size, cp2->key_size);
-    TEST_ASSERT_EQUAL_INT(td1_data2_size, cp2->data_size);
+    TEST_ASSERT_EQUAL_INT(expected_entry2_offset, cp2.offset);
+    TEST_ASSERT_EQUAL_INT(td1_key2_size, cp2.key_size);
+    TEST_ASSERT_EQUAL_INT(td1_data2_size, cp2.data_size);
 
     BTFreeBlock* fb2 = page_freeblock_at(page, 1);
     u32 expected_freespace2_offset = expected_entry2_offset - td1_freespace2_size;
     TEST_ASSERT_EQUAL_INT(expected_freespace2_offset, fb2->start_offset);
     TEST_ASSERT_EQUAL_INT(expected_freespace2_offset + td1_freespace2_size, fb2->end_offset);
 
-    BTCellPtr* cp3 = page_find_cellptr(page, &td1_key3, td1_key3_size);
+    BTCell cp3 = page_cell_at(page, page_find_cell(page, &td1_key3, td1_key3_size));
     u32 expected_entry3_offset = expected_freespace2_offset - td1_entry3_size;
-    TEST_ASSERT_EQUAL_INT(expected_entry3_offset, cp3->offset);
-    TEST_ASSERT_EQUAL_INT(td1_key3_size, cp3->key_size);
-    TEST_ASSERT_EQUAL_INT(td1_data3_size, cp3->data_size);
+    TEST_ASSERT_EQUAL_INT(expected_entry3_offset, cp3.offset);
+    TEST_ASSERT_EQUAL_INT(td1_key3_size, cp3.key_size);
+    TEST_ASSERT_EQUAL_INT(td1_data3_size, cp3.data_size);
 
     BTFreeBlock* fb1 = page_freeblock_at(page, 0);
-    u32 expected_freespace1_offset = expected_entry3_offset - 22;
+    u32 expected_freespace1_offset = expected_entry3_offset - 26;
     TEST_ASSERT_EQUAL_INT(expected_freespace1_offset, fb1->start_offset);
     TEST_ASSERT_EQUAL_INT(expected_freespace2_offset + td1_freespace2_size, fb2->end_offset);
-    TEST_ASSERT_EQUAL_INT(22, fb1->end_offset - fb1->start_offset);
+    TEST_ASSERT_EQUAL_INT(26, fb1->end_offset - fb1->start_offset);
 
     return btree;
 }
@@ -200,7 +200,7 @@ BTree* test_data1() {
 void test_insert_case1() {
     // - non-empty, there is enough space in first freeblock for cell and data
     // -  first freeblock == payload
-    //    test page 1 (cell: 12, data: 11) 
+    //    test page 1 (cell: 16, data: 10) 
 
     BTree* btree = test_data1();
     BTPage* page = buffer[btree->root_page_id];
@@ -223,17 +223,19 @@ void test_insert_case1() {
     // assert metadata, offsets etc
 
     // 1. initial free space was 67 bytes
-    //    we consume 10 for data and 12 for cell ptr (22 in total)
-    // 2. first freeblock entry will be removed because its consumed in full
-    // 67 - 22 + 4 = 49
-    TEST_ASSERT_EQUAL_INT(49, page->hdr->freespace);
-    TEST_ASSERT_EQUAL_INT(49, page_compute_freespace(page));
-    TEST_ASSERT_EQUAL_INT(initial_freeblock_count - 1, page->hdr->freeblock_count);
+    //    we consume 10 for data and 16 for cell ptr (26 in total)
+    // 2. first freeblock is consumed in full but it is kept (empty)
+    //    because it borders the freeblock array
+    // 67 - 26 = 41
+    TEST_ASSERT_EQUAL_INT(41, page->hdr->freespace);
+    TEST_ASSERT_EQUAL_INT(41, page_compute_freespace(page));
+    TEST_ASSERT_EQUAL_INT(initial_freeblock_count, page->hdr->freeblock_count);
+    TEST_ASSERT_EQUAL_INT(0, page->freeblocks->end_offset - page->freeblocks->start_offset);
 
-    BTCellPtr* cp = page_find_cellptr(page, &key, key_size);
-    TEST_ASSERT_EQUAL_INT(key_size, cp->key_size);
-    TEST_ASSERT_EQUAL_INT(data_size, cp->data_size);
-    TEST_ASSERT_EQUAL_INT(zero_offset + PAGE_CELL_PTR_SIZE, cp->offset);
+    BTCell cp = page_cell_at(page, page_find_cell(page, &key, key_size));
+    TEST_ASSERT_EQUAL_INT(key_size, cp.key_size);
+    TEST_ASSERT_EQUAL_INT(data_size, cp.data_size);
+    TEST_ASSERT_EQUAL_INT(zero_offset + PAGE_CELL_PTR_SIZE, cp.offset);
 
     btree_destroy(btree);
 }
@@ -241,7 +243,7 @@ void test_insert_case1() {
 void test_insert_case2() {
     // - non-empty, there is enough space in first freeblock for cell and data
     // -  first freeblock > payload
-    //    test page 1 (cell: 12, data: 8) 
+    //    test page 1 (cell: 16, data: 8) 
 
     BTree* btree = test_data1();
     BTPage* page = buffer[btree->root_page_id];
@@ -265,21 +267,21 @@ void test_insert_case2() {
     // assert metadata, offsets etc
 
     // 1. initial free space was 67 bytes
-    //    we consume 8 for data and 12 for cell ptr (20 in total)
+    //    we consume 8 for data and 16 for cell ptr (24 in total)
     // 2. first freeblock entry will be shrinked
-    // 67 - 20 = 47
-    TEST_ASSERT_EQUAL_INT(47, page->hdr->freespace);
-    TEST_ASSERT_EQUAL_INT(47, page_compute_freespace(page));
+    // 67 - 24 = 43
+    TEST_ASSERT_EQUAL_INT(43, page->hdr->freespace);
+    TEST_ASSERT_EQUAL_INT(43, page_compute_freespace(page));
     TEST_ASSERT_EQUAL_INT(initial_freeblock_count, page->hdr->freeblock_count);
 
     BTFreeBlock* first_fb = page_freeblock_at(page, 0);
     TEST_ASSERT_EQUAL_INT(zero_offset + PAGE_CELL_PTR_SIZE, first_fb->start_offset);
     TEST_ASSERT_EQUAL_INT(zero_offset + PAGE_CELL_PTR_SIZE + 2, first_fb->end_offset);
 
-    BTCellPtr* cp = page_find_cellptr(page, &key, key_size);
-    TEST_ASSERT_EQUAL_INT(key_size, cp->key_size);
-    TEST_ASSERT_EQUAL_INT(data_size, cp->data_size);
-    TEST_ASSERT_EQUAL_INT(first_fb->end_offset, cp->offset);
+    BTCell cp = page_cell_at(page, page_find_cell(page, &key, key_size));
+    TEST_ASSERT_EQUAL_INT(key_size, cp.key_size);
+    TEST_ASSERT_EQUAL_INT(data_size, cp.data_size);
+    TEST_ASSERT_EQUAL_INT(first_fb->end_offset, cp.offset);
 
     btree_destroy(btree);
 }
@@ -312,10 +314,10 @@ void test_insert_case3() {
     // assert metadata, offsets etc
 
     // 1. initial free space was 67 bytes
-    //    we consume 20 for data and 12 for cell ptr (32 in total)
+    //    we consume 20 for data and 16 for cell ptr (36 in total)
     // 2. first freeblock will be shrinked
     // 3. second freeblock will be consumed fully and removed
-    // 67 - 32 + 4 = 39
+    // 67 - 36 + 8 = 39
     TEST_ASSERT_EQUAL_INT(39, page->hdr->freespace);
     TEST_ASSERT_EQUAL_INT(39, page_compute_freespace(page));
     TEST_ASSERT_EQUAL_INT(hist_freeblock_count - 1, page->hdr->freeblock_count);
@@ -323,18 +325,18 @@ void test_insert_case3() {
     BTFreeBlock* first_fb = page_freeblock_at(page, 0);
     int fb_size = first_fb->end_offset - first_fb->start_offset;
 
-    // init = 22
-    // new cell = 12
-    // removed freeblock = 4
-    // 22 - 12 + 4 = 14
-    TEST_ASSERT_EQUAL_INT(14, fb_size);
-    int new_freeblock1_offset = hist_freeblock1_offset + 8;
+    // init = 26
+    // new cell = 16
+    // removed freeblock = 8
+    // 26 - 16 + 8 = 18
+    TEST_ASSERT_EQUAL_INT(18, fb_size);
+    int new_freeblock1_offset = hist_freeblock1_offset + PAGE_CELL_PTR_SIZE - PAGE_FREE_BLOCK_SIZE;
     TEST_ASSERT_EQUAL_INT(new_freeblock1_offset, first_fb->start_offset);
 
-    BTCellPtr* cp = page_find_cellptr(page, &key, key_size);
-    TEST_ASSERT_EQUAL_INT(key_size, cp->key_size);
-    TEST_ASSERT_EQUAL_INT(data_size, cp->data_size);
-    TEST_ASSERT_EQUAL_INT(hist_freeblock2_offset, cp->offset);
+    BTCell cp = page_cell_at(page, page_find_cell(page, &key, key_size));
+    TEST_ASSERT_EQUAL_INT(key_size, cp.key_size);
+    TEST_ASSERT_EQUAL_INT(data_size, cp.data_size);
+    TEST_ASSERT_EQUAL_INT(hist_freeblock2_offset, cp.offset);
 
     btree_destroy(btree);
 }
@@ -366,22 +368,22 @@ void test_insert_case4() {
     // assert metadata, offsets etc
 
     // 1. initial free space was 67 bytes
-    //    we consume 15 for data and 12 for cell ptr (27 in total)
+    //    we consume 15 for data and 16 for cell ptr (31 in total)
     // 2. first freeblock will be shrinked
     // 3. second freeblock will be shrinked
-    // 67 - 27 = 30
-    TEST_ASSERT_EQUAL_INT(40, page->hdr->freespace);
-    TEST_ASSERT_EQUAL_INT(40, page_compute_freespace(page));
+    // 67 - 31 = 36
+    TEST_ASSERT_EQUAL_INT(36, page->hdr->freespace);
+    TEST_ASSERT_EQUAL_INT(36, page_compute_freespace(page));
     TEST_ASSERT_EQUAL_INT(hist_freeblock_count, page->hdr->freeblock_count);
 
     BTFreeBlock* fb1 = page_freeblock_at(page, 0);
     int fb1_size = fb1->end_offset - fb1->start_offset;
 
-    // init = 22
-    // new cell = 12
-    // 22 - 12 = 10
+    // init = 26
+    // new cell = 16
+    // 26 - 16 = 10
     TEST_ASSERT_EQUAL_INT(10, fb1_size);
-    int new_freeblock1_offset = hist_freeblock1_offset + 12;
+    int new_freeblock1_offset = hist_freeblock1_offset + PAGE_CELL_PTR_SIZE;
     TEST_ASSERT_EQUAL_INT(new_freeblock1_offset, fb1->start_offset);
     TEST_ASSERT_EQUAL_INT(new_freeblock1_offset + fb1_size, fb1->end_offset);
 
@@ -393,14 +395,1681 @@ void test_insert_case4() {
     TEST_ASSERT_EQUAL_INT(5, fb2_size);
     TEST_ASSERT_EQUAL_INT(hist_freeblock2_offset, fb2->start_offset);
 
-    BTCellPtr* cp = page_find_cellptr(page, &key, key_size);
-    TEST_ASSERT_EQUAL_INT(key_size, cp->key_size);
-    TEST_ASSERT_EQUAL_INT(data_size, cp->data_size);
-    TEST_ASSERT_EQUAL_INT(fb2->start_offset + fb2_size, cp->offset);
+    BTCell cp = page_cell_at(page, page_find_cell(page, &key, key_size));
+    TEST_ASSERT_EQUAL_INT(key_size, cp.key_size);
+    TEST_ASSERT_EQUAL_INT(data_size, cp.data_size);
+    TEST_ASSERT_EQUAL_INT(fb2->start_offset + fb2_size, cp.offset);
+
+    btree_destroy(btree);
+}
+
+void test_defragment() {
+    BTree* btree = test_data1();
+    BTPage* page = buffer[btree->root_page_id];
+    int expected_freespace = page_estimate_freespace_after_defrag(page);
+
+    page_defragment(page, NULL);
+
+    verify_test_data1(btree);
+    TEST_ASSERT_EQUAL_INT(1, page->hdr->freeblock_count);
+    TEST_ASSERT_EQUAL_INT(expected_freespace, page->hdr->freespace);
+    TEST_ASSERT_EQUAL_INT(expected_freespace, page_compute_freespace(page));
+    TEST_ASSERT_EQUAL_INT(PAGE_HDR_SIZE + 3 * PAGE_CELL_PTR_SIZE + PAGE_FREE_BLOCK_SIZE, page->freeblocks->start_offset);
+
+    btree_destroy(btree);
+}
+
+void test_page_leaf_delete() {
+    // deleted cell (key 4) sits between two free blocks
+    // that are merged with its space into one
+    BTree* btree = test_data1();
+    BTPage* page = buffer[btree->root_page_id];
+    int freespace = page->hdr->freespace;
+    int freeblock_count = page->hdr->freeblock_count;
+
+    TEST_ASSERT_EQUAL_INT(Ok, page_leaf_delete(page, &td1_key2, td1_key2_size));
+    TEST_ASSERT_EQUAL_INT(KeyNotFound, page_leaf_delete(page, &td1_key2, td1_key2_size));
+
+    TEST_ASSERT_EQUAL_INT(2, page->hdr->cell_count);
+    TEST_ASSERT_EQUAL_INT(freeblock_count - 1, page->hdr->freeblock_count);
+    int expected_freespace = freespace + td1_entry2_size + PAGE_CELL_PTR_SIZE + PAGE_FREE_BLOCK_SIZE;
+    TEST_ASSERT_EQUAL_INT(expected_freespace, page->hdr->freespace);
+    TEST_ASSERT_EQUAL_INT(expected_freespace, page_compute_freespace(page));
+
+    BTFreeBlock* fb = page_freeblock_at(page, 1);
+    TEST_ASSERT_EQUAL_INT(td1_freespace2_size + td1_entry2_size + td1_freespace3_size, fb->end_offset - fb->start_offset);
+
+    TEST_ASSERT_EQUAL_STRING(td1_data1, page_data_by_key(page, &td1_key1, td1_key1_size).data);
+    TEST_ASSERT_EQUAL_STRING(td1_data3, page_data_by_key(page, &td1_key3, td1_key3_size).data);
+    TEST_ASSERT_NULL(page_data_by_key(page, &td1_key2, td1_key2_size).data);
+
+    btree_destroy(btree);
+}
+
+void test_alloc_policy() {
+    // ---------------------------------------
+    // | f0: large | f1: 12 | f2: 30 | ... |
+    // ---------------------------------------
+    BTPage* page = page_new(NULL);
+    page_insert_freespace(page, 30);
+    page_insert_freespace(page, 12);
+    BTFreeBlock f0 = *page_freeblock_at(page, 0);
+    BTFreeBlock f1 = *page_freeblock_at(page, 1);
+    BTFreeBlock f2 = *page_freeblock_at(page, 2);
+
+    // first fit takes the first block large enough
+    page->hdr->alloc_policy = FirstFit;
+    TEST_ASSERT_EQUAL_INT(f0.end_offset, page_space_alloc(page, 12));
+
+    // best fit takes the exact match and removes it
+    page->hdr->alloc_policy = BestFit;
+    TEST_ASSERT_EQUAL_INT(f1.end_offset, page_space_alloc(page, 12));
+    TEST_ASSERT_EQUAL_INT(2, page->hdr->freeblock_count);
+
+    // size class fit takes the block of the same size class (16-31 bytes)
+    page->hdr->alloc_policy = SizeClassFit;
+    TEST_ASSERT_EQUAL_INT(f2.end_offset, page_space_alloc(page, 20));
+    TEST_ASSERT_EQUAL_INT(10, page_freeblock_at(page, 1)->end_offset - page_freeblock_at(page, 1)->start_offset);
+    TEST_ASSERT_EQUAL_INT(page->hdr->freespace, page_compute_freespace(page));
+}
+
+void shuffle(u32* arr, int n) {
+    for (int i = n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        u32 tmp = arr[i];
+        arr[i] = arr[j];
+        arr[j] = tmp;
+    }
+}
+
+void fill_data(char* data, u32 key, int size) {
+    for (int i = 0; i < size - 1; i++) {
+        data[i] = 'a' + (key + i) % 26;
+    }
+    data[size - 1] = 0;
+}
+
+void verify_btree_data(BTree* btree, u32* keys, int n, int salt) {
+    char expected[MAX_PAYLOAD_SIZE];
+    for (int i = 0; i < n; i++) {
+        int size = 2 + (keys[i] + salt) % 20;
+        fill_data(expected, keys[i] + salt, size);
+        Value v = btree_get(btree, &keys[i], sizeof(u32));
+        TEST_ASSERT_NOT_NULL(v.data);
+        TEST_ASSERT_EQUAL_INT(size, v.size);
+        TEST_ASSERT_EQUAL_STRING(expected, v.data);
+    }
+}
+
+void insert_btree_data(BTree* btree, u32* keys, int n, int salt) {
+    char data[MAX_PAYLOAD_SIZE];
+    for (int i = 0; i < n; i++) {
+        int size = 2 + (keys[i] + salt) % 20;
+        fill_data(data, keys[i] + salt, size);
+        int rc = btree_insert(btree, &keys[i], sizeof(u32), data, size);
+        TEST_ASSERT_EQUAL_INT(Ok, rc);
+    }
+}
+
+void test_btree_insert_split() {
+    BTree* btree = btree_new(&compare_integers);
+
+    int n = 5000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 3;
+    }
+    srand(42);
+    shuffle(keys, n);
+
+    insert_btree_data(btree, keys, n, 0);
+    verify_btree_data(btree, keys, n, 0);
+
+    BTPage* root = buffer[btree->root_page_id];
+    TEST_ASSERT_EQUAL_INT(0, root->hdr->is_leaf);
+
+    u32 missing = 1;
+    TEST_ASSERT_NULL(btree_get(btree, &missing, sizeof(u32)).data);
+
+    btree_destroy(btree);
+}
+
+void test_btree_overwrite() {
+    BTree* btree = btree_new(&compare_integers);
+
+    int n = 3000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(7);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+
+    // overwrite with values of different sizes
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 5);
+    verify_btree_data(btree, keys, n, 5);
+
+    btree_destroy(btree);
+}
+
+void test_btree_alloc_policy() {
+    BTreeConfig config = { .alloc_policy = BestFit };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+
+    int n = 3000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(3);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 11);
+    verify_btree_data(btree, keys, n, 11);
+
+    for (u32 pid = 0; pid < page_counter; pid++) {
+        TEST_ASSERT_EQUAL_INT(BestFit, buffer[pid]->hdr->alloc_policy);
+    }
+
+    btree_destroy(btree);
+}
+
+void test_btree_key_hints() {
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_binary };
+    BTree* btree = btree_new_with_config(&binary_collation, &config);
+
+    // keys share long prefixes so most of them have the same hint
+    int n = 2000;
+    u32 ids[n];
+    for (int i = 0; i < n; i++) {
+        ids[i] = i;
+    }
+    srand(11);
+    shuffle(ids, n);
+
+    char key[32];
+    for (int i = 0; i < n; i++) {
+        int key_size = sprintf(key, "k%d/%04u", ids[i] % 3, ids[i]);
+        int rc = btree_insert(btree, key, key_size, &ids[i], sizeof(u32));
+        TEST_ASSERT_EQUAL_INT(Ok, rc);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int key_size = sprintf(key, "k%d/%04u", i % 3, i);
+        Value v = btree_get(btree, key, key_size);
+        TEST_ASSERT_NOT_NULL(v.data);
+        TEST_ASSERT_EQUAL_INT(i, *(u32*)v.data);
+    }
+
+    TEST_ASSERT_NULL(btree_get(btree, "k0/", 3).data);
+    TEST_ASSERT_NULL(btree_get(btree, "k", 1).data);
+
+    // every cell carries the hint of its key
+    for (u32 pid = 0; pid < page_counter; pid++) {
+        BTPage* page = buffer[pid];
+        for (int i = 0; i < page->hdr->cell_count; i++) {
+            Value k = page_key_at(page, i);
+            TEST_ASSERT_EQUAL_UINT32(hint_binary(k.data, k.size), page_cellptr_at(page, i)->key_hint);
+        }
+    }
+
+    btree_destroy(btree);
+}
+
+void test_hint_order() {
+    int a = -7, b = 3, c = 300000;
+    TEST_ASSERT_TRUE(hint_integers(&a, 4) < hint_integers(&b, 4));
+    TEST_ASSERT_TRUE(hint_integers(&b, 4) < hint_integers(&c, 4));
+
+    TEST_ASSERT_TRUE(hint_binary("ab", 2) < hint_binary("abc", 3));
+    TEST_ASSERT_TRUE(hint_binary("abcdz", 5) == hint_binary("abcda", 5));
+    TEST_ASSERT_TRUE(hint_binary("b", 1) > hint_binary("abcd", 4));
+}
+
+void test_hint_lower_bound_kernels() {
+    BTHintLowerBound kernels[8];
+    int nkernels = 0;
+    kernels[nkernels++] = hint_lower_bound_binary;
+    kernels[nkernels++] = hint_lower_bound_branchless;
+#ifdef HINT_SIMD
+    if (__builtin_cpu_supports("sse4.2")) {
+        kernels[nkernels++] = hint_lower_bound_sse42;
+        kernels[nkernels++] = hint_lower_bound_blocked_sse42;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[nkernels++] = hint_lower_bound_avx2;
+        kernels[nkernels++] = hint_lower_bound_blocked_avx2;
+    }
+#endif
+
+    // sorted hints with duplicates, including values with the top bit set
+    BTCellPtr cells[300];
+    u32 hint = 5;
+    srand(5);
+    for (int i = 0; i < 300; i++) {
+        hint += rand() % 3 == 0 ? 0 : (u32)rand() % 14000000;
+        cells[i].key_hint = hint;
+    }
+
+    for (u16 n = 0; n <= 300; n += 37) {
+        for (int i = 0; i < 200; i++) {
+            u32 probe = i < 100 ? cells[rand() % 300].key_hint : (u32)rand() * 3;
+            u16 expected = hint_lower_bound_binary(cells, n, probe);
+            for (int k = 0; k < nkernels; k++) {
+                TEST_ASSERT_EQUAL_INT(expected, kernels[k](cells, n, probe));
+            }
+        }
+        for (int k = 0; k < nkernels; k++) {
+            TEST_ASSERT_EQUAL_INT(0, kernels[k](cells, n, 0));
+            TEST_ASSERT_EQUAL_INT(n, kernels[k](cells, n, UINT32_MAX));
+        }
+    }
+}
+
+void fill_large_data(char* data, u32 key, u32 size) {
+    for (u32 i = 0; i < size; i++) {
+        data[i] = (char)(key * 31 + i * 7);
+    }
+}
+
+void verify_stream(BTree* btree, u32 key, const char* expected, u32 size) {
+    BTValueStream stream;
+    TEST_ASSERT_EQUAL_INT(Ok, btree_get_stream(btree, &key, sizeof(u32), &stream));
+
+    u32 read = 0;
+    Value chunk;
+    while (value_stream_next(&stream, &chunk)) {
+        TEST_ASSERT_TRUE(read + chunk.size <= size);
+        TEST_ASSERT_EQUAL_MEMORY(expected + read, chunk.data, chunk.size);
+        read += chunk.size;
+    }
+    TEST_ASSERT_EQUAL_INT(size, read);
+}
+
+// Pages in use by the tree, the only tree in the buffer.
+u32 count_pages(BTree* btree) {
+    return page_counter - btree_free_page_count(btree);
+}
+
+bool is_freelist_trunk(BTree* btree, u32 pid) {
+    for (u32 trunk = btree->freelist_pid; trunk != NO_PID; trunk = buffer[trunk]->hdr->rightmost_pid) {
+        if (trunk == pid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void test_btree_overflow() {
+    BTree* btree = btree_new(&compare_integers);
+
+    u32 sizes[] = { 10, MAX_PAYLOAD_SIZE, 500, 4000, 20000, 1, 70000 };
+    int n = sizeof(sizes) / sizeof(u32);
+    char* data = malloc(70000);
+
+    for (u32 key = 0; key < 200; key++) {
+        u32 size = sizes[key % n];
+        fill_large_data(data, key, size);
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), data, size));
+    }
+
+    for (u32 key = 0; key < 200; key++) {
+        u32 size = sizes[key % n];
+        fill_large_data(data, key, size);
+        verify_stream(btree, key, data, size);
+
+        Value v = btree_get(btree, &key, sizeof(u32));
+        TEST_ASSERT_EQUAL_INT(size, v.size);
+        if (cell_overflows(btree->page_size, sizeof(u32), size)) {
+            TEST_ASSERT_NULL(v.data);
+        } else {
+            TEST_ASSERT_EQUAL_MEMORY(data, v.data, size);
+        }
+    }
+
+    // overwrite with values of other sizes, old overflow pages are released
+    u32 pages_before = count_pages(btree);
+    for (u32 key = 0; key < 200; key++) {
+        u32 size = sizes[(key + 1) % n];
+        fill_large_data(data, key + 1, size);
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), data, size));
+    }
+    for (u32 key = 0; key < 200; key++) {
+        u32 size = sizes[(key + 1) % n];
+        fill_large_data(data, key + 1, size);
+        verify_stream(btree, key, data, size);
+    }
+    TEST_ASSERT_UINT_WITHIN(pages_before / 10, pages_before, count_pages(btree));
+
+    u32 missing = 1000;
+    BTValueStream stream;
+    TEST_ASSERT_EQUAL_INT(KeyNotFound, btree_get_stream(btree, &missing, sizeof(u32), &stream));
+
+    free(data);
+    btree_destroy(btree);
+}
+
+void test_btree_page_size() {
+    // pages larger then 64K need offsets past u16 range
+    u32 page_sizes[] = { MIN_PAGE_SIZE, 4096, 128 * 1024 };
+    char* data = malloc(300000);
+
+    for (int p = 0; p < 3; p++) {
+        BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .page_size = page_sizes[p] };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        TEST_ASSERT_EQUAL_INT(page_sizes[p], buffer[btree->root_page_id]->hdr->page_size);
+
+        int n = 20000;
+        u32 keys[n];
+        for (int i = 0; i < n; i++) {
+            keys[i] = i * 2;
+        }
+        srand(11);
+        shuffle(keys, n);
+        insert_btree_data(btree, keys, n, 0);
+        shuffle(keys, n);
+        insert_btree_data(btree, keys, n, 3);
+        verify_btree_data(btree, keys, n, 3);
+
+        BTPage* root = buffer[btree->root_page_id];
+        TEST_ASSERT_EQUAL_INT(0, root->hdr->is_leaf);
+        // payloads are allocated from the end of the page
+        u32 offset = page_cell_offset(root, root->hdr->cell_count - 1);
+        TEST_ASSERT_TRUE(offset > page_sizes[p] - PAGE_DATA_SIZE);
+
+        // values larger then the page
+        for (u32 key = 1; key < 20; key += 2) {
+            u32 size = key * 15000;
+            fill_large_data(data, key, size);
+            TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), data, size));
+        }
+        for (u32 key = 1; key < 20; key += 2) {
+            u32 size = key * 15000;
+            fill_large_data(data, key, size);
+            verify_stream(btree, key, data, size);
+        }
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+
+    free(data);
+}
+
+void test_varint() {
+    u32 values[] = { 0, 1, 127, 128, 300, 16383, 16384, 1 << 21, UINT32_MAX };
+    char buf[8];
+    for (int i = 0; i < 9; i++) {
+        u32 n = varint_put(buf, values[i]);
+        TEST_ASSERT_EQUAL_INT(varint_size(values[i]), n);
+
+        u32 v;
+        TEST_ASSERT_EQUAL_INT(n, varint_get(buf, &v));
+        TEST_ASSERT_EQUAL_UINT32(values[i], v);
+    }
+}
+
+u32 fill_page_cells(BTPage* page, u32 value_size) {
+    char value[16] = { 0 };
+    u32 key = 0;
+    while (page_leaf_insert(page, &key, sizeof(u32), value, value_size) == Ok) {
+        key++;
+    }
+    return key;
+}
+
+void test_btree_compact_slots() {
+    BTreeConfig config = { .alloc_policy = FirstFit, .slot_format = CompactSlots };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+
+    // small records take 3 bytes (2 byte slot, 1 byte header)
+    // of overhead instead of 16
+    BTreeConfig wide_config = { .alloc_policy = FirstFit };
+    BTree* wide = btree_new_with_config(&compare_integers, &wide_config);
+    BTPage* compact_page = page_new(btree);
+    BTPage* wide_page = page_new(wide);
+    TEST_ASSERT_EQUAL_INT(PAGE_DATA_SIZE / (sizeof(u32) + 8 + 4), fill_page_cells(compact_page, 8));
+    TEST_ASSERT_EQUAL_INT(PAGE_DATA_SIZE / (sizeof(u32) + 8 + PAGE_CELL_PTR_SIZE), fill_page_cells(wide_page, 8));
+    btree_destroy(wide);
+
+    int n = 3000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(3);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 9);
+    verify_btree_data(btree, keys, n, 9);
+    TEST_ASSERT_EQUAL_INT(0, buffer[btree->root_page_id]->hdr->is_leaf);
+
+    // values in overflow pages
+    char* data = malloc(5000);
+    for (u32 key = 0; key < 100; key += 7) {
+        fill_large_data(data, key, 5000);
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), data, 5000));
+    }
+    for (u32 key = 0; key < 100; key += 7) {
+        fill_large_data(data, key, 5000);
+        verify_stream(btree, key, data, 5000);
+    }
+
+    free(data);
+    btree_destroy(btree);
+}
+
+void test_btree_delete() {
+    BTree* btree = btree_new(&compare_integers);
+
+    int n = 4000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(5);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+
+    char* data = malloc(3000);
+    fill_large_data(data, 0, 3000);
+    u32 large_key = n;
+    TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &large_key, sizeof(u32), data, 3000));
+    u32 pages = count_pages(btree);
+    TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &large_key, sizeof(u32)));
+    u32 overflow_size = 3000 - cell_local_data_size(PAGE_SIZE, sizeof(u32), 3000);
+    TEST_ASSERT_EQUAL_INT(pages - overflow_page_count(PAGE_SIZE, overflow_size), count_pages(btree));
+
+    // delete every other key
+    shuffle(keys, n);
+    for (int i = 0; i < n / 2; i++) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+    }
+    for (int i = 0; i < n / 2; i++) {
+        TEST_ASSERT_EQUAL_INT(KeyNotFound, btree_delete(btree, &keys[i], sizeof(u32)));
+        TEST_ASSERT_NULL(btree_get(btree, &keys[i], sizeof(u32)).data);
+    }
+    verify_btree_data(btree, keys + n / 2, n / 2, 0);
+
+    for (u32 pid = 0; pid < page_counter; pid++) {
+        if (buffer[pid] != NULL) {
+            TEST_ASSERT_EQUAL_INT(buffer[pid]->hdr->freespace, page_compute_freespace(buffer[pid]));
+        }
+    }
+
+    // deleted keys can be inserted again
+    insert_btree_data(btree, keys, n / 2, 1);
+    verify_btree_data(btree, keys, n / 2, 1);
+    verify_btree_data(btree, keys + n / 2, n / 2, 0);
+
+    free(data);
+    btree_destroy(btree);
+}
+
+void test_btree_delete_batch() {
+    BTreeConfig config = { .alloc_policy = FirstFit, .slot_format = CompactSlots };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+
+    int n = 4000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(6);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+
+    shuffle(keys, n);
+    BTDeleteBatch batch;
+    btree_delete_batch_begin(btree, &batch);
+    TEST_ASSERT_EQUAL_INT(0, btree_delete_batch_commit(&batch));
+    for (int i = 0; i < n / 2; i++) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete_batch_add(&batch, &keys[i], sizeof(u32)));
+    }
+    // same key twice is deleted once
+    TEST_ASSERT_EQUAL_INT(Ok, btree_delete_batch_add(&batch, &keys[0], sizeof(u32)));
+    u32 missing = n;
+    TEST_ASSERT_EQUAL_INT(KeyNotFound, btree_delete_batch_add(&batch, &missing, sizeof(u32)));
+
+    // keys are visible until commit
+    verify_btree_data(btree, keys, n, 0);
+    TEST_ASSERT_EQUAL_INT(n / 2, btree_delete_batch_commit(&batch));
+
+    for (int i = 0; i < n / 2; i++) {
+        TEST_ASSERT_NULL(btree_get(btree, &keys[i], sizeof(u32)).data);
+    }
+    verify_btree_data(btree, keys + n / 2, n / 2, 0);
+
+    insert_btree_data(btree, keys, n / 2, 2);
+    verify_btree_data(btree, keys, n / 2, 2);
+
+    btree_destroy(btree);
+}
+
+typedef struct BulkInput {
+    u32* keys;
+    int n;
+    int i;
+    char data[MAX_PAYLOAD_SIZE];
+} BulkInput;
+
+// Same values as insert_btree_data with salt 0.
+bool bulk_input_next(void* ctx, Value* key, Value* value) {
+    BulkInput* input = ctx;
+    if (input->i == input->n) {
+        return false;
+    }
+
+    u32* k = input->keys + input->i++;
+    int size = 2 + *k % 20;
+    fill_data(input->data, *k, size);
+    key->data = k;
+    key->size = sizeof(u32);
+    value->data = input->data;
+    value->size = size;
+    return true;
+}
+
+u32 count_leaves() {
+    u32 n = 0;
+    for (u32 pid = 0; pid < page_counter; pid++) {
+        n += buffer[pid] != NULL && buffer[pid]->hdr->is_leaf;
+    }
+    return n;
+}
 
+void test_btree_bulk_load() {
+    int n = 5000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+
+    BTSlotFormat formats[] = { WideSlots, CompactSlots };
+    u32 fill_factors[] = { 100, 60 };
+    u32 leaves[2];
+    for (int f = 0; f < 2; f++) {
+        for (int ff = 0; ff < 2; ff++) {
+            BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .slot_format = formats[f] };
+            BTree* btree = btree_new_with_config(&compare_integers, &config);
+
+            BulkInput input = { .keys = keys, .n = n, .i = 0 };
+            BTBulkIterator it = { .next = bulk_input_next, .ctx = &input };
+            TEST_ASSERT_EQUAL_INT(Ok, btree_bulk_load(btree, &it, fill_factors[ff]));
+            TEST_ASSERT_EQUAL_INT(0, buffer[btree->root_page_id]->hdr->is_leaf);
+            // rightmost count is kept in header only by counted tree
+            for (u32 pid = 0; pid < page_counter; pid++) {
+                if (buffer[pid] != NULL && !buffer[pid]->hdr->is_leaf) {
+                    TEST_ASSERT_EQUAL_INT(0, buffer[pid]->hdr->prev_pid);
+                }
+            }
+            verify_btree_data(btree, keys, n, 0);
+
+            u32 missing = 1;
+            TEST_ASSERT_NULL(btree_get(btree, &missing, sizeof(u32)).data);
+            leaves[ff] = count_leaves();
+
+            // tree takes inserts and deletes after load
+            u32 odd_keys[n];
+            for (int i = 0; i < n; i++) {
+                odd_keys[i] = i * 2 + 1;
+            }
+            srand(8);
+            shuffle(odd_keys, n);
+            insert_btree_data(btree, odd_keys, n, 0);
+            for (int i = 0; i < n; i += 2) {
+                TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+            }
+            verify_btree_data(btree, odd_keys, n, 0);
+
+            btree_destroy(btree);
+            reset_buffer();
+        }
+        // packed leaves hold more cells
+        TEST_ASSERT_TRUE(leaves[0] * 3 / 2 <= leaves[1]);
+    }
+
+    // empty input keeps empty root leaf
+    BTree* btree = btree_new(&compare_integers);
+    BulkInput input = { .keys = keys, .n = 0, .i = 0 };
+    BTBulkIterator it = { .next = bulk_input_next, .ctx = &input };
+    TEST_ASSERT_EQUAL_INT(Ok, btree_bulk_load(btree, &it, 100));
+    TEST_ASSERT_EQUAL_INT(1, buffer[btree->root_page_id]->hdr->is_leaf);
+    TEST_ASSERT_EQUAL_INT(0, buffer[btree->root_page_id]->hdr->cell_count);
+    btree_destroy(btree);
+}
+
+// Scan whole tree with cursor forward or backward, keys must be in order
+// and have values written by insert_btree_data. Return number of keys.
+int scan_btree_data(BTree* btree, bool reverse) {
+    char expected[MAX_PAYLOAD_SIZE];
+    BTCursor cursor;
+    int n = 0;
+    u32 prev = 0;
+    bool ok = reverse
+        ? btree_cursor_seek_for_prev(&cursor, btree, NULL, 0)
+        : btree_cursor_seek(&cursor, btree, NULL, 0);
+    for (; ok; ok = reverse ? btree_cursor_prev(&cursor) : btree_cursor_next(&cursor)) {
+        u32 key = *(u32*)btree_cursor_key(&cursor).data;
+        TEST_ASSERT_TRUE(n == 0 || (reverse ? prev > key : prev < key));
+        int size = 2 + key % 20;
+        fill_data(expected, key, size);
+        Value v = btree_cursor_value(&cursor);
+        TEST_ASSERT_EQUAL_INT(size, v.size);
+        TEST_ASSERT_EQUAL_STRING(expected, v.data);
+        prev = key;
+        n++;
+    }
+    TEST_ASSERT_FALSE(btree_cursor_valid(&cursor));
+    btree_cursor_close(&cursor);
+    return n;
+}
+
+void test_btree_cursor() {
+    int n = 2000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+
+    BTree* btree = btree_new(&compare_integers);
+    BTCursor cursor;
+    TEST_ASSERT_FALSE(btree_cursor_seek(&cursor, btree, NULL, 0));
+
+    srand(11);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+    TEST_ASSERT_FALSE(buffer[btree->root_page_id]->hdr->is_leaf);
+    TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, false));
+
+    // seek lands on the first key that is >= searched key
+    u32 past_end = 2 * n;
+    for (u32 key = 0; key < past_end; key += 37) {
+        TEST_ASSERT_TRUE(btree_cursor_seek(&cursor, btree, &key, sizeof(u32)));
+        TEST_ASSERT_EQUAL_INT((key + 1) / 2 * 2, *(u32*)btree_cursor_key(&cursor).data);
+    }
+    TEST_ASSERT_FALSE(btree_cursor_seek(&cursor, btree, &past_end, sizeof(u32)));
+
+    // leaves emptied by deletes are skipped
+    for (u32 key = 200; key < 1200; key += 2) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &key, sizeof(u32)));
+    }
+    u32 key = 151;
+    TEST_ASSERT_TRUE(btree_cursor_seek(&cursor, btree, &key, sizeof(u32)));
+    u32 expected[] = { 152, 154, 156 };
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_INT(expected[i], *(u32*)btree_cursor_key(&cursor).data);
+        btree_cursor_next(&cursor);
+    }
+    key = 199;
+    TEST_ASSERT_TRUE(btree_cursor_seek(&cursor, btree, &key, sizeof(u32)));
+    TEST_ASSERT_EQUAL_INT(1200, *(u32*)btree_cursor_key(&cursor).data);
+    TEST_ASSERT_EQUAL_INT(n - 500, scan_btree_data(btree, false));
+    btree_destroy(btree);
+    reset_buffer();
+
+    // leaves of bulk loaded tree are linked as well
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+    btree = btree_new(&compare_integers);
+    BulkInput input = { .keys = keys, .n = n, .i = 0 };
+    BTBulkIterator it = { .next = bulk_input_next, .ctx = &input };
+    TEST_ASSERT_EQUAL_INT(Ok, btree_bulk_load(btree, &it, 80));
+    TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, false));
     btree_destroy(btree);
 }
 
+void test_btree_cursor_prev() {
+    int n = 2000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+
+    BTree* btree = btree_new(&compare_integers);
+    BTCursor cursor;
+    TEST_ASSERT_FALSE(btree_cursor_seek_for_prev(&cursor, btree, NULL, 0));
+
+    srand(12);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+    TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, true));
+
+    // seek for prev lands on the last key that is <= searched key
+    u32 last = 2 * n - 2;
+    for (u32 key = 1; key < 2 * last; key += 37) {
+        u32 expected = key > last ? last : key / 2 * 2;
+        TEST_ASSERT_TRUE(btree_cursor_seek_for_prev(&cursor, btree, &key, sizeof(u32)));
+        TEST_ASSERT_EQUAL_INT(expected, *(u32*)btree_cursor_key(&cursor).data);
+    }
+
+    // direction can change at any point
+    u32 key = 500;
+    TEST_ASSERT_TRUE(btree_cursor_seek(&cursor, btree, &key, sizeof(u32)));
+    for (int i = 0; i < 250; i++) {
+        TEST_ASSERT_TRUE(btree_cursor_prev(&cursor));
+    }
+    TEST_ASSERT_EQUAL_INT(0, *(u32*)btree_cursor_key(&cursor).data);
+    TEST_ASSERT_FALSE(btree_cursor_prev(&cursor));
+    TEST_ASSERT_FALSE(btree_cursor_valid(&cursor));
+
+    // leaves emptied by deletes are skipped
+    for (key = 200; key < 1200; key += 2) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &key, sizeof(u32)));
+    }
+    key = 1199;
+    TEST_ASSERT_TRUE(btree_cursor_seek_for_prev(&cursor, btree, &key, sizeof(u32)));
+    TEST_ASSERT_EQUAL_INT(198, *(u32*)btree_cursor_key(&cursor).data);
+    TEST_ASSERT_TRUE(btree_cursor_next(&cursor));
+    TEST_ASSERT_EQUAL_INT(1200, *(u32*)btree_cursor_key(&cursor).data);
+    TEST_ASSERT_EQUAL_INT(n - 500, scan_btree_data(btree, true));
+    btree_destroy(btree);
+    reset_buffer();
+
+    // bulk loaded tree
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+    btree = btree_new(&compare_integers);
+    BulkInput input = { .keys = keys, .n = n, .i = 0 };
+    BTBulkIterator it = { .next = bulk_input_next, .ctx = &input };
+    TEST_ASSERT_EQUAL_INT(Ok, btree_bulk_load(btree, &it, 80));
+    TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, true));
+    btree_destroy(btree);
+}
+
+void test_btree_underflow() {
+    BTSlotFormat formats[] = { WideSlots, CompactSlots };
+    int n = 3000;
+    u32 keys[n];
+
+    for (int f = 0; f < 2; f++) {
+        for (int i = 0; i < n; i++) {
+            keys[i] = i;
+        }
+        BTreeConfig config = { .alloc_policy = FirstFit, .slot_format = formats[f], .merge_threshold = 40 };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        srand(13);
+        shuffle(keys, n);
+        insert_btree_data(btree, keys, n, 0);
+        u32 full_leaves = count_leaves();
+
+        // delete 90% of keys in random order
+        shuffle(keys, n);
+        int deleted = n * 9 / 10;
+        for (int i = 0; i < deleted; i++) {
+            TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+        }
+        verify_btree_data(btree, keys + deleted, n - deleted, 0);
+        TEST_ASSERT_NULL(btree_get(btree, &keys[0], sizeof(u32)).data);
+        TEST_ASSERT_EQUAL_INT(n - deleted, scan_btree_data(btree, false));
+        TEST_ASSERT_EQUAL_INT(n - deleted, scan_btree_data(btree, true));
+
+        // pages were merged, none of them is left empty
+        TEST_ASSERT_TRUE(count_leaves() < full_leaves / 4);
+        for (u32 pid = 0; pid < page_counter; pid++) {
+            if (buffer[pid] != NULL && pid != btree->root_page_id && !is_freelist_trunk(btree, pid)) {
+                TEST_ASSERT_TRUE(buffer[pid]->hdr->cell_count > 0);
+            }
+        }
+
+        // tree collapses into empty root leaf
+        for (int i = deleted; i < n; i++) {
+            TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+        }
+        TEST_ASSERT_EQUAL_INT(1, count_pages(btree));
+        TEST_ASSERT_EQUAL_INT(1, buffer[btree->root_page_id]->hdr->is_leaf);
+        TEST_ASSERT_EQUAL_INT(0, scan_btree_data(btree, false));
+
+        // and grows again
+        insert_btree_data(btree, keys, n, 0);
+        verify_btree_data(btree, keys, n, 0);
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+}
+
+void test_btree_freelist() {
+    BTree* btree = btree_new(&compare_integers);
+    int n = 300;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    char data[1000];
+
+    // values take several overflow pages, so there are more
+    // free pages then a single trunk can list
+    u32 pages = 0;
+    for (int round = 0; round < 3; round++) {
+        srand(14 + round);
+        shuffle(keys, n);
+        for (int i = 0; i < n; i++) {
+            fill_large_data(data, keys[i] + round, sizeof(data));
+            TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &keys[i], sizeof(u32), data, sizeof(data)));
+        }
+        if (round == 0) {
+            pages = page_counter;
+        }
+        for (int i = 0; i < n; i++) {
+            fill_large_data(data, keys[i] + round, sizeof(data));
+            verify_stream(btree, keys[i], data, sizeof(data));
+        }
+
+        shuffle(keys, n);
+        for (int i = 0; i < n; i++) {
+            TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+        }
+        TEST_ASSERT_EQUAL_INT(1, count_pages(btree));
+        TEST_ASSERT_TRUE(btree_free_page_count(btree) > freelist_capacity(PAGE_SIZE));
+    }
+
+    // page space stays bounded
+    TEST_ASSERT_UINT_WITHIN(pages / 20, pages, page_counter);
+    btree_destroy(btree);
+}
+
+void test_btree_finger() {
+    int n = 3000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+
+    // ascending inserts mostly land in the last leaf
+    BTree* btree = btree_new(&compare_integers);
+    insert_btree_data(btree, keys, n, 0);
+    BTFinger* finger = &btree->finger;
+    TEST_ASSERT_TRUE(finger->hits > finger->misses);
+
+    // keys on fences go to the neighbouring leaves
+    BTPage* leaf = btree_seek_leaf(btree, &keys[n / 2], sizeof(u32));
+    TEST_ASSERT_TRUE(finger->has_low && finger->has_high);
+    u32 low = *(u32*)finger->low;
+    u32 high = *(u32*)finger->high;
+    TEST_ASSERT_EQUAL_INT(low, get_key(leaf, 0));
+    TEST_ASSERT_EQUAL_INT(high - 1, get_key(leaf, leaf->hdr->cell_count - 1));
+    u64 hits = finger->hits;
+    TEST_ASSERT_TRUE(btree_seek_leaf(btree, &high, sizeof(u32)) != leaf);
+    TEST_ASSERT_EQUAL_INT(hits, finger->hits);
+
+    // structure changes invalidate the finger
+    srand(16);
+    shuffle(keys, n);
+    for (int i = 0; i < n / 2; i++) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+        if (i % 7 == 0) {
+            verify_btree_data(btree, keys + i + 1, 10, 0);
+        }
+    }
+    verify_btree_data(btree, keys + n / 2, n - n / 2, 0);
+    insert_btree_data(btree, keys, n / 2, 0);
+    verify_btree_data(btree, keys, n, 0);
+    btree_destroy(btree);
+    reset_buffer();
+
+    // disabled finger is never used
+    BTreeConfig config = { .alloc_policy = FirstFit, .disable_finger = true };
+    btree = btree_new_with_config(&compare_integers, &config);
+    insert_btree_data(btree, keys, n, 0);
+    verify_btree_data(btree, keys, n, 0);
+    TEST_ASSERT_EQUAL_INT(0, btree->finger.hits + btree->finger.misses);
+    btree_destroy(btree);
+}
+
+void test_btree_multi_get() {
+    int n = 2000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+    BTree* btree = btree_new(&compare_integers);
+    srand(17);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 0);
+
+    char large[1000];
+    fill_large_data(large, 0, sizeof(large));
+    u32 large_key = 2 * n;
+    TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &large_key, sizeof(u32), large, sizeof(large)));
+
+    // random keys, every other one missing, some repeated
+    int batch = 500;
+    u32 batch_keys[batch];
+    Value in[batch];
+    Value out[batch];
+    for (int i = 0; i < batch; i++) {
+        batch_keys[i] = i % 50 == 0 ? large_key : (u32)(rand() % (2 * n));
+        in[i] = (Value) { .data = &batch_keys[i], .size = sizeof(u32) };
+    }
+    btree_multi_get(btree, in, batch, out);
+
+    for (int i = 0; i < batch; i++) {
+        Value expected = btree_get(btree, &batch_keys[i], sizeof(u32));
+        TEST_ASSERT_EQUAL_INT(expected.size, out[i].size);
+        TEST_ASSERT_EQUAL_PTR(expected.data, out[i].data);
+        TEST_ASSERT_EQUAL_INT(batch_keys[i] % 2 == 0, out[i].size > 0);
+    }
+
+    btree_multi_get(btree, in, 0, out);
+    btree_destroy(btree);
+}
+
+void test_btree_get_interleaved() {
+    int n = 2000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+    srand(19);
+    shuffle(keys, n);
+
+    // random keys, every other one missing
+    int batch = 500;
+    u32 batch_keys[batch];
+    Value in[batch];
+    Value out[batch];
+    for (int i = 0; i < batch; i++) {
+        batch_keys[i] = rand() % (2 * n);
+        in[i] = (Value) { .data = &batch_keys[i], .size = sizeof(u32) };
+    }
+
+    // pages with and without hints
+    u32 depths[] = { 1, 3, 16, BT_MAX_IN_FLIGHT };
+    for (int h = 0; h < 2; h++) {
+        BTreeConfig config = { .alloc_policy = FirstFit, .hint = h == 0 ? NULL : hint_integers };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        insert_btree_data(btree, keys, n, 0);
+
+        for (int d = 0; d < 4; d++) {
+            memset(out, 0xff, sizeof(out));
+            btree_get_interleaved(btree, in, batch, out, depths[d]);
+            for (int i = 0; i < batch; i++) {
+                Value expected = btree_get(btree, &batch_keys[i], sizeof(u32));
+                TEST_ASSERT_EQUAL_INT(expected.size, out[i].size);
+                TEST_ASSERT_EQUAL_PTR(expected.data, out[i].data);
+            }
+        }
+
+        // fewer keys than lookups in flight
+        btree_get_interleaved(btree, in, 2, out, 16);
+        TEST_ASSERT_EQUAL_PTR(btree_get(btree, &batch_keys[1], sizeof(u32)).data, out[1].data);
+        btree_destroy(btree);
+        reset_buffer();
+    }
+
+    // keys share long prefixes so most of them have the same hint
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_binary };
+    BTree* btree = btree_new_with_config(&binary_collation, &config);
+    char str_keys[batch][16];
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        int key_size = sprintf(key, "k%d/%04u", keys[i] % 3, keys[i]);
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, key, key_size, &keys[i], sizeof(u32)));
+    }
+    for (int i = 0; i < batch; i++) {
+        int key_size = sprintf(str_keys[i], "k%d/%04u", batch_keys[i] % 3, batch_keys[i]);
+        in[i] = (Value) { .data = str_keys[i], .size = key_size };
+    }
+    btree_get_interleaved(btree, in, batch, out, 8);
+    for (int i = 0; i < batch; i++) {
+        Value expected = btree_get(btree, in[i].data, in[i].size);
+        TEST_ASSERT_EQUAL_PTR(expected.data, out[i].data);
+        TEST_ASSERT_EQUAL_INT(batch_keys[i] % 2 == 0, out[i].data != NULL);
+    }
+    btree_destroy(btree);
+}
+
+void test_btree_write_batch() {
+    int n = 2000;
+    u32 keys[n];
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+    BTree* btree = btree_new(&compare_integers);
+    srand(18);
+    shuffle(keys, n);
+    insert_btree_data(btree, keys, n, 7);
+
+    // every even key is overwritten and odd keys are new,
+    // first 100 keys are given twice, the last value wins
+    int dups = 100;
+    int batch = 2 * n + dups;
+    u32* batch_keys = malloc(batch * sizeof(u32));
+    char* data = malloc(batch * MAX_PAYLOAD_SIZE);
+    Value* in_keys = malloc(batch * sizeof(Value));
+    Value* in_values = malloc(batch * sizeof(Value));
+    for (int i = 0; i < 2 * n; i++) {
+        batch_keys[dups + i] = i;
+    }
+    shuffle(batch_keys + dups, 2 * n);
+    memcpy(batch_keys, batch_keys + dups, dups * sizeof(u32));
+    for (int i = 0; i < batch; i++) {
+        int salt = i < dups ? 3 : 0;
+        int size = 2 + (batch_keys[i] + salt) % 20;
+        fill_data(data + i * MAX_PAYLOAD_SIZE, batch_keys[i] + salt, size);
+        in_keys[i] = (Value) { .data = &batch_keys[i], .size = sizeof(u32) };
+        in_values[i] = (Value) { .data = data + i * MAX_PAYLOAD_SIZE, .size = size };
+    }
+    TEST_ASSERT_EQUAL_INT(Ok, btree_write_batch(btree, in_keys, in_values, batch));
+    verify_btree_data(btree, batch_keys, batch, 0);
+    TEST_ASSERT_EQUAL_INT(2 * n, scan_btree_data(btree, false));
+    TEST_ASSERT_EQUAL_INT(2 * n, scan_btree_data(btree, true));
+
+    // overflown values are written and released on overwrite
+    char large[1000];
+    fill_large_data(large, 0, sizeof(large));
+    in_values[0] = (Value) { .data = large, .size = sizeof(large) };
+    TEST_ASSERT_EQUAL_INT(Ok, btree_write_batch(btree, in_keys, in_values, 1));
+    verify_stream(btree, batch_keys[0], large, sizeof(large));
+    u32 free_pages = btree_free_page_count(btree);
+    in_keys[1] = (Value) { .data = &batch_keys[0], .size = sizeof(u32) };
+    in_values[1] = (Value) { .data = "ab", .size = 3 };
+    TEST_ASSERT_EQUAL_INT(Ok, btree_write_batch(btree, in_keys, in_values, 2));
+    TEST_ASSERT_EQUAL_STRING("ab", btree_get(btree, &batch_keys[0], sizeof(u32)).data);
+    TEST_ASSERT_TRUE(btree_free_page_count(btree) > free_pages);
+
+    // too large key fails the whole batch
+    char large_key[MAX_PAYLOAD_SIZE];
+    in_keys[1] = (Value) { .data = large_key, .size = sizeof(large_key) };
+    TEST_ASSERT_EQUAL_INT(PayloadTooBig, btree_write_batch(btree, in_keys, in_values, 2));
+    TEST_ASSERT_EQUAL_STRING("ab", btree_get(btree, &batch_keys[0], sizeof(u32)).data);
+    btree_destroy(btree);
+    reset_buffer();
+
+    // empty root leaf is split into many pages at once
+    btree = btree_new(&compare_integers);
+    TEST_ASSERT_EQUAL_INT(Ok, btree_write_batch(btree, in_keys + dups, in_values + dups, 2 * n));
+    verify_btree_data(btree, batch_keys + dups, 2 * n, 0);
+    TEST_ASSERT_EQUAL_INT(2 * n, scan_btree_data(btree, false));
+    TEST_ASSERT_EQUAL_INT(2 * n, scan_btree_data(btree, true));
+
+    free(batch_keys);
+    free(data);
+    free(in_keys);
+    free(in_values);
+    btree_destroy(btree);
+}
+
+typedef struct ConcurrentWorker {
+    BTree* btree;
+    u32* keys;
+    int n;
+    int failures;
+} ConcurrentWorker;
+
+// Insert keys, every key inserted so far must be readable.
+void* concurrent_worker(void* arg) {
+    ConcurrentWorker* worker = arg;
+    char data[MAX_PAYLOAD_SIZE];
+    char read[MAX_PAYLOAD_SIZE];
+    u32 seed = worker->keys[0];
+    for (int i = 0; i < worker->n; i++) {
+        u32 key = worker->keys[i];
+        int size = 2 + key % 20;
+        fill_data(data, key, size);
+        if (btree_insert_concurrent(worker->btree, &key, sizeof(u32), data, size) != Ok) {
+            worker->failures++;
+        }
+
+        seed = seed * 1103515245 + 12345;
+        key = worker->keys[seed % (i + 1)];
+        size = 2 + key % 20;
+        fill_data(data, key, size);
+        u32 read_size;
+        int rc = btree_get_concurrent(worker->btree, &key, sizeof(u32), read, sizeof(read), &read_size);
+        if (rc != Ok || read_size != (u32)size || memcmp(read, data, size) != 0) {
+            worker->failures++;
+        }
+    }
+    return NULL;
+}
+
+void test_btree_concurrent() {
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .concurrent = true };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    TEST_ASSERT_FALSE(btree->finger.enabled);
+
+    int n = 20000;
+    u32* keys = malloc(n * sizeof(u32));
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(20);
+    shuffle(keys, n);
+
+    int threads = 4;
+    pthread_t tids[threads];
+    ConcurrentWorker workers[threads];
+    for (int t = 0; t < threads; t++) {
+        workers[t] = (ConcurrentWorker) { .btree = btree, .keys = keys + t * (n / threads), .n = n / threads };
+        pthread_create(&tids[t], NULL, concurrent_worker, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[t].failures);
+    }
+
+    verify_btree_data(btree, keys, n, 0);
+    TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, false));
+    TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, true));
+
+    // pages of every level are linked left to right, keys of
+    // a page are below its high key and the right page starts at it
+    BTPage* level = buffer[btree->root_page_id];
+    while (true) {
+        for (BTPage* page = level; page->right_pid != NO_PID; page = buffer[page->right_pid]) {
+            Value high = page_high_key(page);
+            Value last = page_key_at(page, page->hdr->cell_count - 1);
+            Value first = page_key_at(buffer[page->right_pid], 0);
+            TEST_ASSERT_NOT_NULL(high.data);
+            TEST_ASSERT_TRUE(compare_integers(last.data, last.size, high.data, high.size) < 0);
+            TEST_ASSERT_TRUE(compare_integers(first.data, first.size, high.data, high.size) >= 0);
+            if (page->hdr->is_leaf) {
+                TEST_ASSERT_EQUAL_UINT32(page->hdr->rightmost_pid, page->right_pid);
+            }
+        }
+        if (level->hdr->is_leaf) {
+            break;
+        }
+        level = buffer[page_child_at(level, 0)];
+    }
+
+    // missing key, small buffer and overflown value
+    u32 key = n;
+    char read[4];
+    u32 read_size;
+    TEST_ASSERT_EQUAL_INT(KeyNotFound, btree_get_concurrent(btree, &key, sizeof(u32), read, sizeof(read), &read_size));
+    key = 19;
+    TEST_ASSERT_EQUAL_INT(NotEnoughSpace, btree_get_concurrent(btree, &key, sizeof(u32), read, sizeof(read), &read_size));
+    TEST_ASSERT_EQUAL_INT(2 + 19 % 20, read_size);
+    char large[1000] = { 0 };
+    TEST_ASSERT_EQUAL_INT(PayloadTooBig, btree_insert_concurrent(btree, &key, sizeof(u32), large, sizeof(large)));
+    TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), large, sizeof(large)));
+    TEST_ASSERT_EQUAL_INT(PayloadTooBig, btree_get_concurrent(btree, &key, sizeof(u32), read, sizeof(read), &read_size));
+
+    free(keys);
+    btree_destroy(btree);
+}
+
+// Many threads start on a single leaf tree so that splits of the
+// root and of its new siblings run at the same time.
+void test_btree_concurrent_root_split() {
+    int threads = 8;
+    int per_thread = 48;
+    int n = threads * per_thread;
+    u32* keys = malloc(n * sizeof(u32));
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(21);
+
+    for (int round = 0; round < 100; round++) {
+        BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .concurrent = true };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        shuffle(keys, n);
+
+        pthread_t tids[threads];
+        ConcurrentWorker workers[threads];
+        for (int t = 0; t < threads; t++) {
+            workers[t] = (ConcurrentWorker) { .btree = btree, .keys = keys + t * per_thread, .n = per_thread };
+            pthread_create(&tids[t], NULL, concurrent_worker, &workers[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(tids[t], NULL);
+            TEST_ASSERT_EQUAL_INT(0, workers[t].failures);
+        }
+        verify_btree_data(btree, keys, n, 0);
+        TEST_ASSERT_EQUAL_INT(n, scan_btree_data(btree, false));
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+    free(keys);
+}
+
+// Entries under the page, internal cells must hold counts of their children.
+u32 verify_counts(BTPage* page) {
+    if (page->hdr->is_leaf) {
+        return page->hdr->cell_count;
+    }
+    u32 total = 0;
+    for (u16 i = 0; i <= page->hdr->cell_count; i++) {
+        u32 count = verify_counts(buffer[page_child_at(page, i)]);
+        TEST_ASSERT_EQUAL_UINT32(count, page_child_count(page, i));
+        total += count;
+    }
+    return total;
+}
+
+// Tree holds even keys 0, 2, .., 2 * (n - 1).
+void verify_order_statistics(BTree* btree, u32 n) {
+    TEST_ASSERT_EQUAL_UINT32(n, btree->count);
+    TEST_ASSERT_EQUAL_UINT32(n, verify_counts(buffer[btree->root_page_id]));
+    for (u32 i = 0; i < n; i++) {
+        u32 key = 2 * i;
+        u32 odd = key + 1;
+        TEST_ASSERT_EQUAL_UINT32(i, btree_rank(btree, &key, sizeof(u32)));
+        TEST_ASSERT_EQUAL_UINT32(i + 1, btree_rank(btree, &odd, sizeof(u32)));
+        Value selected = btree_select(btree, i);
+        TEST_ASSERT_EQUAL_UINT32(key, *(u32*)selected.data);
+    }
+    TEST_ASSERT_NULL(btree_select(btree, n).data);
+
+    u32 low = 11;
+    u32 high = 2 * n - 11;
+    TEST_ASSERT_EQUAL_UINT32(n - 11, btree_count_range(btree, &low, sizeof(u32), &high, sizeof(u32)));
+    TEST_ASSERT_EQUAL_UINT32(0, btree_count_range(btree, &high, sizeof(u32), &low, sizeof(u32)));
+    TEST_ASSERT_EQUAL_UINT32(6, btree_count_range(btree, NULL, 0, &low, sizeof(u32)));
+    TEST_ASSERT_EQUAL_UINT32(n, btree_count_range(btree, NULL, 0, NULL, 0));
+}
+
+void test_btree_order_statistics() {
+    int n = 4000;
+    u32* keys = malloc(2 * n * sizeof(u32));
+    for (int i = 0; i < 2 * n; i++) {
+        keys[i] = i;
+    }
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .counted = true };
+    BTree* btree = btree_new_with_config(&compare_integers, &config);
+    TEST_ASSERT_FALSE(btree->finger.enabled);
+
+    // all keys are inserted and odd ones are deleted again
+    srand(22);
+    shuffle(keys, 2 * n);
+    insert_btree_data(btree, keys, 2 * n, 0);
+    insert_btree_data(btree, keys, n, 0);
+    TEST_ASSERT_EQUAL_UINT32(2 * n, btree->count);
+    for (int i = 0; i < 2 * n; i++) {
+        if (keys[i] % 2 == 1) {
+            TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, &keys[i], sizeof(u32)));
+        }
+    }
+    u32 missing = 1;
+    TEST_ASSERT_EQUAL_INT(KeyNotFound, btree_delete(btree, &missing, sizeof(u32)));
+    verify_order_statistics(btree, n);
+
+    // batch delete of the upper half, write batch puts it back
+    BTDeleteBatch batch;
+    btree_delete_batch_begin(btree, &batch);
+    for (int i = n / 2; i < n; i++) {
+        u32 key = 2 * i;
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete_batch_add(&batch, &key, sizeof(u32)));
+    }
+    btree_delete_batch_commit(&batch);
+    verify_order_statistics(btree, n / 2);
+
+    Value* in_keys = malloc(n * sizeof(Value));
+    Value* in_values = malloc(n * sizeof(Value));
+    for (int i = 0; i < n; i++) {
+        keys[i] = 2 * i;
+        in_keys[i] = (Value) { .data = &keys[i], .size = sizeof(u32) };
+        in_values[i] = (Value) { .data = "value", .size = 6 };
+    }
+    shuffle(keys, n);
+    TEST_ASSERT_EQUAL_INT(Ok, btree_write_batch(btree, in_keys, in_values, n));
+    verify_order_statistics(btree, n);
+    btree_destroy(btree);
+    reset_buffer();
+
+    // bulk loaded tree
+    for (int i = 0; i < n; i++) {
+        keys[i] = 2 * i;
+    }
+    btree = btree_new_with_config(&compare_integers, &config);
+    BulkInput input = { .keys = keys, .n = n, .i = 0 };
+    BTBulkIterator it = { .next = bulk_input_next, .ctx = &input };
+    TEST_ASSERT_EQUAL_INT(Ok, btree_bulk_load(btree, &it, 80));
+    verify_order_statistics(btree, n);
+
+    free(keys);
+    free(in_keys);
+    free(in_values);
+    btree_destroy(btree);
+}
+
+// Tree must hold exactly keys of [0, n) that are not gone.
+void verify_range_deleted(BTree* btree, u32 n, const bool* gone) {
+    u32 expected = 0;
+    for (u32 key = 0; key < n; key++) {
+        Value value = btree_get(btree, &key, sizeof(u32));
+        if (gone[key]) {
+            TEST_ASSERT_NULL(value.data);
+            TEST_ASSERT_EQUAL_UINT32(0, value.size);
+        } else {
+            TEST_ASSERT_TRUE(value.data != NULL || value.size > MAX_PAYLOAD_SIZE);
+            expected++;
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(expected, scan_btree_data(btree, false));
+    TEST_ASSERT_EQUAL_INT(expected, scan_btree_data(btree, true));
+    if (btree->counted) {
+        TEST_ASSERT_EQUAL_UINT32(expected, btree->count);
+        TEST_ASSERT_EQUAL_UINT32(expected, verify_counts(buffer[btree->root_page_id]));
+    }
+}
+
+void test_btree_delete_range() {
+    int n = 6000;
+    u32* keys = malloc(n * sizeof(u32));
+    bool* gone = malloc(n * sizeof(bool));
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    srand(23);
+    shuffle(keys, n);
+
+    // bounds on existing and missing keys, open bounds (NULL)
+    // are marked with 0 and n
+    u32 ranges[][2] = { { 1000, 4000 }, { 999, 1000 }, { 4500, 4501 }, { 0, 10 }, { 5990, 6000 }, { 3000, 4200 } };
+    u32 deleted[] = { 3000, 1, 1, 10, 10, 200 };
+    for (int counted = 0; counted < 2; counted++) {
+        BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .counted = counted };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        insert_btree_data(btree, keys, n, 0);
+        memset(gone, 0, n * sizeof(bool));
+
+        // value in overflow pages goes with its key
+        char large[1000];
+        fill_large_data(large, 2000, sizeof(large));
+        u32 key = 2000;
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), large, sizeof(large)));
+        u32 free_pages = btree_free_page_count(btree);
+
+        for (int r = 0; r < 6; r++) {
+            u32 low = ranges[r][0];
+            u32 high = ranges[r][1];
+            u32 count = btree_delete_range(
+                btree, low > 0 ? &low : NULL, sizeof(u32), high < (u32)n ? &high : NULL, sizeof(u32));
+            TEST_ASSERT_EQUAL_UINT32(deleted[r], count);
+            for (u32 i = low; i < high; i++) {
+                gone[i] = true;
+            }
+            verify_range_deleted(btree, n, gone);
+        }
+        TEST_ASSERT_TRUE(btree_free_page_count(btree) > free_pages);
+        u32 low = 5000;
+        u32 high = 4000;
+        TEST_ASSERT_EQUAL_UINT32(0, btree_delete_range(btree, &low, sizeof(u32), &high, sizeof(u32)));
+
+        // freed pages are reused by inserts
+        free_pages = btree_free_page_count(btree);
+        insert_btree_data(btree, keys, n, 0);
+        TEST_ASSERT_TRUE(btree_free_page_count(btree) < free_pages);
+        verify_btree_data(btree, keys, n, 0);
+
+        // whole tree
+        TEST_ASSERT_EQUAL_UINT32(n, btree_delete_range(btree, NULL, 0, NULL, 0));
+        TEST_ASSERT_EQUAL_INT(1, buffer[btree->root_page_id]->hdr->is_leaf);
+        TEST_ASSERT_EQUAL_INT(0, scan_btree_data(btree, false));
+        insert_btree_data(btree, keys, n, 0);
+        verify_btree_data(btree, keys, n, 0);
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+    free(keys);
+    free(gone);
+}
+
+void test_btree_prefix_scan() {
+    int tenants = 20;
+    int per_tenant = 300;
+    int n = tenants * per_tenant;
+    u32* ids = malloc(n * sizeof(u32));
+    for (int i = 0; i < n; i++) {
+        ids[i] = i;
+    }
+    srand(24);
+    shuffle(ids, n);
+
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_binary };
+    BTree* btree = btree_new_with_config(&binary_collation, &config);
+    char key[16];
+    for (int i = 0; i < n; i++) {
+        int key_size = sprintf(key, "t%u/%05u", ids[i] / per_tenant, ids[i] % per_tenant);
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, key, key_size, &ids[i], sizeof(u32)));
+    }
+
+    // t1 also matches t10..t19, empty prefix matches every key
+    const char* prefixes[] = { "t7/", "t1", "t7/0001", "t19/00299", "", "t99", "u", "t0/00300" };
+    int expected[] = { per_tenant, 11 * per_tenant, 10, 1, n, 0, 0, 0 };
+    for (int p = 0; p < 8; p++) {
+        u32 prefix_size = strlen(prefixes[p]);
+        BTCursor cursor;
+        bool found = btree_prefix_scan(&cursor, btree, prefixes[p], prefix_size);
+        TEST_ASSERT_EQUAL_INT(expected[p] > 0, found);
+        int count = 0;
+        Value prev = { 0 };
+        while (btree_cursor_valid(&cursor)) {
+            Value k = btree_cursor_key(&cursor);
+            TEST_ASSERT_TRUE(k.size >= prefix_size && memcmp(k.data, prefixes[p], prefix_size) == 0);
+            TEST_ASSERT_TRUE(prev.data == NULL || binary_collation(prev.data, prev.size, k.data, k.size) < 0);
+            prev = k;
+            count++;
+            btree_cursor_next(&cursor);
+        }
+        TEST_ASSERT_EQUAL_INT(expected[p], count);
+        TEST_ASSERT_FALSE(btree_cursor_next(&cursor));
+        btree_cursor_close(&cursor);
+    }
+
+    // prefix with all its keys deleted
+    for (int i = 0; i < per_tenant; i++) {
+        int key_size = sprintf(key, "t1/%05u", i);
+        TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, key, key_size));
+    }
+    BTCursor cursor;
+    TEST_ASSERT_FALSE(btree_prefix_scan(&cursor, btree, "t1/", 3));
+    TEST_ASSERT_TRUE(btree_prefix_scan(&cursor, btree, "t1", 2));
+    TEST_ASSERT_EQUAL_MEMORY("t10/00000", btree_cursor_key(&cursor).data, 9);
+
+    // plain seek drops the prefix
+    btree_cursor_seek(&cursor, btree, "t7/", 3);
+    int count = 0;
+    while (btree_cursor_valid(&cursor)) {
+        count++;
+        btree_cursor_next(&cursor);
+    }
+    TEST_ASSERT_EQUAL_INT(3 * per_tenant, count);
+
+    btree_destroy(btree);
+    free(ids);
+}
+
+void test_btree_scan_token() {
+    int n = 3000;
+    u32* keys = malloc(n * sizeof(u32));
+    for (int i = 0; i < n; i++) {
+        keys[i] = i * 2;
+    }
+    srand(25);
+    shuffle(keys, n);
+    BTree* btree = btree_new(&compare_integers);
+    insert_btree_data(btree, keys, n, 0);
+
+    // pages of rows read through tokens, the second time tree is
+    // modified between pages: token key is deleted and keys after
+    // it are inserted, every other page enough of them to split leaves
+    int rows_per_page = 100;
+    for (int modify = 0; modify < 2; modify++) {
+        BTCursor cursor;
+        btree_cursor_seek(&cursor, btree, NULL, 0);
+        BTScanToken* token = NULL;
+        int rows = 0;
+        int inserted = 0;
+        int direct = 0;
+        u32 prev = 0;
+        while (true) {
+            if (token != NULL) {
+                if (modify) {
+                    TEST_ASSERT_EQUAL_INT(Ok, btree_delete(btree, token->key, token->key_size));
+                    int inserts = rows / rows_per_page % 2 == 0 ? 40 : 1;
+                    for (int i = 0; i < inserts; i++) {
+                        u32 key = *(u32*)token->key + 1 + 2 * i;
+                        inserted += btree_insert(btree, &key, sizeof(u32), "x", 1) == Ok;
+                    }
+                }
+                u64 seeks = btree->finger.hits + btree->finger.misses;
+                bool unchanged = buffer[token->pid]->hdr->version == token->version;
+                direct += unchanged;
+                if (!btree_cursor_resume(&cursor, btree, token)) {
+                    break;
+                }
+                // unchanged leaf is resumed without descent
+                TEST_ASSERT_TRUE(!unchanged || btree->finger.hits + btree->finger.misses == seeks);
+                free(token);
+                token = NULL;
+            }
+            for (int i = 0; i < rows_per_page && btree_cursor_valid(&cursor); i++) {
+                u32 key = *(u32*)btree_cursor_key(&cursor).data;
+                TEST_ASSERT_TRUE(rows == 0 || key > prev);
+                prev = key;
+                rows++;
+                if (i < rows_per_page - 1) {
+                    btree_cursor_next(&cursor);
+                }
+            }
+            if (!btree_cursor_valid(&cursor)) {
+                break;
+            }
+            token = btree_cursor_token(&cursor);
+            btree_cursor_close(&cursor);
+        }
+        free(token);
+
+        TEST_ASSERT_EQUAL_INT(n + inserted, rows);
+        TEST_ASSERT_TRUE(direct > 0);
+        if (modify) {
+            TEST_ASSERT_TRUE(inserted > n / rows_per_page);
+            TEST_ASSERT_TRUE(direct < n / rows_per_page);
+        } else {
+            TEST_ASSERT_EQUAL_INT(n / rows_per_page, direct);
+        }
+    }
+
+    // leaves after the token leaf are split, token leaf itself is
+    // untouched and is still resumed without descent
+    u32 token_key = n;
+    BTCursor cursor;
+    TEST_ASSERT_TRUE(btree_cursor_seek(&cursor, btree, &token_key, sizeof(u32)));
+    BTScanToken* token = btree_cursor_token(&cursor);
+    btree_cursor_close(&cursor);
+    u32 pages = page_counter;
+    for (u32 key = 4 * n; key < 5 * n; key++) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert(btree, &key, sizeof(u32), "x", 1));
+    }
+    TEST_ASSERT_TRUE(page_counter > pages);
+    TEST_ASSERT_EQUAL_INT(token->version, buffer[token->pid]->hdr->version);
+    u64 seeks = btree->finger.hits + btree->finger.misses;
+    TEST_ASSERT_TRUE(btree_cursor_resume(&cursor, btree, token));
+    TEST_ASSERT_EQUAL_INT(seeks, btree->finger.hits + btree->finger.misses);
+    TEST_ASSERT_EQUAL_INT(token->pid, cursor.page->hdr->pid);
+    int rows = 0;
+    u32 prev = *(u32*)token->key;
+    while (btree_cursor_valid(&cursor)) {
+        u32 key = *(u32*)btree_cursor_key(&cursor).data;
+        TEST_ASSERT_TRUE(key > prev);
+        prev = key;
+        rows++;
+        btree_cursor_next(&cursor);
+    }
+    TEST_ASSERT_EQUAL_INT(5 * n - 1, prev);
+    TEST_ASSERT_TRUE(rows > n);
+    free(token);
+    btree_destroy(btree);
+    reset_buffer();
+
+    // leaf of the token is split by concurrent insert, keys below
+    // the token key are added so the key moves to the new page
+    BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .concurrent = true };
+    btree = btree_new_with_config(&compare_integers, &config);
+    for (int i = 0; i < n; i++) {
+        u32 key = keys[i] * 50;
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert_concurrent(btree, &key, sizeof(u32), "x", 1));
+    }
+    token_key = n * 50;
+    TEST_ASSERT_TRUE(btree_cursor_seek(&cursor, btree, &token_key, sizeof(u32)));
+    token = btree_cursor_token(&cursor);
+    for (u32 key = token_key - 99; key < token_key; key++) {
+        TEST_ASSERT_EQUAL_INT(Ok, btree_insert_concurrent(btree, &key, sizeof(u32), "x", 1));
+    }
+    TEST_ASSERT_TRUE(buffer[token->pid]->hdr->version != token->version);
+    TEST_ASSERT_TRUE(btree_cursor_resume(&cursor, btree, token));
+    rows = 0;
+    prev = token_key;
+    while (btree_cursor_valid(&cursor)) {
+        u32 key = *(u32*)btree_cursor_key(&cursor).data;
+        TEST_ASSERT_TRUE(key > prev);
+        prev = key;
+        rows++;
+        btree_cursor_next(&cursor);
+    }
+    TEST_ASSERT_EQUAL_INT(n - n / 2 - 1, rows);
+    free(token);
+
+    btree_destroy(btree);
+    free(keys);
+}
+
+// Batch deleting most keys of the tree merges its leaves.
+void test_btree_delete_batch_rebalance() {
+    int n = 6000;
+    u32* keys = malloc(n * sizeof(u32));
+    u32* kept = malloc(n * sizeof(u32));
+    for (int c = 0; c < 2; c++) {
+        for (int i = 0; i < n; i++) {
+            keys[i] = i;
+        }
+        srand(13);
+        shuffle(keys, n);
+        BTreeConfig config = { .alloc_policy = FirstFit, .hint = hint_integers, .counted = c == 1 };
+        BTree* btree = btree_new_with_config(&compare_integers, &config);
+        insert_btree_data(btree, keys, n, 0);
+        TEST_ASSERT_EQUAL_INT(0, buffer[btree->root_page_id]->hdr->is_leaf);
+        u32 live_pages = page_counter - btree_free_page_count(btree);
+
+        // every tenth key is kept
+        int n_kept = 0;
+        BTDeleteBatch batch;
+        btree_delete_batch_begin(btree, &batch);
+        for (int i = 0; i < n; i++) {
+            if (keys[i] % 10 == 0) {
+                kept[n_kept++] = keys[i];
+            } else {
+                TEST_ASSERT_EQUAL_INT(Ok, btree_delete_batch_add(&batch, &keys[i], sizeof(u32)));
+            }
+        }
+        TEST_ASSERT_EQUAL_INT(n - n_kept, btree_delete_batch_commit(&batch));
+        TEST_ASSERT_TRUE((page_counter - btree_free_page_count(btree)) * 2 < live_pages);
+
+        BTPage* leaf = buffer[btree->root_page_id];
+        while (!leaf->hdr->is_leaf) {
+            leaf = buffer[page_child_at(leaf, 0)];
+        }
+        for (; leaf != NULL; leaf = leaf->hdr->rightmost_pid != NO_PID ? buffer[leaf->hdr->rightmost_pid] : NULL) {
+            TEST_ASSERT_TRUE(leaf->hdr->cell_count > 0);
+        }
+        verify_btree_data(btree, kept, n_kept, 0);
+        TEST_ASSERT_EQUAL_INT(n_kept, scan_btree_data(btree, false));
+        TEST_ASSERT_EQUAL_INT(n_kept, scan_btree_data(btree, true));
+        if (btree->counted) {
+            TEST_ASSERT_EQUAL_UINT32(n_kept, btree->count);
+            TEST_ASSERT_EQUAL_UINT32(n_kept, verify_counts(buffer[btree->root_page_id]));
+        }
+
+        btree_destroy(btree);
+        reset_buffer();
+    }
+    free(keys);
+    free(kept);
+}
 
 // - empty and there is enough space
 
@@ -473,6 +2142,37 @@ int main(void) {
     RUN_TEST(test_insert_case2);
     RUN_TEST(test_insert_case3);
     RUN_TEST(test_insert_case4);
+    RUN_TEST(test_defragment);
+    RUN_TEST(test_page_leaf_delete);
+    RUN_TEST(test_btree_insert_split);
+    RUN_TEST(test_btree_overwrite);
+    RUN_TEST(test_alloc_policy);
+    RUN_TEST(test_btree_alloc_policy);
+    RUN_TEST(test_btree_key_hints);
+    RUN_TEST(test_hint_order);
+    RUN_TEST(test_hint_lower_bound_kernels);
+    RUN_TEST(test_btree_overflow);
+    RUN_TEST(test_btree_page_size);
+    RUN_TEST(test_varint);
+    RUN_TEST(test_btree_compact_slots);
+    RUN_TEST(test_btree_delete);
+    RUN_TEST(test_btree_delete_batch);
+    RUN_TEST(test_btree_delete_batch_rebalance);
+    RUN_TEST(test_btree_bulk_load);
+    RUN_TEST(test_btree_cursor);
+    RUN_TEST(test_btree_cursor_prev);
+    RUN_TEST(test_btree_underflow);
+    RUN_TEST(test_btree_freelist);
+    RUN_TEST(test_btree_finger);
+    RUN_TEST(test_btree_multi_get);
+    RUN_TEST(test_btree_get_interleaved);
+    RUN_TEST(test_btree_write_batch);
+    RUN_TEST(test_btree_concurrent);
+    RUN_TEST(test_btree_concurrent_root_split);
+    RUN_TEST(test_btree_order_statistics);
+    RUN_TEST(test_btree_delete_range);
+    RUN_TEST(test_btree_prefix_scan);
+    RUN_TEST(test_btree_scan_token);
     return UNITY_END();
 }
 